@@ -0,0 +1,145 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Condition engine.
+ *
+ * Rules are evaluated by the instrument libraries for each sample, the
+ * callback is called from the same vameter_process() or counter_read() call
+ * that has produced the triggering sample. Every rule is compiled into set
+ * and clear window so the evaluation is just a few comparsions.
+ */
+
+#ifndef __LIBCOND_H__
+#define __LIBCOND_H__
+
+#include <stdint.h>
+
+enum cond_chan {
+	COND_VOLTAGE,       /* volts                                */
+	COND_CURRENT,       /* ampers                               */
+	COND_VOLTAGE_RANGE, /* 0 - 7 for 'A' - 'H'                  */
+	COND_CURRENT_RANGE, /* 4 * hw_switch + 0 - 3 for 'A' - 'D'  */
+	COND_FREQ,          /* hertz                                */
+	COND_FREQ_RANGE,    /* counter range character              */
+	COND_CHANNELS,
+};
+
+struct cond_rule {
+	/*
+	 * Rule is asserted when value is outside of the [set_lo, set_hi]
+	 * for count consecutive samples and released once it's inside of
+	 * [clr_lo, clr_hi].
+	 */
+	float set_lo;
+	float set_hi;
+	float clr_lo;
+	float clr_hi;
+
+	uint16_t count;
+	uint16_t cnt;
+	uint8_t  active;
+
+	/* window, drift waiting for the first value or changed */
+	uint8_t  type;
+	float    ppm;
+	float    hyst_ppm;
+
+	/*
+	 * Called when rule is asserted (active = 1) or released (active = 0).
+	 */
+	void (*fire)(struct cond_rule *self, float val, int active);
+	void *priv;
+
+	struct cond_rule *next;
+};
+
+struct cond_set {
+	struct cond_rule *rules[COND_CHANNELS];
+};
+
+/*
+ * Allocates empty rule set.
+ */
+struct cond_set  *cond_create(void);
+
+/*
+ * Frees rule set and all rules.
+ */
+void              cond_destroy(struct cond_set *self);
+
+/*
+ * Value > limit for count samples, released when value <= limit - hyst.
+ * Returns NULL and EINVAL if hyst is negative.
+ */
+struct cond_rule *cond_above(struct cond_set *self, enum cond_chan chan,
+                             float limit, float hyst, uint16_t count,
+                             void (*fire)(struct cond_rule *self, float val, int active),
+                             void *priv);
+
+/*
+ * Value < limit for count samples, released when value >= limit + hyst.
+ * Returns NULL and EINVAL if hyst is negative.
+ */
+struct cond_rule *cond_below(struct cond_set *self, enum cond_chan chan,
+                             float limit, float hyst, uint16_t count,
+                             void (*fire)(struct cond_rule *self, float val, int active),
+                             void *priv);
+
+/*
+ * Value outside of [lo, hi] for count samples, released when value is
+ * inside of [lo + hyst, hi - hyst]. Returns NULL and EINVAL if hyst is
+ * negative or greater than half of the window.
+ */
+struct cond_rule *cond_outside(struct cond_set *self, enum cond_chan chan,
+                               float lo, float hi, float hyst, uint16_t count,
+                               void (*fire)(struct cond_rule *self, float val, int active),
+                               void *priv);
+
+/*
+ * Value differs from ref more than ppm for count samples, released when it's
+ * within ppm - hyst_ppm. If ref is zero, first value is used. Returns NULL
+ * and EINVAL if hyst_ppm is negative or greater than ppm.
+ */
+struct cond_rule *cond_drift(struct cond_set *self, enum cond_chan chan,
+                             float ref, float ppm, float hyst_ppm, uint16_t count,
+                             void (*fire)(struct cond_rule *self, float val, int active),
+                             void *priv);
+
+/*
+ * Fires (with active = 1) everytime the value changes, useful for ranges.
+ */
+struct cond_rule *cond_changed(struct cond_set *self, enum cond_chan chan,
+                               void (*fire)(struct cond_rule *self, float val, int active),
+                               void *priv);
+
+/*
+ * Removes and frees the rule. May be called from the fire callback of the
+ * rule itself, but not for other rules of the channel being evaluated.
+ */
+void              cond_remove(struct cond_set *self, struct cond_rule *rule);
+
+/*
+ * Evaluates all rules for the channel, called by the instrument libraries.
+ */
+void              cond_eval(struct cond_set *self, enum cond_chan chan, float val);
+
+#endif /* __LIBCOND_H__ */
@@ -25,6 +25,10 @@
 #include <stdint.h>
 
 #include "libserial.h"
+#include "libcond.h"
+#include "libexporter.h"
+#include "libseqlock.h"
+#include "libshmring.h"
 
 enum counter_mode {
 	COUNTER_05SEC_PERIOD, /* 0.5 sec period on  */
@@ -32,6 +36,62 @@ enum counter_mode {
 	COUNTER_5SEC,         /* 5 sec period off */
 };
 
+struct counter_sample {
+	float val;
+	unsigned char range;
+	uint64_t t;              /* CLOCK_MONOTONIC ns of the last byte */
+};
+
+/*
+ * Latest measurement, see counter_get_snapshot().
+ */
+struct counter_snapshot {
+	uint64_t seq;            /* number of published measurements    */
+	uint64_t t;              /* CLOCK_MONOTONIC ns, 0 if none yet   */
+	float    val;
+	uint8_t  range;          /* range byte, 0 if not known          */
+	uint8_t  reserved[3];
+};
+
+struct counter;
+struct listener_walk;
+
+/*
+ * Callbacks with context, every callback gets the instance and the ctx
+ * pointer the ops were registered with. Unused callbacks may be NULL.
+ */
+struct counter_ops {
+	void (*measure)(struct counter *self, void *ctx, float val);
+	void (*range)(struct counter *self, void *ctx, unsigned char range);
+	void (*sample)(struct counter *self, void *ctx,
+	               const struct counter_sample *s);
+	/* command was written, err is zero or errno of the failed write */
+	void (*command_done)(struct counter *self, void *ctx, uint8_t cmd,
+	                     int err);
+};
+
+/*
+ * Registered ops and ctx, called in order of registration after the plain
+ * callbacks. The structure is owned by the caller.
+ */
+struct counter_listener {
+	const struct counter_ops *ops;
+	void *ctx;
+
+	struct counter_listener *next;
+};
+
+struct counter_stats {
+	uint64_t packets;          /* measurements received           */
+	uint64_t range_changes;
+	uint64_t resync;           /* bytes lost waiting for 0xC9     */
+	uint64_t invalid_range;    /* packets dropped for unknown range */
+	uint64_t callback_ns;      /* time spent in measure callbacks */
+
+	/* us between two measurements */
+	struct stats_hist interval;
+};
+
 struct counter {
 	struct libserial_port *port;
 	
@@ -41,6 +101,36 @@ struct counter {
 
 	void (*measure_ev)(float val);
 	void (*range_ev)(unsigned char range);
+
+	/* extended callback with timestamp, called after measure_ev */
+	void (*measure_sample)(struct counter *self, const struct counter_sample *s);
+
+	/* callbacks with context */
+	struct counter_listener *listeners;
+	struct listener_walk *walks;
+	struct counter_listener listener;
+
+	/* output of counter_process_samples(), NULL otherwise */
+	struct counter_sample *samples;
+	uint32_t nsamples;
+
+	/* condition rules for COND_FREQ and COND_FREQ_RANGE, may be NULL */
+	struct cond_set *cond;
+
+	/* exported metrics, NULL if not used */
+	struct exporter_counter *exporter;
+
+	/* shared memory ring for other processes, NULL if not used */
+	struct shmring *ring;
+
+	/* instrumentation counters, time of the last measurement */
+	struct counter_stats stats;
+	uint64_t t_last;
+
+	/* latest measurement, parser copy and the seqlock register */
+	struct counter_snapshot snap;
+	uint64_t snap_seq;
+	struct counter_snapshot snap_reg;
 };
 
 /*
@@ -49,6 +139,23 @@ struct counter {
 struct counter *counter_create(const char *port, void (*measure)(float),
                                void (*range)(unsigned char));
 
+/*
+ * Dtto but with ops and context instead of the plain callbacks.
+ */
+struct counter *counter_create_ctx(const char *port,
+                                   const struct counter_ops *ops, void *ctx);
+
+/*
+ * Attaches/detaches listener. Any listener may be detached from a callback
+ * and freed right away, the rest of the listeners is still called. Listener
+ * attached from a callback may be called for the current packet already.
+ */
+void            counter_listen(struct counter *counter,
+                               struct counter_listener *listener,
+                               const struct counter_ops *ops, void *ctx);
+void            counter_unlisten(struct counter *counter,
+                                 struct counter_listener *listener);
+
 /*
  * Unlock serial port, free memory.
  */
@@ -60,7 +167,50 @@ void            counter_destroy(struct counter *counter);
 void            counter_read(struct counter *counter);
 
 /*
- * Set measurment mode
+ * Parse data read by the application, t is CLOCK_MONOTONIC time in ns when
+ * the last byte has arrived.
+ */
+void            counter_process(struct counter *counter, const uint8_t *buf,
+                                uint32_t len, uint64_t t);
+
+/*
+ * Most measurements that can end in len bytes, a packet is eight bytes.
+ */
+#define COUNTER_SAMPLES_MAX(len) ((len) / 8 + 1)
+
+/*
+ * Dtto and stores the measurements into s, in order, so that the caller may
+ * handle them without callbacks. The s array must have room for
+ * COUNTER_SAMPLES_MAX(len) entries. Returns number of the entries.
+ */
+uint32_t        counter_process_samples(struct counter *counter,
+                                        const uint8_t *buf, uint32_t len,
+                                        uint64_t t, struct counter_sample *s);
+
+/*
+ * Copies counter stats, may be called from any thread.
+ */
+void            counter_get_stats(struct counter *counter,
+                                  struct counter_stats *stats);
+
+/*
+ * Offline decoding helpers. Counter_sync() returns position of the first
+ * packet start at or after pos, counter_seed() returns position before pos
+ * from which the parser has to run to know the range at pos.
+ */
+size_t          counter_sync(const uint8_t *buf, size_t len, size_t pos);
+size_t          counter_seed(const uint8_t *buf, size_t pos);
+
+/*
+ * Copies the latest measurement, may be called from any thread, it never
+ * blocks the parser.
+ */
+void            counter_get_snapshot(struct counter *counter,
+                                     struct counter_snapshot *snap);
+
+/*
+ * Set measurment mode. Commands are queued and written without blocking,
+ * see libserial_send(), the command_done op reports the result.
  */
 void            counter_mode(struct counter *counter, enum counter_mode mode);
 
@@ -71,4 +221,18 @@ void            counter_mode(struct counter *counter, enum counter_mode mode);
  */
 void            counter_trigger(struct counter *counter, int8_t trig);
 
+/*
+ * Export values into OpenMetrics exporter, NULL stops exporting. Returns -1
+ * if malloc has failed, -1 and EEXIST if the device is exported already.
+ */
+int             counter_export(struct counter *counter, struct exporter *exp);
+
+/*
+ * Publish measurements as struct counter_sample into shared memory ring
+ * name with slots records, NULL stops publishing. Readers attach with
+ * shmring_attach(name, SHMRING_COUNTER). Returns -1 and errno on failure.
+ */
+int             counter_publish(struct counter *counter, const char *name,
+                                uint32_t slots);
+
 #endif /* __LIBCOUNTER_H__ */
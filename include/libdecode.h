@@ -0,0 +1,95 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Parallel offline decoding of raw captures.
+ *
+ * The capture is mapped into memory and split into chunks at frame starts
+ * (VAmeter control bytes, counter packet starts). Each chunk is decoded by a
+ * fresh instance in a worker thread. The parser is first run silently over
+ * the last range and reference frames before the chunk, so the output is
+ * the same as from decoding the whole file at once. Records are
+ * passed to the emit callback in file order from the calling thread.
+ *
+ * Record times are offsets in the capture converted to ns at the port
+ * speed, as if bytes arrived back to back.
+ */
+
+#ifndef __LIBDECODE_H__
+#define __LIBDECODE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum decode_type {
+	DECODE_VAMETER,
+	DECODE_COUNTER,
+};
+
+enum decode_chan {
+	DECODE_VOLTAGE,
+	DECODE_CURRENT,
+	DECODE_FREQ,
+};
+
+struct decode_record {
+	uint64_t t;
+	float    val;              /* frame RMS or frequency    */
+	uint8_t  chan;             /* DECODE_VOLTAGE, ...       */
+	uint8_t  range;            /* range index or range byte */
+	uint8_t  flags;            /* VAMETER_PROVISIONAL, ...  */
+	char     acdc;             /* VAMETER_DC_POS, ..., 0    */
+};
+
+struct decode {
+	enum decode_type type;
+
+	/* worker threads, 0 for number of online CPUs */
+	unsigned int threads;
+
+	/* approximate chunk size in bytes */
+	size_t chunk_size;
+
+	/* VAmeter callibration file, NULL if not used */
+	const char *callib;
+
+	void (*emit)(struct decode *self, const struct decode_record *rec);
+	void *priv;
+
+	/* filled in by decode_file() */
+	unsigned int chunks;
+	uint64_t records;
+};
+
+/*
+ * Initalize decoder with defaults, one thread per CPU and 4MB chunks.
+ */
+void decode_init(struct decode *self, enum decode_type type,
+                 void (*emit)(struct decode *self,
+                              const struct decode_record *rec),
+                 void *priv);
+
+/*
+ * Decodes capture file. Returns zero, or -1 and errno on failure.
+ */
+int  decode_file(struct decode *self, const char *path);
+
+#endif /* __LIBDECODE_H__ */
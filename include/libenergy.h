@@ -0,0 +1,111 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Power and energy integration for VAmeter.
+ *
+ * Each current frame is paired with the preceding voltage frame, the power
+ * is integrated over the real frame timestamps. Totals are periodically
+ * written into a checkpoint file and loaded back on start so that long
+ * running measurements survive restarts.
+ */
+
+#ifndef __LIBENERGY_H__
+#define __LIBENERGY_H__
+
+#include <stdint.h>
+
+struct vameter_sample;
+
+struct vameter_energy {
+	/*
+	 * Live values.
+	 */
+	float    voltage;          /* voltage of the last pair, signed for DC */
+	float    current;          /* current of the last pair, signed for DC */
+	float    power;            /* W, apparent power for AC            */
+
+	/*
+	 * Totals.
+	 */
+	double   energy;           /* Wh                                  */
+	double   charge;           /* Ah                                  */
+	double   seconds;          /* integrated time                     */
+	uint64_t pairs;            /* integrated voltage/current pairs    */
+	uint32_t gaps;             /* pairs too far apart, not integrated */
+
+	/*
+	 * Integration state.
+	 */
+	uint64_t t_voltage;
+	uint8_t  voltage_ac;
+	uint8_t  has_pair;
+	uint64_t t_last;
+
+	/* maximal time between frames that is integrated */
+	uint64_t max_gap;
+
+	/*
+	 * Checkpoint file, NULL if not used.
+	 */
+	char    *checkpoint;
+	uint64_t period;
+	uint64_t t_checkpoint;
+	uint8_t  checkpoint_due;
+};
+
+/*
+ * Allocates integrator, loads totals from checkpoint file if it exists.
+ * Checkpoint may be NULL, period is in seconds.
+ */
+struct vameter_energy *energy_create(const char *checkpoint, unsigned int period);
+
+/*
+ * Writes final checkpoint and frees memory.
+ */
+void energy_destroy(struct vameter_energy *self);
+
+/*
+ * Feed voltage and current frames, called by libvameter.
+ */
+void energy_voltage(struct vameter_energy *self, const struct vameter_sample *s);
+void energy_current(struct vameter_energy *self, const struct vameter_sample *s);
+
+/*
+ * Writes totals into the checkpoint file now. Returns -1 on failure with
+ * errno set.
+ */
+int  energy_checkpoint(struct vameter_energy *self);
+
+/*
+ * Writes the checkpoint if the period has elapsed, must not be called from
+ * the parser callbacks. Called by vameter_read(), applications that parse
+ * data with vameter_process_ts() should call it after parsing. Returns -1
+ * on failure with errno set.
+ */
+int  energy_poll(struct vameter_energy *self);
+
+/*
+ * Zeroes totals.
+ */
+void energy_reset(struct vameter_energy *self);
+
+#endif /* __LIBENERGY_H__ */
@@ -0,0 +1,155 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Diagnostic event log.
+ *
+ * Libraries never print, instead they record structured events (code and
+ * two integer arguments) into a small per-instance ring. Events are rate
+ * limited by a token bucket and optionally passed to a sink callback set
+ * by the application. Events above the log level cost just one comparsion.
+ *
+ * Build the library with -DEVLOG_DISABLE to compile all events out.
+ */
+
+#ifndef __LIBEVLOG_H__
+#define __LIBEVLOG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EVLOG_RING 32
+
+enum evlog_level {
+	EVLOG_ERR,
+	EVLOG_WARN,
+	EVLOG_INFO,
+	EVLOG_DEBUG,
+};
+
+enum evlog_code {
+	EVLOG_READ_ERROR,          /* arg = errno                  */
+	EVLOG_WRITE_ERROR,         /* arg = errno, arg2 = command  */
+	EVLOG_VAMETER_UNKNOWN,     /* arg = command                */
+	EVLOG_VAMETER_VRANGE,      /* arg = invalid range byte     */
+	EVLOG_VAMETER_ARANGE,      /* arg = invalid range byte     */
+	EVLOG_COUNTER_LOST,        /* arg = byte                   */
+	EVLOG_COUNTER_RANGE,       /* arg = invalid range byte     */
+	EVLOG_COUNTER_MODE,        /* arg = invalid mode           */
+	EVLOG_GEN_LOST,            /* arg = byte                   */
+	EVLOG_GEN_ACK,
+	EVLOG_GEN_STATE_START,
+	EVLOG_GEN_STATE,           /* arg = wave, arg2 = freq word */
+	EVLOG_GEN_MEMORY,          /* arg = memory slot            */
+	EVLOG_GEN_FREQ,            /* arg = freq word              */
+	EVLOG_GEN_UNSUPPORTED,     /* arg = wave                   */
+	EVLOG_CODES,
+};
+
+struct evlog_event {
+	uint64_t t;                /* CLOCK_MONOTONIC ns             */
+	uint16_t code;             /* enum evlog_code                */
+	uint8_t  level;            /* enum evlog_level               */
+	uint32_t arg;
+	uint32_t arg2;
+	uint32_t suppressed;       /* events dropped before this one */
+};
+
+struct evlog {
+	/* events with level above are ignored */
+	uint8_t  level;
+
+	/* token bucket, rate events per second, up to burst at once */
+	uint32_t rate;
+	uint32_t burst;
+	uint64_t credit;           /* ns worth of tokens */
+	uint64_t t_last;
+
+	uint32_t suppressed;       /* since the last recorded event */
+	uint64_t dropped;          /* total                         */
+
+	/* ring, head counts all recorded events */
+	uint32_t head;
+	struct evlog_event ring[EVLOG_RING];
+
+	/* instance name used for formatting, i.e. device path */
+	const char *name;
+
+	void (*sink)(const struct evlog *self, const struct evlog_event *ev);
+	void *priv;
+};
+
+/*
+ * Initalize log, default level is EVLOG_INFO, rate 10 events per second
+ * and burst of 20 events.
+ */
+void evlog_init(struct evlog *self, const char *name);
+
+/*
+ * Set rate limit, rate = 0 disables rate limiting.
+ */
+void evlog_rate(struct evlog *self, uint32_t rate, uint32_t burst);
+
+/*
+ * Set sink called for each recorded event.
+ */
+void evlog_sink(struct evlog *self,
+                void (*sink)(const struct evlog *self, const struct evlog_event *ev),
+                void *priv);
+
+/*
+ * Records event, use EVLOG() instead.
+ */
+void evlog_emit(struct evlog *self, enum evlog_level level,
+                enum evlog_code code, uint32_t arg, uint32_t arg2);
+
+#ifdef EVLOG_DISABLE
+# define EVLOG(log, lvl, code, arg, arg2) do { \
+	(void)(log); (void)(arg); (void)(arg2); \
+} while (0)
+#else
+# define EVLOG(log, lvl, code, arg, arg2) do { \
+	if ((lvl) <= (log)->level)                        \
+		evlog_emit(log, lvl, code, arg, arg2);    \
+} while (0)
+#endif
+
+/*
+ * Reads next event, pos is reader position that starts at 0. When reader
+ * was overrun it skips to the oldest event in the ring. Returns 0 when
+ * there are no more events.
+ */
+int evlog_get(const struct evlog *self, uint32_t *pos, struct evlog_event *ev);
+
+/*
+ * Formats event as a line of text without newline.
+ */
+int evlog_format(const struct evlog *self, const struct evlog_event *ev,
+                 char *buf, size_t size);
+
+/*
+ * Sink that prints formatted events to stderr.
+ */
+void evlog_stderr(const struct evlog *self, const struct evlog_event *ev);
+
+const char *evlog_level_name(enum evlog_level level);
+
+#endif /* __LIBEVLOG_H__ */
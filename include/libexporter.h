@@ -0,0 +1,232 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * OpenMetrics exporter.
+ *
+ * Serves latest instrument values in OpenMetrics text format over HTTP on
+ * local TCP port or unix socket. Values are stored in series, setting a
+ * value only marks the exporter dirty, the complete HTTP response is
+ * rendered into a buffer on the first scrape after an update and then sent
+ * as it is to all following scrapes. All sockets are non-blocking, so the
+ * exporter can be polled from the acquisition loop.
+ */
+
+#ifndef __LIBEXPORTER_H__
+#define __LIBEXPORTER_H__
+
+#include <stdint.h>
+#include <poll.h>
+
+#define EXPORTER_CLIENTS 16
+
+/* clients that haven't finished the scrape in time are closed */
+#define EXPORTER_TIMEOUT_MS 5000
+
+enum exporter_type {
+	EXPORTER_GAUGE,
+	EXPORTER_COUNTER,
+};
+
+struct exporter_series {
+	char   *labels;            /* rendered labels, e.g. device="/dev/ttyUSB0" */
+	double  val;
+
+	struct exporter_family *family;
+	struct exporter_series *next;
+};
+
+struct exporter_family {
+	char               *name;
+	char               *help;
+	enum exporter_type  type;
+
+	struct exporter_series *series;
+	struct exporter_family *next;
+};
+
+/*
+ * Rendered response, refcounted as it may be still sent to clients when
+ * new one is rendered.
+ */
+struct exporter_buf {
+	unsigned int refs;
+	size_t       len;
+	size_t       size;
+	char         data[];
+};
+
+struct exporter_client {
+	int      fd;               /* -1 if slot is free            */
+	uint8_t  newlines;         /* end of request headers search */
+	size_t   pos;              /* bytes of the response sent    */
+	uint64_t deadline;         /* CLOCK_MONOTONIC ms            */
+
+	struct exporter_buf *buf;  /* NULL while reading request    */
+};
+
+struct exporter {
+	int   fd;                  /* listening socket           */
+	char *path;                /* unix socket path or NULL   */
+
+	uint8_t  dirty;
+	uint64_t scrapes;
+	uint64_t renders;
+
+	struct exporter_family *families;
+
+	/* last rendered response and body scratch buffer */
+	struct exporter_buf *buf;
+	char   *body;
+	size_t  body_size;
+
+	struct exporter_client clients[EXPORTER_CLIENTS];
+};
+
+/*
+ * Creates exporter listening on addr, which is either path to unix socket
+ * (contains '/') or TCP port number, TCP socket is bound to 127.0.0.1 only.
+ *
+ * Returns NULL on failure with errno set.
+ */
+struct exporter *exporter_create(const char *addr);
+
+/*
+ * Closes all sockets, removes unix socket, frees all families and series.
+ */
+void exporter_destroy(struct exporter *self);
+
+/*
+ * Returns series for metric name with labels, family and series are
+ * created if they don't exist yet. For counters the name is without
+ * the _total suffix. Returns NULL if malloc has failed.
+ */
+struct exporter_series *exporter_series(struct exporter *self,
+                                        const char *name,
+                                        enum exporter_type type,
+                                        const char *help,
+                                        const char *labels);
+
+/*
+ * Removes series, empty families are removed as well.
+ */
+void exporter_series_remove(struct exporter *self,
+                            struct exporter_series *series);
+
+/*
+ * Update value, only marks exporter dirty.
+ */
+void exporter_set(struct exporter *self, struct exporter_series *series,
+                  double val);
+
+/*
+ * Fills pollfd array with active clients and listening socket, the latter
+ * only if there is a free client slot. Returns number of filled entries, at
+ * most max.
+ */
+int  exporter_pollfds(struct exporter *self, struct pollfd *fds, int max);
+
+/*
+ * Returns ms until the first client times out, -1 if there are no clients.
+ * Should be used as poll() timeout together with exporter_pollfds().
+ */
+int  exporter_timeout(struct exporter *self);
+
+/*
+ * Accepts new connections, reads requests, sends responses and closes
+ * clients that have timed out. Never blocks, should be called when any of
+ * the exporter_pollfds() is ready or exporter_timeout() has expired.
+ */
+void exporter_poll(struct exporter *self);
+
+/*
+ * Serves exporter while waiting for fd to become readable. Returns 1 when
+ * fd is readable (or hung up), 0 otherwise.
+ */
+int  exporter_wait(struct exporter *self, int fd);
+
+/*
+ * Series for one VAmeter, updated by libvameter.
+ */
+struct vameter_sample;
+
+struct exporter_vameter {
+	struct exporter *exp;
+
+	struct exporter_series *voltage;
+	struct exporter_series *current;
+	struct exporter_series *voltage_range;
+	struct exporter_series *current_range;
+	struct exporter_series *voltage_ac;
+	struct exporter_series *current_ac;
+	struct exporter_series *voltage_frames;
+	struct exporter_series *current_frames;
+	struct exporter_series *errors;
+};
+
+/*
+ * Series are labeled with the device path. Returns NULL and EEXIST if the
+ * device is exported already.
+ */
+struct exporter_vameter *exporter_vameter_create(struct exporter *exp,
+                                                 const char *device);
+
+void exporter_vameter_destroy(struct exporter_vameter *self);
+
+void exporter_vameter_voltage(struct exporter_vameter *self,
+                              const struct vameter_sample *s);
+
+/* current range is exported as 4 * hw_switch + range */
+void exporter_vameter_current(struct exporter_vameter *self,
+                              const struct vameter_sample *s,
+                              uint8_t hw_switch);
+
+void exporter_vameter_errors(struct exporter_vameter *self, uint32_t errors);
+
+/*
+ * Series for one counter, updated by libcounter.
+ */
+struct counter_sample;
+
+struct exporter_counter {
+	struct exporter *exp;
+
+	struct exporter_series *freq;
+	struct exporter_series *range;
+	struct exporter_series *samples;
+	struct exporter_series *errors;
+};
+
+/*
+ * Series are labeled with the device path. Returns NULL and EEXIST if the
+ * device is exported already.
+ */
+struct exporter_counter *exporter_counter_create(struct exporter *exp,
+                                                 const char *device);
+
+void exporter_counter_destroy(struct exporter_counter *self);
+
+void exporter_counter_sample(struct exporter_counter *self,
+                             const struct counter_sample *s);
+
+void exporter_counter_errors(struct exporter_counter *self, uint32_t errors);
+
+#endif /* __LIBEXPORTER_H__ */
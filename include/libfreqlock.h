@@ -0,0 +1,103 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Software frequency lock loop.
+ *
+ * Generator output is measured by counter and the 24 bit generator frequency
+ * value is corrected until the measured frequency matches the target. Coarse
+ * steps are done with 0.5 sec gate, once the error is small enough the
+ * counter is switched to 5 sec gate for the fine lock.
+ */
+
+#ifndef __LIBFREQLOCK_H__
+#define __LIBFREQLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "libcounter.h"
+#include "libgenerator.h"
+
+struct freqlock {
+	struct counter   *counter;
+	struct generator *gen;
+
+	/*
+	 * Loop parameters.
+	 */
+	float target;            /* target frequency in Hz                  */
+	float gain;              /* loop bandwidth, fraction of correction
+	                            applied per reading, 0 < gain <= 1      */
+	float coarse_ppm;        /* switch to 5 sec gate below this error   */
+	float lock_ppm;          /* locked when error is below this         */
+	unsigned int lock_cnt;   /* consecutive readings needed for lock    */
+
+	/*
+	 * Loop state.
+	 */
+	uint32_t word;           /* current 24 bit frequency value          */
+	uint8_t  fine;           /* 5 sec gate is used                      */
+	uint8_t  skip;           /* readings to throw away                  */
+	uint8_t  locked;
+	unsigned int in_lock;
+	struct timespec start;
+
+	/* attached to the counter while freqlock_run() runs */
+	struct counter_listener listener;
+
+	/*
+	 * Results.
+	 */
+	unsigned int steps;      /* number of corrections                   */
+	float freq;              /* last measured frequency                 */
+	float error_ppm;         /* residual error of last reading          */
+	float lock_time;         /* seconds from start to lock              */
+};
+
+/*
+ * Initalize lock loop with default parameters.
+ */
+void freqlock_init(struct freqlock *self, struct counter *counter,
+                   struct generator *gen, float target);
+
+/*
+ * Sets coarse gate and initial generator frequency.
+ *
+ * Generator state must be loaded already, as the frequency value depends on
+ * the output wave. Returns -1 if frequency cannot be set for current wave.
+ */
+int freqlock_start(struct freqlock *self);
+
+/*
+ * Feed one counter reading into the loop. Useful when application handles
+ * counter reads itself, call it from the measure callback.
+ */
+void freqlock_feed(struct freqlock *self, float freq);
+
+/*
+ * Reads counter and generator until locked or timeout.
+ *
+ * Returns 0 when locked, -1 on timeout or error.
+ */
+int freqlock_run(struct freqlock *self, int timeout_ms);
+
+#endif /* __LIBFREQLOCK_H__ */
@@ -53,11 +53,28 @@ enum generator_filter {
 /* Null terminated array of strings */
 extern const char *generator_filter_names[];
 
+struct generator_stats {
+	uint64_t acks;             /* 0xd3 request successful      */
+	uint64_t states;           /* state packets parsed         */
+	uint64_t loaded;           /* memory loaded notifications  */
+	uint64_t resync;           /* unexpected bytes             */
+	uint64_t callback_ns;      /* time spent in update callback */
+};
+
 struct generator {
 	struct libserial_port *port;
 
 	void (*update)(struct generator *self);
 
+	/*
+	 * Optional, called once a command was written to the port, err is zero
+	 * or errno of the failed write.
+	 */
+	void (*command_done)(struct generator *self, uint8_t cmd, int err);
+
+	/* user context, not touched by the library */
+	void *ctx;
+
 	/* generator internal state */
 	enum generator_wave   wave;
 	enum generator_filter filter;
@@ -66,10 +83,16 @@ struct generator {
 	int32_t freq;
 	uint8_t mem;
 
+	/* last memory slot reported by 0x3X notification, -1 if none */
+	int8_t  loaded;
+
 	/* serial data buffer */
 	uint8_t data_flag;
 	uint8_t data_pos;
 	uint8_t data[10];
+
+	/* instrumentation counters */
+	struct generator_stats stats;
 };
 
 /*
@@ -91,6 +114,21 @@ void generator_destroy(struct generator *self);
  */
 void generator_read(struct generator *self);
 
+/*
+ * Parse data read by the application, i.e. from an event loop.
+ */
+void generator_process(struct generator *self, const uint8_t *buf, size_t len);
+
+/*
+ * Copies generator stats, may be called from any thread.
+ */
+void generator_get_stats(struct generator *self, struct generator_stats *stats);
+
+/*
+ * Commands below are queued and written without blocking, see
+ * libserial_send(). The command_done callback reports the result.
+ */
+
 /*
  * Generator can save up to 8 signals that can be later loaded.
  */
@@ -127,6 +165,13 @@ void generator_set_freq(struct generator *self, uint32_t freq);
  */
 void generator_set_freq_float(struct generator *self, float freq);
 
+/*
+ * Converts frequency in hertz to 24 bit value for current wave.
+ *
+ * Returns -1 if wave is unknown or frequency cannot be set for it.
+ */
+int generator_freq_word(struct generator *self, float freq, uint32_t *fval);
+
 /*
  * Tells generator to send it's state.
  */
@@ -149,4 +194,67 @@ float generator_convert_amplitude(struct generator *self);
  */
 float generator_convert_offset(struct generator *self);
 
+/*
+ * Preset manager.
+ *
+ * Maps named configurations to the eight generator memory slots. Presets are
+ * uploaded (full reconfiguration followed by SAVE) ahead of time and then
+ * switched with single byte LOAD. When all slots are taken, the least
+ * recently used one is overwritten.
+ */
+#define GENERATOR_SLOTS       8
+#define GENERATOR_PRESET_NAME 16
+
+struct generator_preset {
+	char name[GENERATOR_PRESET_NAME];
+
+	enum generator_wave   wave;
+	enum generator_filter filter;
+	uint8_t  amplitude;
+	uint8_t  offset;
+	uint32_t freq;
+};
+
+struct generator_presets {
+	struct generator *gen;
+
+	struct generator_preset slot[GENERATOR_SLOTS];
+	uint32_t last_use[GENERATOR_SLOTS]; /* 0 == slot is empty */
+	uint32_t clock;
+
+	/* slot that should be loaded in the generator, -1 if unknown */
+	int8_t active;
+};
+
+/*
+ * Initalize preset manager, all slots are considered empty.
+ */
+void generator_presets_init(struct generator_presets *self,
+                            struct generator *gen);
+
+/*
+ * Uploads preset into a memory slot unless it's there already.
+ *
+ * Returns slot number.
+ */
+int generator_preset_upload(struct generator_presets *self,
+                            const struct generator_preset *preset);
+
+/*
+ * Switches generator to the preset, uploads it first if it's not cached.
+ *
+ * Returns slot number.
+ */
+int generator_preset_switch(struct generator_presets *self,
+                            const struct generator_preset *preset);
+
+/*
+ * Reads generator data until the 0x3X notification for the active slot
+ * arrives, commands still queued in the port are written meanwhile.
+ *
+ * Returns 0 on success, -1 on timeout or error and -2 when generator reported
+ * different slot.
+ */
+int generator_preset_wait(struct generator_presets *self, int timeout_ms);
+
 #endif /* __LIBGENERATOR_H__ */
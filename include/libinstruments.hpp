@@ -0,0 +1,758 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * C++20 interface to the instrument libraries.
+ *
+ * Instruments are RAII handles that close the device on destruction, the
+ * measurements are awaited from coroutines:
+ *
+ * instruments::task<> sweep(instruments::vameter &meter,
+ *                           instruments::generator &gen)
+ * {
+ *	struct generator_preset p = {...};
+ *
+ *	co_await gen.apply(p);
+ *	co_await meter.executor().sleep(std::chrono::milliseconds(200));
+ *
+ *	struct vameter_sample s = co_await meter.next_voltage();
+ *	...
+ * }
+ *
+ * instruments::executor exec;
+ * instruments::vameter meter(exec, "/dev/ttyUSB0");
+ * instruments::generator gen(exec, "/dev/ttyUSB1");
+ *
+ * exec.spawn(sweep(meter, gen));
+ * exec.run();
+ *
+ * The executor is single threaded and runs on top of libioloop, coroutines
+ * are resumed from executor::run() after ioloop_run_once() has returned,
+ * never from the middle of the parser. Awaiting next_voltage() and alike
+ * returns the first frame that is parsed after the coroutine was suspended,
+ * frames parsed while nobody waits are only passed to the C callbacks.
+ *
+ * Parsing is specialised per instrument at compile time. The loop calls one
+ * process function per read, instantiated for the instrument class, which
+ * runs the C parser through vameter_process_events(),
+ * counter_process_samples() or generator_process() and passes the results
+ * to the instrument handlers by direct calls that inline. The awaiters are
+ * not reached through the C ops and update pointers, listeners registered
+ * on the C instrument are still called as usual.
+ *
+ * Errors are reported by std::system_error exceptions, an exception that
+ * leaves a spawned task is rethrown from executor::run().
+ *
+ * The executor has to be created before and destroyed after the instruments
+ * added to it.
+ */
+
+#ifndef __LIBINSTRUMENTS_HPP__
+#define __LIBINSTRUMENTS_HPP__
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <optional>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "libvameter.h"
+#include "libcounter.h"
+#include "libgenerator.h"
+#include "libioloop.h"
+}
+
+namespace instruments {
+
+static inline std::system_error errno_error(int err, const char *what)
+{
+	return std::system_error(err, std::generic_category(), what);
+}
+
+template<typename T = void> class task;
+
+namespace detail {
+
+struct promise_base {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	/* tasks are lazy, started when awaited or spawned */
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	/* resumes the awaiting coroutine, top level tasks stay suspended */
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+
+		template<typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			std::coroutine_handle<> c = h.promise().continuation;
+
+			return c ? c : std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	final_awaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception() noexcept
+	{
+		error = std::current_exception();
+	}
+};
+
+template<typename T>
+struct promise : promise_base {
+	std::optional<T> value;
+
+	task<T> get_return_object();
+
+	void return_value(T v) { value = std::move(v); }
+
+	T result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+
+		return std::move(*value);
+	}
+};
+
+template<>
+struct promise<void> : promise_base {
+	task<void> get_return_object();
+
+	void return_void() {}
+
+	void result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+} /* namespace detail */
+
+/*
+ * Coroutine returning T, awaiting it runs it to completion.
+ */
+template<typename T>
+class task {
+public:
+	typedef detail::promise<T> promise_type;
+	typedef std::coroutine_handle<promise_type> handle;
+
+	explicit task(handle h) : h_(h) {}
+	task(task &&t) noexcept : h_(std::exchange(t.h_, {})) {}
+	task(const task &) = delete;
+
+	task &operator=(task &&t) noexcept
+	{
+		if (this != &t) {
+			if (h_)
+				h_.destroy();
+			h_ = std::exchange(t.h_, {});
+		}
+
+		return *this;
+	}
+
+	~task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	bool done() const { return !h_ || h_.done(); }
+
+	bool await_ready() const noexcept { return done(); }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+	{
+		h_.promise().continuation = c;
+		return h_;
+	}
+
+	T await_resume() { return h_.promise().result(); }
+
+private:
+	friend class executor;
+
+	handle h_;
+};
+
+template<typename T>
+inline task<T> detail::promise<T>::get_return_object()
+{
+	return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::promise<void>::get_return_object()
+{
+	return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+/*
+ * Single threaded executor, waits for the instrument ports and timers.
+ */
+class executor {
+public:
+	explicit executor(unsigned int nports = 8,
+	                  enum ioloop_backend backend = IOLOOP_AUTO)
+		: loop_(ioloop_create(nports, backend))
+	{
+		if (loop_ == NULL)
+			throw errno_error(errno, "ioloop_create");
+	}
+
+	executor(const executor &) = delete;
+	executor &operator=(const executor &) = delete;
+
+	~executor()
+	{
+		/* suspended coroutines are destroyed with the tasks */
+		tasks_.clear();
+		ioloop_destroy(loop_);
+	}
+
+	/*
+	 * Takes ownership of a top level task, it's started from run().
+	 */
+	void spawn(task<void> t)
+	{
+		post(t.h_);
+		tasks_.push_back(std::move(t));
+	}
+
+	/*
+	 * Runs until all spawned tasks are finished or there is nothing left
+	 * that could resume them, i.e. no timers and all ports at end of file.
+	 */
+	void run()
+	{
+		for (;;) {
+			while (!ready_.empty()) {
+				std::coroutine_handle<> h = ready_.front();
+
+				ready_.pop_front();
+				h.resume();
+			}
+
+			reap();
+
+			if (tasks_.empty())
+				return;
+
+			int timeout = next_timeout();
+
+			if (timeout < 0 && !ioloop_active(loop_))
+				return;
+
+			if (ioloop_run_once(loop_, timeout) < 0)
+				throw errno_error(errno, "ioloop_run_once");
+
+			expire();
+		}
+	}
+
+	struct sleep_awaiter {
+		executor &exec;
+		uint64_t deadline;
+
+		bool await_ready() const noexcept
+		{
+			return deadline <= libserial_time();
+		}
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			exec.timers_.emplace(deadline, h);
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	sleep_awaiter sleep(std::chrono::nanoseconds d)
+	{
+		return sleep_awaiter{*this, libserial_time() + d.count()};
+	}
+
+	/*
+	 * Queues coroutine to be resumed from run().
+	 */
+	void post(std::coroutine_handle<> h) { ready_.push_back(h); }
+
+	void add(struct libserial_port *port, ioloop_process process, void *inst)
+	{
+		if (ioloop_add(loop_, port, process, inst))
+			throw errno_error(errno, "ioloop_add");
+	}
+
+	void remove(struct libserial_port *port)
+	{
+		ioloop_remove(loop_, port);
+	}
+
+	struct ioloop *loop() const { return loop_; }
+
+private:
+	void reap()
+	{
+		for (size_t i = 0; i < tasks_.size();) {
+			if (!tasks_[i].done()) {
+				i++;
+				continue;
+			}
+
+			task<void> t = std::move(tasks_[i]);
+
+			tasks_.erase(tasks_.begin() + i);
+			t.await_resume();
+		}
+	}
+
+	int next_timeout() const
+	{
+		if (!ready_.empty())
+			return 0;
+
+		if (timers_.empty())
+			return -1;
+
+		uint64_t now = libserial_time();
+		uint64_t deadline = timers_.begin()->first;
+
+		if (deadline <= now)
+			return 0;
+
+		/* rounded up, waking up early would only spin */
+		return (deadline - now + 999999) / 1000000;
+	}
+
+	void expire()
+	{
+		uint64_t now = libserial_time();
+
+		while (!timers_.empty() && timers_.begin()->first <= now) {
+			post(timers_.begin()->second);
+			timers_.erase(timers_.begin());
+		}
+	}
+
+	struct ioloop *loop_;
+
+	std::vector<task<void>> tasks_;
+	std::deque<std::coroutine_handle<>> ready_;
+	std::multimap<uint64_t, std::coroutine_handle<>> timers_;
+};
+
+/*
+ * Coroutines waiting for the next value of T.
+ */
+template<typename T>
+class waiters {
+public:
+	struct awaiter {
+		waiters &w;
+		std::coroutine_handle<> h;
+		T value;
+		int err;
+
+		explicit awaiter(waiters &w) : w(w), value(), err(0) {}
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			this->h = h;
+			w.list_.push_back(this);
+		}
+
+		T await_resume()
+		{
+			if (err)
+				throw errno_error(err, "instrument");
+
+			return value;
+		}
+	};
+
+	awaiter wait() { return awaiter(*this); }
+
+	bool empty() const { return list_.empty(); }
+
+	/* Passes the value to all waiting coroutines and schedules them. */
+	void wake(executor &exec, const T &value, int err = 0)
+	{
+		for (awaiter *a : list_) {
+			a->value = value;
+			a->err = err;
+			exec.post(a->h);
+		}
+
+		list_.clear();
+	}
+
+private:
+	std::vector<awaiter*> list_;
+};
+
+/*
+ * Per instrument open, close and parser. Parse() feeds the C parser and
+ * calls the handlers of H for the results, H is the instrument class so the
+ * calls are resolved at compile time.
+ */
+struct vameter_tag {};
+struct counter_tag {};
+struct generator_tag {};
+
+template<typename Tag> struct instrument_traits;
+
+template<>
+struct instrument_traits<vameter_tag> {
+	typedef struct VAmeter type;
+
+	static type *open(const char *dev) { return vameter_init(dev); }
+	static void close(type *self) { vameter_exit(self); }
+	static struct libserial_port *port(type *self) { return self->port; }
+
+	template<typename H>
+	static void parse(H &h, type *self, const uint8_t *buf, uint32_t len,
+	                  uint64_t t)
+	{
+		struct vameter_event ev[VAMETER_EVENTS_MAX(IOLOOP_RBUF)];
+		uint32_t off, n, i, cnt;
+
+		/* the loop passes at most IOLOOP_RBUF bytes at a time */
+		for (off = 0; off < len; off += n) {
+			n = std::min(len - off, (uint32_t)IOLOOP_RBUF);
+
+			cnt = vameter_process_events(self, buf + off, n,
+				libserial_byte_time(t, self->hot->char_ns,
+				                    off + n - 1, len), ev);
+
+			for (i = 0; i < cnt; i++) {
+				if (ev[i].chan == 'V')
+					h.voltage_frame(ev[i].s);
+				else
+					h.current_frame(ev[i].s);
+			}
+		}
+	}
+};
+
+template<>
+struct instrument_traits<counter_tag> {
+	typedef struct counter type;
+
+	static type *open(const char *dev)
+	{
+		return counter_create(dev, NULL, NULL);
+	}
+
+	static void close(type *self) { counter_destroy(self); }
+	static struct libserial_port *port(type *self) { return self->port; }
+
+	template<typename H>
+	static void parse(H &h, type *self, const uint8_t *buf, uint32_t len,
+	                  uint64_t t)
+	{
+		struct counter_sample s[COUNTER_SAMPLES_MAX(IOLOOP_RBUF)];
+		uint32_t off, n, i, cnt;
+
+		for (off = 0; off < len; off += n) {
+			n = std::min(len - off, (uint32_t)IOLOOP_RBUF);
+
+			cnt = counter_process_samples(self, buf + off, n,
+				libserial_byte_time(t, self->port->char_ns,
+				                    off + n - 1, len), s);
+
+			for (i = 0; i < cnt; i++)
+				h.sample(s[i]);
+		}
+	}
+};
+
+template<>
+struct instrument_traits<generator_tag> {
+	typedef struct generator type;
+
+	static type *open(const char *dev)
+	{
+		return generator_create(dev, NULL);
+	}
+
+	static void close(type *self) { generator_destroy(self); }
+	static struct libserial_port *port(type *self) { return self->port; }
+
+	/* the state is kept in the generator, a new one bumps the counter */
+	template<typename H>
+	static void parse(H &h, type *self, const uint8_t *buf, uint32_t len,
+	                  uint64_t)
+	{
+		uint64_t states = self->stats.states;
+
+		generator_process(self, buf, len);
+
+		if (self->stats.states != states)
+			h.state_update();
+	}
+};
+
+/*
+ * Owns the C instrument and keeps it added to the executor, Derived is the
+ * instrument class that handles the parser results.
+ */
+template<typename Tag, typename Derived>
+class device {
+public:
+	typedef instrument_traits<Tag> traits;
+	typedef typename traits::type c_type;
+
+	device(class executor &exec, const char *dev)
+		: exec_(exec), self_(traits::open(dev))
+	{
+		if (!self_)
+			throw errno_error(errno, dev);
+
+		exec_.add(traits::port(get()), &device::process, this);
+	}
+
+	/* callbacks hold pointer to this */
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	~device()
+	{
+		exec_.remove(traits::port(get()));
+	}
+
+	c_type *get() const { return self_.get(); }
+
+	class executor &executor() const { return exec_; }
+
+protected:
+	struct closer {
+		void operator()(c_type *self) const { traits::close(self); }
+	};
+
+	class executor &exec_;
+	std::unique_ptr<c_type, closer> self_;
+
+private:
+	/* the only indirect call, once per read */
+	static void process(void *inst, const uint8_t *buf, uint32_t len,
+	                    uint64_t t)
+	{
+		Derived &self = static_cast<Derived&>(*static_cast<device*>(inst));
+
+		traits::parse(self, self.get(), buf, len, t);
+	}
+};
+
+class vameter : public device<vameter_tag, vameter> {
+public:
+	vameter(class executor &exec, const char *dev)
+		: device(exec, dev) {}
+
+	waiters<struct vameter_sample>::awaiter next_voltage()
+	{
+		return voltage_.wait();
+	}
+
+	waiters<struct vameter_sample>::awaiter next_current()
+	{
+		return current_.wait();
+	}
+
+private:
+	friend struct instrument_traits<vameter_tag>;
+
+	void voltage_frame(const struct vameter_sample &s)
+	{
+		if (!voltage_.empty())
+			voltage_.wake(exec_, s);
+	}
+
+	void current_frame(const struct vameter_sample &s)
+	{
+		if (!current_.empty())
+			current_.wake(exec_, s);
+	}
+
+	waiters<struct vameter_sample> voltage_;
+	waiters<struct vameter_sample> current_;
+};
+
+class counter : public device<counter_tag, counter> {
+public:
+	counter(class executor &exec, const char *dev)
+		: device(exec, dev)
+	{
+		counter_listen(get(), &listener_, &ops, this);
+	}
+
+	~counter()
+	{
+		counter_unlisten(get(), &listener_);
+	}
+
+	/* Waits for the next measurement. */
+	waiters<struct counter_sample>::awaiter measure()
+	{
+		return sample_.wait();
+	}
+
+	/*
+	 * Commands are queued, a failed write is reported to the coroutines
+	 * waiting in measure().
+	 */
+	void mode(enum counter_mode mode) { counter_mode(get(), mode); }
+	void trigger(int8_t trig) { counter_trigger(get(), trig); }
+
+private:
+	friend struct instrument_traits<counter_tag>;
+
+	void sample(const struct counter_sample &s)
+	{
+		if (!sample_.empty())
+			sample_.wake(exec_, s);
+	}
+
+	/* writes complete outside of the parser, these stay callbacks */
+	static void command_done(::counter *, void *ctx, uint8_t, int err)
+	{
+		counter *self = static_cast<counter*>(ctx);
+
+		if (err)
+			self->sample_.wake(self->exec_, counter_sample(), err);
+	}
+
+	static constexpr struct counter_ops ops = {
+		.measure      = NULL,
+		.range        = NULL,
+		.sample       = NULL,
+		.command_done = command_done,
+	};
+
+	struct counter_listener listener_;
+
+	waiters<struct counter_sample> sample_;
+};
+
+class generator : public device<generator_tag, generator> {
+public:
+	generator(class executor &exec, const char *dev)
+		: device(exec, dev)
+	{
+		get()->ctx = this;
+		get()->command_done = command_done;
+	}
+
+	/*
+	 * Sends the whole preset and waits until the generator reports its
+	 * state back, the returned preset is the reported state.
+	 */
+	struct apply_awaiter : waiters<struct generator_preset>::awaiter {
+		::generator *gen;
+		struct generator_preset preset;
+
+		apply_awaiter(generator &g, const struct generator_preset &p)
+			: awaiter(g.state_), gen(g.get()), preset(p) {}
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			awaiter::await_suspend(h);
+
+			generator_set_wave(gen, preset.wave);
+			generator_set_filter(gen, preset.filter);
+			generator_set_amplitude(gen, preset.amplitude);
+			generator_set_offset(gen, preset.offset);
+			generator_set_freq(gen, preset.freq);
+			generator_load_state(gen);
+		}
+	};
+
+	apply_awaiter apply(const struct generator_preset &preset)
+	{
+		return apply_awaiter(*this, preset);
+	}
+
+	/* Requests and waits for the generator state. */
+	struct state_awaiter : waiters<struct generator_preset>::awaiter {
+		::generator *gen;
+
+		explicit state_awaiter(generator &g)
+			: awaiter(g.state_), gen(g.get()) {}
+
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			awaiter::await_suspend(h);
+			generator_load_state(gen);
+		}
+	};
+
+	state_awaiter state() { return state_awaiter(*this); }
+
+private:
+	friend struct instrument_traits<generator_tag>;
+
+	void state_update()
+	{
+		::generator *gen = get();
+		struct generator_preset p = {};
+
+		if (state_.empty())
+			return;
+
+		p.wave      = gen->wave;
+		p.filter    = gen->filter;
+		p.amplitude = gen->amplitude;
+		p.offset    = gen->offset;
+		p.freq      = gen->freq;
+
+		state_.wake(exec_, p);
+	}
+
+	static void command_done(::generator *gen, uint8_t, int err)
+	{
+		generator *self = static_cast<generator*>(gen->ctx);
+
+		if (err)
+			self->state_.wake(self->exec_, generator_preset(), err);
+	}
+
+	waiters<struct generator_preset> state_;
+};
+
+} /* namespace instruments */
+
+#endif /* __LIBINSTRUMENTS_HPP__ */
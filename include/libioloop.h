@@ -0,0 +1,156 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * I/O loop for several instruments.
+ *
+ * Reads from all added ports and feeds the data to the instrument parsers,
+ * the port outbound queues (see libserial_send()) are drained when the port
+ * is writable. On Linux the loop uses io_uring, reads are kept armed in the
+ * ring and re-armed in the same io_uring_enter() call that waits for the
+ * next completions, so that a read costs one syscall instead of a poll()
+ * and a read(). Commands sent to the ports are only queued and their writes
+ * are submitted in the same call as well. Where io_uring is not available
+ * the loop falls back to poll() and commands are written right away.
+ *
+ * The loop is single threaded, all callbacks are called from
+ * ioloop_run_once().
+ */
+
+#ifndef __LIBIOLOOP_H__
+#define __LIBIOLOOP_H__
+
+#include <stdint.h>
+
+#include "libserial.h"
+
+struct VAmeter;
+struct counter;
+struct generator;
+
+#define IOLOOP_RBUF 512
+
+enum ioloop_backend {
+	IOLOOP_AUTO,               /* io_uring if available, poll otherwise */
+	IOLOOP_POLL,
+	IOLOOP_URING,
+};
+
+/*
+ * Called with data read from the port, t is CLOCK_MONOTONIC time in ns
+ * when the read has completed.
+ */
+typedef void (*ioloop_process)(void *inst, const uint8_t *buf, uint32_t len,
+                               uint64_t t);
+
+struct ioloop_port {
+	struct libserial_port *port;
+
+	ioloop_process process;
+	void *inst;
+
+	/* read is submitted to the ring */
+	int armed;
+
+	/* end of file or read error, port is no longer read */
+	int done;
+
+	/* write of the outbound queue head is submitted to the ring */
+	int wflight;
+
+	/* port write() calls already counted in stats, poll backend */
+	uint64_t writes;
+
+	/* completions reaped from the ring, not yet dispatched */
+	uint8_t rready;
+	uint8_t wready;
+	int32_t rres;
+	int32_t wres;
+
+	uint8_t rbuf[IOLOOP_RBUF];
+};
+
+struct ioloop_stats {
+	uint64_t waits;            /* io_uring_enter() or poll() calls      */
+	uint64_t syscalls;         /* all syscalls including waits          */
+	uint64_t submitted;        /* requests submitted to the ring        */
+	uint64_t completions;      /* finished reads and writes             */
+};
+
+struct ioloop {
+	enum ioloop_backend backend;
+
+	unsigned int size;
+	unsigned int used;
+	unsigned int active;
+
+	struct ioloop_stats stats;
+
+	/* backend state */
+	void *priv;
+
+	struct ioloop_port ports[];
+};
+
+/*
+ * Creates loop for up to nports ports. IOLOOP_AUTO falls back to poll() if
+ * io_uring cannot be set up. Returns NULL and sets errno on failure.
+ */
+struct ioloop *ioloop_create(unsigned int nports, enum ioloop_backend backend);
+
+void ioloop_destroy(struct ioloop *self);
+
+/*
+ * Adds port to the loop, process is called with the data read. Returns
+ * zero, or -1 and ENOSPC when the loop is full.
+ */
+int ioloop_add(struct ioloop *self, struct libserial_port *port,
+               ioloop_process process, void *inst);
+
+/*
+ * Stops reading and writing the port, must be called before the port is
+ * closed. With io_uring the read and write in flight are cancelled and
+ * waited for, a write that was cancelled is lost. Returns zero, or -1 and
+ * ENOENT when the port is not in the loop.
+ */
+int ioloop_remove(struct ioloop *self, struct libserial_port *port);
+
+int ioloop_add_vameter(struct ioloop *self, struct VAmeter *meter);
+int ioloop_add_counter(struct ioloop *self, struct counter *counter);
+int ioloop_add_generator(struct ioloop *self, struct generator *gen);
+
+/*
+ * Waits up to timeout_ms (-1 forever) for data and dispatches it. Returns
+ * number of completed reads and writes, or -1 and errno on failure.
+ */
+int ioloop_run_once(struct ioloop *self, int timeout_ms);
+
+/*
+ * Number of ports that are still read, i.e. didn't reach end of file.
+ */
+static inline unsigned int ioloop_active(struct ioloop *self)
+{
+	return self->active;
+}
+
+const char *ioloop_backend_name(struct ioloop *self);
+
+#endif /* __LIBIOLOOP_H__ */
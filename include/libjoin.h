@@ -0,0 +1,105 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Time alignment of channels from one or more instruments.
+ *
+ * Values are pushed with their timestamps (see struct vameter_sample and
+ * struct counter_sample) and combined records, for example {t, V, I, f},
+ * are emitted according to the policy. Buffering is bounded, each channel
+ * keeps last JOIN_DEPTH values.
+ */
+
+#ifndef __LIBJOIN_H__
+#define __LIBJOIN_H__
+
+#include <stdint.h>
+
+#define JOIN_MAX_CHANNELS 8
+#define JOIN_DEPTH        16
+
+enum join_policy {
+	/* record with latest values is emitted on every push */
+	JOIN_LATEST,
+	/*
+	 * Channel 0 drives the timeline, record is emitted once all other
+	 * channels have value at or after its time, values are linearly
+	 * interpolated.
+	 */
+	JOIN_INTERPOLATE,
+	/* record is emitted once every channel has a new value */
+	JOIN_WAIT_ALL,
+};
+
+struct join_record {
+	uint64_t t;
+	uint32_t valid;                  /* bitmask of channels with value */
+	float    val[JOIN_MAX_CHANNELS];
+};
+
+struct join_ring {
+	uint64_t t[JOIN_DEPTH];
+	float    val[JOIN_DEPTH];
+	uint8_t  head;
+	uint8_t  cnt;
+};
+
+struct join {
+	enum join_policy policy;
+	unsigned int channels;
+
+	/* channels updated since last record (JOIN_WAIT_ALL) */
+	uint32_t fresh;
+
+	struct join_ring chan[JOIN_MAX_CHANNELS];
+
+	/* channel 0 values waiting for the others (JOIN_INTERPOLATE) */
+	struct join_ring pending;
+
+	/* values overwritten or emitted without all channels */
+	uint32_t dropped;
+
+	void (*emit)(struct join *self, const struct join_record *rec);
+	void *priv;
+};
+
+/*
+ * Initalize join for channels (at most JOIN_MAX_CHANNELS).
+ *
+ * Returns -1 if there are too many channels.
+ */
+int  join_init(struct join *self, unsigned int channels,
+               enum join_policy policy,
+               void (*emit)(struct join *self, const struct join_record *rec),
+               void *priv);
+
+/*
+ * Adds value for channel, t is CLOCK_MONOTONIC time in ns. Values for each
+ * channel must be pushed in time order.
+ */
+void join_push(struct join *self, unsigned int chan, uint64_t t, float val);
+
+/*
+ * Emits all pending records (JOIN_INTERPOLATE) with values that are known.
+ */
+void join_flush(struct join *self);
+
+#endif /* __LIBJOIN_H__ */
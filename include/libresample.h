@@ -0,0 +1,133 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Fixed rate resampling and decimation.
+ *
+ * Values are pushed with their timestamps and one record per channel set is
+ * emitted for every period long interval. Each channel aggregates the values
+ * that fell into the interval, min, max and count are always filled in and
+ * val holds the selected aggregation. Intervals are aligned to multiples of
+ * the period on the CLOCK_MONOTONIC timeline and channels with no value in
+ * an interval are flagged in the gap bitmask.
+ *
+ * Accumulators are updated incrementally, nothing is buffered. Because
+ * channels from different instruments don't arrive in strict time order an
+ * interval is closed only when a value at least hold ns past its end
+ * arrives, values older than that are dropped and counted as late.
+ */
+
+#ifndef __LIBRESAMPLE_H__
+#define __LIBRESAMPLE_H__
+
+#include <stdint.h>
+
+#define RESAMPLE_MAX_CHANNELS 8
+
+enum resample_agg {
+	RESAMPLE_MEAN,
+	RESAMPLE_LAST,
+	RESAMPLE_MIN,
+	RESAMPLE_MAX,
+	RESAMPLE_RMS,
+	RESAMPLE_COUNT,
+};
+
+struct resample_value {
+	float    val;              /* selected aggregation, NAN for gap */
+	float    min;
+	float    max;
+	uint32_t cnt;              /* number of values in the interval  */
+};
+
+struct resample_record {
+	uint64_t t;                /* start of the interval             */
+	uint32_t gap;              /* bitmask of channels without value */
+	struct resample_value chan[RESAMPLE_MAX_CHANNELS];
+};
+
+struct resample_acc {
+	double   sum;
+	double   sumsq;
+	float    min;
+	float    max;
+	float    last;
+	uint32_t cnt;
+};
+
+struct resample {
+	uint64_t period;
+	uint64_t hold;
+
+	/* start of the current interval, 0 until first value */
+	uint64_t start;
+
+	unsigned int channels;
+	enum resample_agg agg[RESAMPLE_MAX_CHANNELS];
+
+	/* current and next interval */
+	struct resample_acc acc[2][RESAMPLE_MAX_CHANNELS];
+	unsigned int cur;
+
+	/* values older than the current interval */
+	uint32_t late;
+
+	void (*emit)(struct resample *self, const struct resample_record *rec);
+	void *priv;
+};
+
+/*
+ * Initalize resampler for channels (at most RESAMPLE_MAX_CHANNELS) with
+ * period and hold in ns, hold must not be longer than the period. All
+ * channels aggregate RESAMPLE_MEAN.
+ *
+ * Returns -1 on invalid parameters.
+ */
+int  resample_init(struct resample *self, unsigned int channels,
+                   uint64_t period, uint64_t hold,
+                   void (*emit)(struct resample *self,
+                                const struct resample_record *rec),
+                   void *priv);
+
+/*
+ * Sets aggregation for channel, returns -1 if there is no such channel.
+ */
+int  resample_agg(struct resample *self, unsigned int chan,
+                  enum resample_agg agg);
+
+/*
+ * Adds value for channel, t is CLOCK_MONOTONIC time in ns.
+ */
+void resample_push(struct resample *self, unsigned int chan, uint64_t t,
+                   float val);
+
+/*
+ * Emits intervals that ended more than hold ns before now, call it
+ * periodically to get gap records while no data arrive.
+ */
+void resample_advance(struct resample *self, uint64_t now);
+
+/*
+ * Emits the open intervals that have any values.
+ */
+void resample_flush(struct resample *self);
+
+#endif /* __LIBRESAMPLE_H__ */
@@ -0,0 +1,59 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Seqlock protected registers.
+ *
+ * A register holds the latest value published by a single writer, any
+ * number of readers may copy it at any time from any thread. The writer
+ * never waits for the readers, a reader retries only when its copy raced
+ * with an update. The sequence is odd while an update is in progress.
+ *
+ * Register values must consist of whole uint64_t words, the copy is done
+ * word by word with relaxed atomics so that there are no data races.
+ */
+
+#ifndef __LIBSEQLOCK_H__
+#define __LIBSEQLOCK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Publishes size bytes of val into the register reg, may be called only
+ * from the writer thread.
+ */
+void seqlock_write(uint64_t *seq, void *reg, const void *val, size_t size);
+
+/*
+ * Copies the register into val, returns number of updates published so far.
+ */
+uint64_t seqlock_read(const uint64_t *seq, void *val, const void *reg,
+                      size_t size);
+
+/*
+ * Single attempt, returns zero and number of updates, or -1 if the copy
+ * raced with the writer.
+ */
+int seqlock_read_try(const uint64_t *seq, void *val, const void *reg,
+                     size_t size, uint64_t *updates);
+
+#endif /* __LIBSEQLOCK_H__ */
@@ -25,10 +25,99 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <termios.h>
+#include <stdint.h>
+
+#include "libstats.h"
+#include "libevlog.h"
+
+struct libserial_stats {
+	uint64_t reads;            /* read() calls                  */
+	uint64_t bytes;            /* bytes read                    */
+	uint64_t errors;           /* failed reads, except EAGAIN   */
+	uint64_t again;            /* reads that returned EAGAIN    */
+
+	uint64_t writes;           /* write() calls                 */
+	uint64_t written;          /* bytes written                 */
+	uint64_t write_again;      /* writes that returned EAGAIN   */
+	uint64_t write_errors;     /* failed writes, except EAGAIN  */
+
+	struct stats_hist read_bytes; /* bytes per successful read  */
+};
+
+#define LIBSERIAL_OUTQ 256
+#define LIBSERIAL_CMDS 16
+
+struct libserial_port;
+
+/*
+ * Command completion, err is zero when the command was written, errno
+ * otherwise.
+ */
+typedef void (*libserial_done)(struct libserial_port *port, void *priv,
+                               uint8_t cmd, int err);
+
+struct libserial_cmd {
+	uint32_t end;              /* queue position after the last byte */
+	uint8_t cmd;               /* first byte, for diagnostics        */
+	libserial_done done;
+	void *priv;
+};
+
+/*
+ * Outbound command queue. Positions are free running, the queue holds
+ * tail - head bytes. The queue is not thread safe, commands have to be
+ * queued from the thread that reads the port.
+ */
+struct libserial_outq {
+	uint32_t head;
+	uint32_t tail;
+
+	/* write of the head is in flight in an asynchronous I/O loop */
+	int busy;
+
+	/*
+	 * Writes are submitted by an asynchronous I/O loop, libserial_send()
+	 * and libserial_flush() only queue.
+	 */
+	int async;
+
+	uint32_t cmd_head;
+	uint32_t cmd_tail;
+	struct libserial_cmd cmds[LIBSERIAL_CMDS];
+
+	uint8_t buf[LIBSERIAL_OUTQ];
+};
 
 struct libserial_port {
 	int fd;
 	struct stat st;
+
+	/*
+	 * Non-blocking descriptor for the outbound queue. For serial ports it's
+	 * a separate open of the device so that reads on fd may still block,
+	 * for files it's fd.
+	 */
+	int wfd;
+	struct libserial_outq outq;
+
+	/*
+	 * USB serial adapter latency timer in ms as read back from sysfs, -1 if
+	 * the adapter doesn't have one.
+	 */
+	int latency_timer;
+
+	/* ASYNC_LOW_LATENCY was set */
+	int low_latency;
+
+	/* time to transfer one character (10 bits) in ns */
+	uint32_t char_ns;
+
+	/* updated by libserial_read() */
+	struct libserial_stats stats;
+
+	/* diagnostic events of the port and the instrument */
+	struct evlog log;
+
 	char dev[];
 };
 
@@ -45,6 +134,10 @@ struct libserial_port {
  *
  * You can also pass file instead of serial port as a dev. In this case
  * baudrate is ignored and also no serial port locking is done.
+ *
+ * For serial ports the USB adapter latency timer is lowered, when available,
+ * and ASYNC_LOW_LATENCY is set. The results are stored in the latency_timer
+ * and low_latency fields.
  */
 struct libserial_port *libserial_open(const char *dev, tcflag_t baudrate);
 
@@ -53,4 +146,81 @@ struct libserial_port *libserial_open(const char *dev, tcflag_t baudrate);
  */
 void libserial_close(struct libserial_port *port);
 
+/*
+ * Reads data from the port, time of the read is stored into t, that is the
+ * arrival time of the last byte in the buffer. Returns same as read().
+ */
+ssize_t libserial_read(struct libserial_port *port, void *buf, size_t len,
+                       uint64_t *t);
+
+/*
+ * Queues command and tries to write it without blocking, what is left is
+ * written by later libserial_flush() calls. When the port is in an io_uring
+ * loop the command is only queued and the loop submits the write together
+ * with the reads in its next io_uring_enter(). The done callback, which may
+ * be NULL, is called once the last byte was written or the command failed,
+ * possibly before this function returns.
+ *
+ * Returns zero, or -1 and errno set to ENOSPC when the queue is full, the
+ * done callback is called in that case too.
+ */
+int libserial_send(struct libserial_port *port, const void *buf, uint32_t len,
+                   libserial_done done, void *priv);
+
+/*
+ * Writes as much of the queue as possible without blocking, does nothing
+ * for ports in an io_uring loop. Returns number of bytes still queued, or -1
+ * on write error, queued commands are failed in that case. Called from
+ * libserial_read() as well, applications that don't read constantly should
+ * poll fd for POLLOUT while libserial_pending() is non-zero.
+ */
+int libserial_flush(struct libserial_port *port);
+
+static inline uint32_t libserial_pending(struct libserial_port *port)
+{
+	return port->outq.tail - port->outq.head;
+}
+
+/*
+ * Interface for asynchronous I/O loops. Libserial_out_buf() returns the
+ * continuous part of the queue head and marks the queue busy,
+ * libserial_out_done() completes it with ret and err as returned by
+ * write().
+ */
+uint32_t libserial_out_buf(struct libserial_port *port, const uint8_t **buf);
+void libserial_out_done(struct libserial_port *port, ssize_t ret, int err);
+
+/*
+ * Updates port stats for a read done outside of libserial_read(), i.e. an
+ * asynchronous one. Ret is what read() would return and err its errno.
+ */
+void libserial_account(struct libserial_port *port, ssize_t ret, int err);
+
+/*
+ * Copies port stats, may be called from any thread.
+ */
+void libserial_get_stats(struct libserial_port *port,
+                         struct libserial_stats *stats);
+
+/*
+ * Returns CLOCK_MONOTONIC time in ns.
+ */
+uint64_t libserial_time(void);
+
+/*
+ * Time of n-th byte of the buffer of len bytes which was read at time t.
+ * Bytes are assumed to arrive back to back at the port speed.
+ */
+static inline uint64_t libserial_byte_time(uint64_t t, uint32_t char_ns,
+                                           uint32_t n, uint32_t len)
+{
+	return t - (uint64_t)(len - 1 - n) * char_ns;
+}
+
+/*
+ * Sets sysfs mount point used to look up the adapter latency timer, default
+ * is "/sys". The string is not copied.
+ */
+void libserial_sysfs_root(const char *root);
+
 #endif /* __LIBSERIAL_H__ */
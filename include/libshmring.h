@@ -0,0 +1,111 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Shared memory ring of records.
+ *
+ * One process publishes fixed size records into a POSIX shared memory
+ * object, any number of processes attach read only and follow it, each
+ * with its own cursor. The writer never waits for the readers and doesn't
+ * know about them, a reader that falls more than the ring size behind
+ * loses the oldest records and the loss is counted.
+ *
+ * Every slot is a seqlock register, the number of its updates tells the
+ * reader whether it still holds the record at the cursor.
+ */
+
+#ifndef __LIBSHMRING_H__
+#define __LIBSHMRING_H__
+
+#include <stdint.h>
+
+#define SHMRING_MAGIC   0x52696e67
+#define SHMRING_VERSION 1
+
+/*
+ * Record kinds published by the libraries, see struct vameter_record and
+ * struct counter_sample.
+ */
+#define SHMRING_VAMETER 1
+#define SHMRING_COUNTER 2
+
+struct shmring_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t kind;             /* SHMRING_VAMETER, ...          */
+	uint32_t rec_size;         /* bytes, multiple of 8          */
+	uint32_t slots;            /* power of two                  */
+	uint32_t reserved[11];
+
+	/* records published so far, on its own cache line */
+	uint64_t head;
+	uint64_t pad[7];
+};
+
+struct shmring {
+	struct shmring_hdr *hdr;
+	uint8_t *slots;
+	size_t map_size;
+
+	uint32_t rec_size;
+	uint32_t slot_size;
+	uint32_t mask;
+
+	/* reader cursor and records lost to overruns */
+	uint64_t cursor;
+	uint64_t lost;
+
+	int writer;
+	char name[];
+};
+
+/*
+ * Creates ring for the writer, name is shm_open() name, i.e. "/vameter".
+ * Slots is rounded up to power of two. Returns NULL and errno on failure.
+ */
+struct shmring *shmring_create(const char *name, uint32_t kind,
+                               uint32_t rec_size, uint32_t slots);
+
+/*
+ * Unmaps the ring and removes the name, attached readers keep the mapping.
+ */
+void shmring_destroy(struct shmring *self);
+
+/*
+ * Publishes record of rec_size bytes, never blocks.
+ */
+void shmring_write(struct shmring *self, const void *rec);
+
+/*
+ * Attaches reader to an existing ring, the cursor starts at the newest
+ * record. Kind must match unless zero. Returns NULL and errno on failure.
+ */
+struct shmring *shmring_attach(const char *name, uint32_t kind);
+
+void shmring_detach(struct shmring *self);
+
+/*
+ * Reads next record. Returns 1 if a record was copied, 0 if there is no new
+ * one. Records overwritten before they were read are added to lost.
+ */
+int shmring_read(struct shmring *self, void *rec);
+
+#endif /* __LIBSHMRING_H__ */
@@ -0,0 +1,107 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Spectral analysis of VAmeter sample frames.
+ *
+ * Each frame has 32 samples, SPECTRUM_SIZE samples (one or more frames) are
+ * collected and real FFT is computed. The size is fixed at compile time, the
+ * library and applications must be compiled with the same value. The
+ * twiddle tables are computed once, per FFT stage in contiguous arrays, no
+ * memory is allocated per frame.
+ *
+ * There is no window function, the analysis works best when the frame spans
+ * whole number of signal periods.
+ */
+
+#ifndef __LIBSPECTRUM_H__
+#define __LIBSPECTRUM_H__
+
+#include <stdint.h>
+
+/* power of two and multiple of 32, i.e. 32, 64, ... 256 */
+#ifndef SPECTRUM_SIZE
+# define SPECTRUM_SIZE 32
+#endif
+
+#define SPECTRUM_BINS      (SPECTRUM_SIZE/2 + 1)
+#define SPECTRUM_HARMONICS 8
+
+struct VAmeter;
+
+struct spectrum {
+	/*
+	 * Results, peak amplitudes in volts (ampers) for each bin, mag[0] is
+	 * the DC component.
+	 */
+	float   mag[SPECTRUM_BINS];
+
+	/* bin with the largest AC amplitude */
+	uint8_t fundamental;
+
+	/* fundamental and its harmonics, zero above the Nyquist frequency */
+	float   harm[SPECTRUM_HARMONICS];
+
+	/* total harmonic distortion, harmonics RMS / fundamental RMS */
+	float   thd;
+
+	/*
+	 * Called when results are ready.
+	 */
+	void  (*done)(struct VAmeter *meter, const struct spectrum *self);
+	void   *priv;
+
+	/*
+	 * Samples for the current block.
+	 */
+	uint16_t pos;
+	uint16_t frame_start;
+	float    buf[SPECTRUM_SIZE];
+};
+
+/*
+ * Initalize analysis state.
+ */
+void spectrum_init(struct spectrum *self,
+                   void (*done)(struct VAmeter *meter, const struct spectrum *self),
+                   void *priv);
+
+/*
+ * Adds one sample in raw units, called by the library.
+ */
+static inline void spectrum_sample(struct spectrum *self, float sample)
+{
+	if (self->pos < SPECTRUM_SIZE)
+		self->buf[self->pos++] = sample;
+}
+
+/*
+ * Ends frame, samples are scaled to volts (ampers), invalid frame is thrown
+ * away. Returns non-zero when the block was completed and results computed.
+ */
+int  spectrum_frame(struct spectrum *self, float scale, int valid);
+
+/*
+ * Computes results from the samples in buf.
+ */
+void spectrum_compute(struct spectrum *self);
+
+#endif /* __LIBSPECTRUM_H__ */
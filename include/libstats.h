@@ -0,0 +1,90 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Instrumentation counters.
+ *
+ * Every counter is updated only by the thread that reads and parses the
+ * data, so plain relaxed atomic load and store is enough for the update and
+ * there are no locked instructions on the hot path. Any other thread can
+ * take a snapshot at any time, each counter is read atomically but the
+ * snapshot as a whole is not consistent.
+ *
+ * Stats structures must consist of uint64_t only so that they can be copied
+ * by stats_snapshot().
+ */
+
+#ifndef __LIBSTATS_H__
+#define __LIBSTATS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Log2 histogram, bucket 0 counts zeroes, bucket n counts values in
+ * [2^(n-1), 2^n), the last bucket counts everything bigger.
+ */
+#define STATS_HIST_SIZE 32
+
+struct stats_hist {
+	uint64_t bucket[STATS_HIST_SIZE];
+};
+
+static inline void stats_add(uint64_t *cnt, uint64_t val)
+{
+	uint64_t v = __atomic_load_n(cnt, __ATOMIC_RELAXED);
+
+	__atomic_store_n(cnt, v + val, __ATOMIC_RELAXED);
+}
+
+static inline void stats_inc(uint64_t *cnt)
+{
+	stats_add(cnt, 1);
+}
+
+static inline unsigned int stats_bucket(uint64_t val)
+{
+	unsigned int b;
+
+	if (val == 0)
+		return 0;
+
+	b = 64 - __builtin_clzll(val);
+
+	return b < STATS_HIST_SIZE ? b : STATS_HIST_SIZE - 1;
+}
+
+static inline void stats_hist(struct stats_hist *hist, uint64_t val)
+{
+	stats_inc(&hist->bucket[stats_bucket(val)]);
+}
+
+/*
+ * Copies stats structure of size bytes, safe to call from any thread.
+ */
+void stats_snapshot(void *dst, const void *src, size_t size);
+
+/*
+ * Lower bound of the histogram bucket.
+ */
+uint64_t stats_bucket_min(unsigned int bucket);
+
+#endif /* __LIBSTATS_H__ */
@@ -0,0 +1,110 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Frequency response measurement.
+ *
+ * Generator is stepped through a list of frequencies, for each of them
+ * VAmeter voltage readings are watched until the settling detector reports
+ * stable value and the value is recorded. Then the sweep moves to the next
+ * frequency right away.
+ */
+
+#ifndef __LIBSWEEP_H__
+#define __LIBSWEEP_H__
+
+#include <stdio.h>
+#include <time.h>
+
+#include "libgenerator.h"
+#include "libvameter.h"
+
+struct sweep_point {
+	float freq;              /* generator frequency in Hz        */
+	float vrms;              /* settled AC RMS voltage           */
+	char  acdc;              /* VAMETER_AC, VAMETER_DC_...       */
+	uint8_t settled;         /* zero if max_frames was reached   */
+	unsigned int frames;     /* voltage frames read at the point */
+	float time;              /* seconds spent at the point       */
+};
+
+struct sweep {
+	struct generator *gen;
+	struct VAmeter   *meter;
+
+	/*
+	 * VAmeter settling detector parameters, see struct vameter_settle.
+	 */
+	float tolerance;
+	float floor;
+	uint8_t hold;
+	unsigned int max_frames;
+
+	/* reference for gain, if zero the maximum is used */
+	float ref;
+
+	struct sweep_point *points;
+	unsigned int cnt;
+
+	/*
+	 * Sweep state.
+	 */
+	unsigned int cur;
+	uint8_t skip;
+	struct timespec start;
+
+	/* attached to the meter while sweep_run() runs */
+	struct vameter_listener listener;
+};
+
+/*
+ * Allocates points and sets default settling parameters.
+ *
+ * Returns -1 if malloc has failed.
+ */
+int  sweep_init(struct sweep *self, struct generator *gen,
+                struct VAmeter *meter, const float *freqs, unsigned int cnt);
+
+/*
+ * Frees points.
+ */
+void sweep_free(struct sweep *self);
+
+/*
+ * Fills freqs with cnt logarithmically spaced frequencies.
+ */
+void sweep_log_freqs(float *freqs, unsigned int cnt, float start, float stop);
+
+/*
+ * Runs the sweep, generator state must be loaded already.
+ *
+ * Returns 0 when all points were measured, -1 on timeout or error.
+ */
+int  sweep_run(struct sweep *self, int timeout_ms);
+
+/*
+ * Writes measured points as a table, one line per point.
+ *
+ * freq[Hz] V[V] gain[dB] settled frames time[s]
+ */
+void sweep_write_table(struct sweep *self, FILE *f);
+
+#endif /* __LIBSWEEP_H__ */
@@ -26,32 +26,245 @@
 #include <stdbool.h>
 
 #include "libserial.h"
+#include "libcond.h"
+#include "libspectrum.h"
+#include "libenergy.h"
+#include "libexporter.h"
+#include "libseqlock.h"
+#include "libshmring.h"
 
 #define VAMETER_DC_POS '+'
 #define VAMETER_DC_NEG '-'
 #define VAMETER_AC     '~'
 
-struct VAmeter {
-	/*
-	 * VA meter state.
-	 */
+/*
+ * Sample was computed from references preloaded from the cache, fresh
+ * references were not received from the device yet.
+ */
+#define VAMETER_PROVISIONAL 0x01
+
+/*
+ * Sample has not settled yet after range or input change.
+ */
+#define VAMETER_SETTLING    0x02
+
+/*
+ * Settling detector, sample is stable when hold consecutive samples differ
+ * by less than tolerance * sample + floor. Detector is disabled if hold is 0.
+ */
+struct vameter_settle {
+	float   tolerance;
+	float   floor;
+	uint8_t hold;
+	uint8_t cnt;
+	float   last;
+};
+
+/*
+ * All values computed from one frame of samples.
+ */
+struct vameter_sample {
+	char    acdc;              /* VAMETER_DC_POS, ...              */
+	uint8_t flags;             /* VAMETER_PROVISIONAL, ...         */
+	uint8_t range;             /* range index                      */
+	uint8_t cnt;               /* number of samples in frame       */
+
+	float   rms;               /* true RMS (the voltage_sample value) */
+	float   dc;                /* mean value, DC component         */
+	float   ac_rms;            /* RMS of the AC component          */
+	float   min;
+	float   max;
+	float   pp;                /* peak to peak                     */
+	float   crest;             /* crest factor, peak / rms         */
+
+	uint64_t t;                /* CLOCK_MONOTONIC ns of the last byte */
+	uint32_t dt;               /* ns between samples               */
+};
+
+/*
+ * Interpolated time of n-th sample in the frame.
+ */
+static inline uint64_t vameter_sample_time(const struct vameter_sample *s,
+                                           uint8_t n)
+{
+	return s->t - (uint64_t)(s->cnt - 1 - n) * s->dt;
+}
+
+/*
+ * Finished sample frame, see vameter_process_events().
+ */
+struct vameter_event {
+	struct vameter_sample s;
+	char    chan;              /* 'V' or 'A'                       */
+	uint8_t hw_switch;         /* current hw switch, 0 for voltage */
+};
+
+/*
+ * Most sample frames that can end in len bytes, a frame that produces a
+ * sample has at least a control byte and one two byte sample.
+ */
+#define VAMETER_EVENTS_MAX(len) ((len) / 3 + 1)
+
+struct VAmeter;
+
+/*
+ * Callbacks with context, every callback gets the instance and the ctx
+ * pointer the ops were registered with. Unused callbacks may be NULL.
+ */
+struct vameter_ops {
+	void (*voltage_range)(struct VAmeter *self, void *ctx,
+	                      uint8_t range, const char *str_range);
+	void (*current_range)(struct VAmeter *self, void *ctx, uint8_t hw_switch,
+	                      uint8_t range, const char *str_range);
+	void (*voltage_sample)(struct VAmeter *self, void *ctx,
+	                       char acdc, float sample);
+	void (*current_sample)(struct VAmeter *self, void *ctx,
+	                       char acdc, float sample);
+	void (*voltage_frame)(struct VAmeter *self, void *ctx,
+	                      const struct vameter_sample *s);
+	void (*current_frame)(struct VAmeter *self, void *ctx,
+	                      const struct vameter_sample *s);
+	void (*voltage_stable)(struct VAmeter *self, void *ctx,
+	                       char acdc, float sample);
+	void (*current_stable)(struct VAmeter *self, void *ctx,
+	                       char acdc, float sample);
+};
+
+/*
+ * Registered ops and ctx, any number of listeners may be attached to one
+ * meter, they are called in order of registration after the plain
+ * callbacks. The structure is owned by the caller.
+ */
+struct vameter_listener {
+	const struct vameter_ops *ops;
+	void *ctx;
+
+	struct vameter_listener *next;
+};
+
+/*
+ * Frame types counted in stats.
+ */
+enum vameter_frame {
+	VAMETER_FRAME_V_RANGE,
+	VAMETER_FRAME_V_ZERO_REF,
+	VAMETER_FRAME_V_REF,
+	VAMETER_FRAME_V_SAMPLE,
+	VAMETER_FRAME_A_RANGE,
+	VAMETER_FRAME_A_ZERO_REF,
+	VAMETER_FRAME_A_REF,
+	VAMETER_FRAME_A_SAMPLE,
+	VAMETER_FRAME_TYPES,
+};
+
+struct vameter_stats {
+	uint64_t frames[VAMETER_FRAME_TYPES];
+	uint64_t range_changes;
+	uint64_t resync;           /* data bytes outside of known frame */
+	uint64_t unknown;          /* unknown commands                  */
+	uint64_t invalid_range;
+	uint64_t truncated;        /* frames with wrong number of bytes */
+	uint64_t callback_ns;      /* time spent in frame callbacks     */
+
+	/* us between two sample frames of the same channel */
+	struct stats_hist voltage_interval;
+	struct stats_hist current_interval;
+};
+
+/*
+ * Record published into shared memory ring, see vameter_publish().
+ */
+struct vameter_record {
+	struct vameter_sample s;
+	char    chan;              /* 'V' or 'A'                      */
+	uint8_t hw_switch;         /* current hw switch, 0 for voltage */
+	uint8_t reserved[6];
+};
+
+/*
+ * Latest values, published after every sample frame, see
+ * vameter_get_snapshot().
+ */
+struct vameter_snapshot {
+	uint64_t seq;              /* number of published frames          */
+	uint64_t t;                /* CLOCK_MONOTONIC ns of the last frame */
+	uint64_t voltage_t;        /* time of the voltage, 0 if none yet  */
+	uint64_t current_t;        /* time of the current, 0 if none yet  */
+	float    voltage;
+	float    current;
+	uint8_t  voltage_range;    /* range index, 0xff if not known      */
+	uint8_t  current_range;
+	uint8_t  hw_switch;
+	char     voltage_acdc;     /* VAMETER_DC_POS, ..., 0 if not known */
+	char     current_acdc;
+	uint8_t  voltage_flags;    /* VAMETER_PROVISIONAL, ...            */
+	uint8_t  current_flags;
+	uint8_t  reserved;
+};
+
+/*
+ * Parser state touched for every byte, kept in a single cache line. For
+ * pooled meters these are allocated contiguously, apart from the rest of
+ * the struct VAmeter.
+ */
+struct vameter_hot {
 	uint8_t  command;          /* where are we now       */
-	
 	uint8_t  sample_low;       /* low part of sample     */
 	uint8_t  sample_cnt;       /* number of read samples */
-	float    sample_sum;       /* sum of read samples    */
 
-	uint8_t cur_voltage_range; /* voltage range          */
-	uint8_t cur_current_range; /* current range          */
-	uint8_t hw_switch;         /* hw switch on the board */
+	/*
+	 * Number of samples less than zero. Used to determine AC/DC.
+	 */
+	uint8_t  neg_volt_samp;
+	uint8_t  neg_curr_samp;
+
+	uint8_t  cur_voltage_range; /* voltage range          */
+	uint8_t  cur_current_range; /* current range          */
+	uint8_t  hw_switch;         /* hw switch on the board */
+
+	/*
+	 * Which references and ranges are known and which of them were
+	 * received from the device (not preloaded from the cache).
+	 */
+	uint8_t  ref_known;
+	uint8_t  ref_fresh;
+
+	uint32_t char_ns;          /* character time         */
+
+	float    sample_sum;       /* sum of squared samples */
+	float    sample_lin;       /* sum of samples         */
+	float    sample_min;       /* minimal sample         */
+	float    sample_max;       /* maximal sample         */
 
 	/*
 	 * Autocallibration values.
 	 */
-	float   voltage_ref;
-	float   voltage_zero;
-	float   current_ref;
-	float   current_zero;
+	float    voltage_ref;
+	float    voltage_zero;
+	float    current_ref;
+	float    current_zero;
+
+	/*
+	 * Optional spectral analysis, NULL if not used, see
+	 * vameter_set_spectrum().
+	 */
+	struct spectrum *voltage_spectrum;
+	struct spectrum *current_spectrum;
+} __attribute__((aligned(64)));
+
+struct vameter_pool;
+struct listener_walk;
+
+struct VAmeter {
+	/*
+	 * Parser state, points either into the pool or to the same allocation
+	 * right before the meter.
+	 */
+	struct vameter_hot *hot;
+	struct vameter_pool *pool;
+
+	/* references cache file, NULL if not used */
+	char   *ref_cache;
 
 	/*
 	 * Measured values
@@ -66,10 +279,13 @@ struct VAmeter {
 	float current_callib[4];
 
 	/*
-	 * Number of samples less than zero. Used to determine AC/DC.
+	 * Flags for the sample passed to the callback.
 	 */
-	uint8_t neg_volt_samp;
-	uint8_t neg_curr_samp;
+	uint8_t voltage_flags;
+	uint8_t current_flags;
+
+	struct vameter_settle voltage_settle;
+	struct vameter_settle current_settle;
 
 	/*
 	 * Callbacks, that could be set by application.
@@ -79,22 +295,139 @@ struct VAmeter {
 	void (*voltage_sample)(char acdc, float sample);
 	void (*current_sample)(char acdc, float sample);
 
+	/*
+	 * Extended sample callbacks, called after the sample callbacks.
+	 */
+	void (*voltage_frame)(struct VAmeter *self, const struct vameter_sample *s);
+	void (*current_frame)(struct VAmeter *self, const struct vameter_sample *s);
+
+	/*
+	 * Called after sample callback for the first stable sample.
+	 */
+	void (*voltage_stable)(char acdc, float sample);
+	void (*current_stable)(char acdc, float sample);
+
+	/*
+	 * Callbacks with context, see vameter_set_ops() and vameter_listen().
+	 */
+	struct vameter_listener *listeners;
+	struct listener_walk *walks;
+	struct vameter_listener listener;
+
+	/* output of vameter_process_events(), NULL otherwise */
+	struct vameter_event *events;
+	uint32_t nevents;
+
+	/*
+	 * Power and energy integration, NULL if not used.
+	 */
+	struct vameter_energy *energy;
+
+	/*
+	 * Condition rules evaluated for each sample, NULL if not used.
+	 */
+	struct cond_set *cond;
+
+	/*
+	 * Exported metrics, NULL if not used.
+	 */
+	struct exporter_vameter *exporter;
+
+	/*
+	 * Shared memory ring for other processes, NULL if not used.
+	 */
+	struct shmring *ring;
+
+	/*
+	 * Instrumentation counters and end of the last sample frames.
+	 */
+	struct vameter_stats stats;
+	uint64_t t_voltage;
+	uint64_t t_current;
+
+	/*
+	 * Latest values, parser copy and the seqlock register.
+	 */
+	struct vameter_snapshot snap;
+	uint64_t snap_seq;
+	struct vameter_snapshot snap_reg;
+
 	/*
 	 * File descriptor and path to device file. 
 	 */
 	struct libserial_port *port;
 };
 
+/*
+ * Pool of meters, meters and their parser states are allocated in two
+ * contiguous arrays so that processing reads for many meters touches as
+ * few cache lines as possible.
+ */
+struct vameter_pool {
+	unsigned int size;
+	unsigned int used;
+
+	struct vameter_hot *hot;
+	struct VAmeter     *meters;
+	uint8_t            *in_use;
+};
+
+/*
+ * Allocates pool for size meters. Returns NULL if malloc has failed.
+ */
+struct vameter_pool *vameter_pool_create(unsigned int size);
+
+/*
+ * Dtto as vameter_init() but the meter is allocated from the pool. Returns
+ * NULL with errno set to ENOSPC when the pool is full. Pooled meters are
+ * freed by vameter_exit() as well.
+ */
+struct VAmeter *vameter_pool_init(struct vameter_pool *pool,
+                                  const char *device_path);
+
+/*
+ * Frees the pool, all meters must be freed already.
+ */
+void vameter_pool_destroy(struct vameter_pool *pool);
+
 /*
  * Allocate struct AVmeter, open device.
+ *
+ * Last known references are preloaded from $HOME/.usb-instruments/ID.ref
+ * where ID is the /dev/serial/by-id/ name of the device, i.e. it includes
+ * the adapter serial number. Devices without by-id name are not cached.
  */
 struct VAmeter *vameter_init(const char *device_path);
 
 /*
- * Free memory and close device.
+ * Dtto but with ops and context set, see vameter_set_ops().
+ */
+struct VAmeter *vameter_init_ops(const char *device_path,
+                                 const struct vameter_ops *ops, void *ctx);
+
+/*
+ * Free memory and close device, store references into the cache.
  */
 void            vameter_exit(struct VAmeter *meter);
 
+/*
+ * Sets ops and ctx of the meter, NULL ops removes them. Meter holds one such
+ * listener, use vameter_listen() for more.
+ */
+void            vameter_set_ops(struct VAmeter *meter,
+                                const struct vameter_ops *ops, void *ctx);
+
+/*
+ * Attaches/detaches listener. Any listener may be detached from a callback
+ * and freed right away, the rest of the listeners is still called. Listener
+ * attached from a callback may be called for the current frame already.
+ */
+void            vameter_listen(struct VAmeter *meter,
+                               struct vameter_listener *listener,
+                               const struct vameter_ops *ops, void *ctx);
+void            vameter_unlisten(struct VAmeter *meter,
+                                 struct vameter_listener *listener);
+
 /*
  * Returns device name.
  */
@@ -106,11 +439,73 @@ const char     *vameter_get_dev(struct VAmeter *meter);
  */
 int             vameter_get_fd(struct VAmeter *meter);
 
+/*
+ * Copies meter stats, may be called from any thread. Stats for the serial
+ * port are available from libserial_get_stats().
+ */
+void            vameter_get_stats(struct VAmeter *meter,
+                                  struct vameter_stats *stats);
+
+/*
+ * Offline decoding helpers. Vameter_sync() returns position of the first
+ * control byte at or after pos, i.e. where a frame starts.
+ *
+ * The parser state at a position is given by the last range and reference
+ * frames before it. Vameter_seed_scan() updates seed with these frames
+ * found in buf[from, pos), frames that are not found there keep positions
+ * from the previous scan, so that a capture split into chunks is scanned
+ * only once. Vameter_seed_run() runs the parser over the seed frames and
+ * over the frame that is completed at pos, the meter then continues at pos
+ * as if it parsed everything before.
+ */
+#define VAMETER_SEED_FRAMES 6
+
+struct vameter_seed {
+	/* start of the last frame of each kind, SIZE_MAX if not seen */
+	size_t frame[VAMETER_SEED_FRAMES];
+};
+
+size_t          vameter_sync(const uint8_t *buf, size_t len, size_t pos);
+void            vameter_seed_init(struct vameter_seed *seed);
+void            vameter_seed_scan(struct vameter_seed *seed,
+                                  const uint8_t *buf, size_t from, size_t pos);
+void            vameter_seed_run(struct VAmeter *meter, const uint8_t *buf,
+                                 size_t pos, const struct vameter_seed *seed);
+
+/*
+ * Copies the latest values, may be called from any thread at any rate, it
+ * never blocks the parser.
+ */
+void            vameter_get_snapshot(struct VAmeter *meter,
+                                     struct vameter_snapshot *snap);
+
+/*
+ * Number of protocol errors, i.e. unknown commands, invalid ranges and
+ * truncated frames.
+ */
+uint64_t        vameter_errors(const struct vameter_stats *stats);
+
 /*
  * Process bytes from buffer.
  */
 void            vameter_process(struct VAmeter *meter, uint8_t *buf, uint32_t buf_len);
 
+/*
+ * Dtto but t is CLOCK_MONOTONIC time in ns when the last byte of the buffer
+ * has arrived. Frame and sample times are interpolated from it.
+ */
+void            vameter_process_ts(struct VAmeter *meter, uint8_t *buf,
+                                   uint32_t buf_len, uint64_t t);
+
+/*
+ * Dtto and stores the finished sample frames into ev, in order, so that the
+ * caller may handle them without callbacks. The ev array must have room
+ * for VAMETER_EVENTS_MAX(buf_len) entries. Returns number of the entries.
+ */
+uint32_t        vameter_process_events(struct VAmeter *meter,
+                                       const uint8_t *buf, uint32_t buf_len,
+                                       uint64_t t, struct vameter_event *ev);
+
 /*
  * Read and process data.
  */
@@ -140,4 +535,70 @@ int             vameter_load_callib(struct VAmeter *meter, const char *file);
  */
 void            vameter_unload_callib(struct VAmeter *meter);
 
+/*
+ * Start power and energy integration. Totals are loaded from and
+ * periodically (period in seconds) stored into the checkpoint file, which
+ * may be NULL. Returns -1 if malloc has failed.
+ */
+int             vameter_energy_start(struct VAmeter *meter,
+                                     const char *checkpoint,
+                                     unsigned int period);
+
+/*
+ * Stop integration, totals are stored into the checkpoint file.
+ */
+void            vameter_energy_stop(struct VAmeter *meter);
+
+/*
+ * Export values into OpenMetrics exporter, NULL stops exporting. Returns -1
+ * if malloc has failed, -1 and EEXIST if the device is exported already.
+ */
+int             vameter_export(struct VAmeter *meter, struct exporter *exp);
+
+/*
+ * Publish sample frames as struct vameter_record into shared memory ring
+ * name with slots records, NULL stops publishing. Readers attach with
+ * shmring_attach(name, SHMRING_VAMETER). Returns -1 and errno on failure.
+ */
+int             vameter_publish(struct VAmeter *meter, const char *name,
+                                uint32_t slots);
+
+/*
+ * Set spectral analysis for voltage and current frames, NULL disables it.
+ */
+void            vameter_set_spectrum(struct VAmeter *meter,
+                                     struct spectrum *voltage,
+                                     struct spectrum *current);
+
+/*
+ * Set settling detector parameters, hold = 0 disables the detector.
+ */
+void            vameter_voltage_settle(struct VAmeter *meter, float tolerance,
+                                       float floor, uint8_t hold);
+void            vameter_current_settle(struct VAmeter *meter, float tolerance,
+                                       float floor, uint8_t hold);
+
+/*
+ * Restart settling, for example after the measured input was changed.
+ */
+void            vameter_settle_restart(struct VAmeter *meter);
+
+/*
+ * Load autocallibration references and ranges. Returns -1 on failure with
+ * errno set and -2 when the file couldn't be parsed.
+ */
+int             vameter_load_refs(struct VAmeter *meter, const char *file);
+
+/*
+ * Store autocallibration references and ranges. Returns -1 on failure with
+ * errno set.
+ */
+int             vameter_save_refs(struct VAmeter *meter, const char *file);
+
+/*
+ * Change the reference cache file, NULL disables the cache. Returns -1 if
+ * malloc has failed.
+ */
+int             vameter_ref_cache(struct VAmeter *meter, const char *file);
+
 #endif /* __LIBVAMETER_H__ */
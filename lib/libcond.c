@@ -0,0 +1,264 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+
+#include "libcond.h"
+
+#define RULE_WINDOW  0
+#define RULE_DRIFT   1
+#define RULE_CHANGED 2
+
+struct cond_set *cond_create(void)
+{
+	struct cond_set *self = malloc(sizeof(struct cond_set));
+	int i;
+
+	if (self == NULL)
+		return NULL;
+
+	for (i = 0; i < COND_CHANNELS; i++)
+		self->rules[i] = NULL;
+
+	return self;
+}
+
+void cond_destroy(struct cond_set *self)
+{
+	struct cond_rule *rule, *next;
+	int i;
+
+	if (self == NULL)
+		return;
+
+	for (i = 0; i < COND_CHANNELS; i++) {
+		for (rule = self->rules[i]; rule != NULL; rule = next) {
+			next = rule->next;
+			free(rule);
+		}
+	}
+
+	free(self);
+}
+
+static struct cond_rule *cond_add(struct cond_set *self, enum cond_chan chan,
+                                  float set_lo, float set_hi,
+                                  float clr_lo, float clr_hi, uint16_t count,
+                                  void (*fire)(struct cond_rule *self, float val, int active),
+                                  void *priv)
+{
+	struct cond_rule *rule;
+
+	if (chan >= COND_CHANNELS)
+		return NULL;
+
+	rule = malloc(sizeof(struct cond_rule));
+
+	if (rule == NULL)
+		return NULL;
+
+	rule->set_lo   = set_lo;
+	rule->set_hi   = set_hi;
+	rule->clr_lo   = clr_lo;
+	rule->clr_hi   = clr_hi;
+	rule->count    = count ? count : 1;
+	rule->cnt      = 0;
+	rule->active   = 0;
+	rule->type     = RULE_WINDOW;
+	rule->ppm      = 0;
+	rule->hyst_ppm = 0;
+	rule->fire     = fire;
+	rule->priv     = priv;
+
+	rule->next = self->rules[chan];
+	self->rules[chan] = rule;
+
+	return rule;
+}
+
+struct cond_rule *cond_above(struct cond_set *self, enum cond_chan chan,
+                             float limit, float hyst, uint16_t count,
+                             void (*fire)(struct cond_rule *self, float val, int active),
+                             void *priv)
+{
+	/* clear limit would be above the set limit */
+	if (hyst < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return cond_add(self, chan, -INFINITY, limit, -INFINITY, limit - hyst,
+	                count, fire, priv);
+}
+
+struct cond_rule *cond_below(struct cond_set *self, enum cond_chan chan,
+                             float limit, float hyst, uint16_t count,
+                             void (*fire)(struct cond_rule *self, float val, int active),
+                             void *priv)
+{
+	/* clear limit would be below the set limit */
+	if (hyst < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return cond_add(self, chan, limit, INFINITY, limit + hyst, INFINITY,
+	                count, fire, priv);
+}
+
+struct cond_rule *cond_outside(struct cond_set *self, enum cond_chan chan,
+                               float lo, float hi, float hyst, uint16_t count,
+                               void (*fire)(struct cond_rule *self, float val, int active),
+                               void *priv)
+{
+	/* clear window would be wider than the set window or empty */
+	if (hyst < 0 || hyst > (hi - lo) / 2) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return cond_add(self, chan, lo, hi, lo + hyst, hi - hyst,
+	                count, fire, priv);
+}
+
+static void drift_compile(struct cond_rule *rule, float ref)
+{
+	float set = fabsf(ref) * rule->ppm / 1000000;
+	float clr = fabsf(ref) * (rule->ppm - rule->hyst_ppm) / 1000000;
+
+	rule->set_lo = ref - set;
+	rule->set_hi = ref + set;
+	rule->clr_lo = ref - clr;
+	rule->clr_hi = ref + clr;
+	rule->type   = RULE_WINDOW;
+}
+
+struct cond_rule *cond_drift(struct cond_set *self, enum cond_chan chan,
+                             float ref, float ppm, float hyst_ppm, uint16_t count,
+                             void (*fire)(struct cond_rule *self, float val, int active),
+                             void *priv)
+{
+	struct cond_rule *rule;
+
+	/* clear window would be inverted or wider than the set window */
+	if (hyst_ppm < 0 || hyst_ppm > ppm) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	rule = cond_add(self, chan, 0, 0, 0, 0, count, fire, priv);
+
+	if (rule == NULL)
+		return NULL;
+
+	rule->ppm      = ppm;
+	rule->hyst_ppm = hyst_ppm;
+
+	if (ref != 0)
+		drift_compile(rule, ref);
+	else
+		rule->type = RULE_DRIFT;
+
+	return rule;
+}
+
+/*
+ * Window is [last, last] and moves with every change.
+ */
+struct cond_rule *cond_changed(struct cond_set *self, enum cond_chan chan,
+                               void (*fire)(struct cond_rule *self, float val, int active),
+                               void *priv)
+{
+	struct cond_rule *rule;
+
+	rule = cond_add(self, chan, NAN, NAN, NAN, NAN, 1, fire, priv);
+
+	if (rule != NULL)
+		rule->type = RULE_CHANGED;
+
+	return rule;
+}
+
+void cond_remove(struct cond_set *self, struct cond_rule *rule)
+{
+	struct cond_rule **i;
+	int chan;
+
+	for (chan = 0; chan < COND_CHANNELS; chan++) {
+		for (i = &self->rules[chan]; *i != NULL; i = &(*i)->next) {
+			if (*i == rule) {
+				*i = rule->next;
+				free(rule);
+				return;
+			}
+		}
+	}
+}
+
+static void cond_eval_changed(struct cond_rule *rule, float val)
+{
+	/* first value sets the window */
+	if (isnan(rule->set_lo)) {
+		rule->set_lo = rule->set_hi = val;
+		return;
+	}
+
+	if (val != rule->set_lo) {
+		rule->set_lo = rule->set_hi = val;
+		rule->fire(rule, val, 1);
+	}
+}
+
+void cond_eval(struct cond_set *self, enum cond_chan chan, float val)
+{
+	struct cond_rule *rule, *next;
+
+	/* fire may remove its own rule */
+	for (rule = self->rules[chan]; rule != NULL; rule = next) {
+		next = rule->next;
+
+		switch (rule->type) {
+		case RULE_CHANGED:
+			cond_eval_changed(rule, val);
+			continue;
+		case RULE_DRIFT:
+			drift_compile(rule, val);
+			continue;
+		}
+
+		if (!rule->active) {
+			if (val < rule->set_lo || val > rule->set_hi) {
+				if (++rule->cnt >= rule->count) {
+					rule->active = 1;
+					rule->cnt    = 0;
+					rule->fire(rule, val, 1);
+				}
+			} else {
+				rule->cnt = 0;
+			}
+		} else if (val >= rule->clr_lo && val <= rule->clr_hi) {
+			rule->active = 0;
+			rule->fire(rule, val, 0);
+		}
+	}
+}
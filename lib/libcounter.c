@@ -27,8 +27,11 @@
 #include <stdio.h>
 
 #include "libcounter.h"
+#include "listeners.h"
 
 #define PACKET_START 0xC9
+/* start, range and six nibbles */
+#define PACKET_LEN   8
 
 struct counter *counter_create(const char *dev, void (*measure)(float),
                                void (*range)(unsigned char))
@@ -48,6 +51,19 @@ struct counter *counter_create(const char *dev, void (*measure)(float),
 	/* event callbacks */
 	counter->measure_ev = measure;
 	counter->range_ev = range;
+	counter->cond     = NULL;
+	counter->measure_sample = NULL;
+	counter->listeners      = NULL;
+	counter->walks          = NULL;
+	counter->samples        = NULL;
+	counter->nsamples       = 0;
+	counter->exporter = NULL;
+	counter->ring     = NULL;
+	counter->t_last   = 0;
+	memset(&counter->stats, 0, sizeof(counter->stats));
+	memset(&counter->snap, 0, sizeof(counter->snap));
+	memset(&counter->snap_reg, 0, sizeof(counter->snap_reg));
+	counter->snap_seq = 0;
 	
 	/* initalization */
 	counter->stream_pos = -2;
@@ -57,31 +73,96 @@ struct counter *counter_create(const char *dev, void (*measure)(float),
 	return counter;
 }
 
+struct counter *counter_create_ctx(const char *dev,
+                                   const struct counter_ops *ops, void *ctx)
+{
+	struct counter *counter = counter_create(dev, NULL, NULL);
+
+	if (counter != NULL && ops != NULL)
+		counter_listen(counter, &counter->listener, ops, ctx);
+
+	return counter;
+}
+
+void counter_listen(struct counter *counter, struct counter_listener *listener,
+                    const struct counter_ops *ops, void *ctx)
+{
+	struct counter_listener **i;
+
+	listener->ops  = ops;
+	listener->ctx  = ctx;
+	listener->next = NULL;
+
+	for (i = &counter->listeners; *i != NULL; i = &(*i)->next);
+
+	*i = listener;
+}
+
+void counter_unlisten(struct counter *counter, struct counter_listener *listener)
+{
+	struct counter_listener **i;
+
+	UNLISTEN_OPS(counter, listener);
+
+	for (i = &counter->listeners; *i != NULL; i = &(*i)->next) {
+		if (*i == listener) {
+			*i = listener->next;
+			return;
+		}
+	}
+}
+
 void counter_destroy(struct counter *counter)
 {
 	if (counter == NULL)
 		return;
 
+	exporter_counter_destroy(counter->exporter);
+	shmring_destroy(counter->ring);
 	libserial_close(counter->port);
 	free(counter);
 }
 
-static void counter_parse(struct counter *counter, unsigned char byte)
+static void proto_error(struct counter *counter, uint64_t *cnt)
+{
+	stats_inc(cnt);
+
+	if (counter->exporter != NULL) {
+		exporter_counter_errors(counter->exporter,
+		                        counter->stats.resync +
+		                        counter->stats.invalid_range);
+	}
+}
+
+static void counter_parse(struct counter *counter, unsigned char byte,
+                          uint64_t t)
 {
+	struct counter_sample s;
+	uint64_t cb_start;
+	float val;
+
 	switch (counter->stream_pos) {
 		/* synchronize */
 		case -2:
 			if (byte == PACKET_START)
 				counter->stream_pos = -1;
-			else
-				printf("LOST %x\n", byte);
+			else {
+				EVLOG(&counter->port->log, EVLOG_WARN,
+				      EVLOG_COUNTER_LOST, byte, 0);
+				proto_error(counter, &counter->stats.resync);
+			}
 		break;
 		/* range */
 		case -1:
 			//TODO: check for correct range
 			if (counter->range != byte) {
+				stats_inc(&counter->stats.range_changes);
 				counter->range = byte;
-				counter->range_ev(counter->range);
+				if (counter->range_ev != NULL)
+					counter->range_ev(counter->range);
+				CALL_OPS(counter, range, byte);
+				if (counter->cond != NULL)
+					cond_eval(counter->cond, COND_FREQ_RANGE, byte);
 			}
 			counter->stream_pos = 0;
 		break;
@@ -94,22 +175,71 @@ static void counter_parse(struct counter *counter, unsigned char byte)
 				
 				switch (counter->range) {
 					case 'A':
-						counter->measure_ev(2.00 * 128 * counter->val);
+						val = 2.00 * 128 * counter->val;
 					break;
 					case 'B':
-						counter->measure_ev(2.00 * counter->val);
+						val = 2.00 * counter->val;
 					break;
 					case 'C':
-						counter->measure_ev(2000000.00 / counter->val);
+						val = 2000000.00 / counter->val;
 					break;
 					case 'a':
-						counter->measure_ev(128.00 * counter->val / 5);
+						val = 128.00 * counter->val / 5;
 					break;
 					case 'b':
-						counter->measure_ev(1.00 * counter->val / 5);
+						val = 1.00 * counter->val / 5;
 					break;
+					default:
+						EVLOG(&counter->port->log, EVLOG_WARN,
+						      EVLOG_COUNTER_RANGE, counter->range, 0);
+						proto_error(counter, &counter->stats.invalid_range);
+						goto out;
 				}
-					
+
+				stats_inc(&counter->stats.packets);
+
+				if (counter->t_last != 0 && t > counter->t_last)
+					stats_hist(&counter->stats.interval, (t - counter->t_last) / 1000);
+
+				counter->t_last = t;
+
+				counter->snap.seq++;
+				counter->snap.t     = t;
+				counter->snap.val   = val;
+				counter->snap.range = counter->range;
+				seqlock_write(&counter->snap_seq, &counter->snap_reg,
+				              &counter->snap, sizeof(counter->snap));
+
+				cb_start = libserial_time();
+
+				if (counter->measure_ev != NULL)
+					counter->measure_ev(val);
+
+				memset(&s, 0, sizeof(s));
+				s.val   = val;
+				s.range = counter->range;
+				s.t     = t;
+
+				if (counter->measure_sample != NULL)
+					counter->measure_sample(counter, &s);
+
+				CALL_OPS(counter, measure, val);
+				CALL_OPS(counter, sample, &s);
+
+				if (counter->exporter != NULL)
+					exporter_counter_sample(counter->exporter, &s);
+
+				if (counter->ring != NULL)
+					shmring_write(counter->ring, &s);
+
+				if (counter->samples != NULL)
+					counter->samples[counter->nsamples++] = s;
+
+				if (counter->cond != NULL)
+					cond_eval(counter->cond, COND_FREQ, val);
+
+				stats_add(&counter->stats.callback_ns, libserial_time() - cb_start);
+out:
 				counter->val = 0;
 				counter->stream_pos = -2;
 				return;
@@ -119,20 +249,112 @@ static void counter_parse(struct counter *counter, unsigned char byte)
 	}
 }
 
+static void process(struct counter *counter, const uint8_t *buf,
+                    uint32_t len, uint64_t t)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++) {
+		counter_parse(counter, buf[i],
+		              libserial_byte_time(t, counter->port->char_ns, i, len));
+	}
+}
+
+void counter_process(struct counter *counter, const uint8_t *buf,
+                     uint32_t len, uint64_t t)
+{
+	struct counter_sample *samples = counter->samples;
+
+	/* called from a callback of counter_process_samples() */
+	counter->samples = NULL;
+	process(counter, buf, len, t);
+	counter->samples = samples;
+}
+
+uint32_t counter_process_samples(struct counter *counter, const uint8_t *buf,
+                                 uint32_t len, uint64_t t,
+                                 struct counter_sample *s)
+{
+	struct counter_sample *samples = counter->samples;
+	uint32_t nsamples = counter->nsamples, ret;
+
+	counter->samples  = s;
+	counter->nsamples = 0;
+
+	process(counter, buf, len, t);
+
+	ret = counter->nsamples;
+
+	counter->samples  = samples;
+	counter->nsamples = nsamples;
+
+	return ret;
+}
+
 void counter_read(struct counter *counter)
 {
-	char buf[64];
+	uint8_t buf[64];
 	int len;
-	int i;
+	uint64_t t;
 
-	len = read(counter->port->fd, &buf, sizeof (buf));
+	len = libserial_read(counter->port, buf, sizeof (buf), &t);
 
 	//TODO: error
 	if (len < 0)
 		return;
 
-	for (i = 0; i < len; i++)
-		counter_parse(counter, buf[i]);
+	counter_process(counter, buf, len, t);
+}
+
+size_t counter_sync(const uint8_t *buf, size_t len, size_t pos)
+{
+	for (; pos < len; pos++) {
+		if (buf[pos] != PACKET_START)
+			continue;
+
+		/* 0xC9 may appear in data as well, check the next packet */
+		if (pos + PACKET_LEN >= len || buf[pos + PACKET_LEN] == PACKET_START)
+			return pos;
+	}
+
+	return len;
+}
+
+size_t counter_seed(const uint8_t *buf, size_t pos)
+{
+	(void) buf;
+
+	/* only the range of the previous packet is carried over */
+	return pos > PACKET_LEN ? pos - PACKET_LEN : 0;
+}
+
+int counter_publish(struct counter *counter, const char *name, uint32_t slots)
+{
+	shmring_destroy(counter->ring);
+	counter->ring = NULL;
+
+	if (name == NULL)
+		return 0;
+
+	counter->ring = shmring_create(name, SHMRING_COUNTER,
+	                               sizeof(struct counter_sample), slots);
+
+	return counter->ring == NULL ? -1 : 0;
+}
+
+/* seqlock copies whole uint64_t words */
+_Static_assert(sizeof(struct counter_snapshot) % sizeof(uint64_t) == 0,
+               "counter_snapshot size must be multiple of 8");
+
+void counter_get_snapshot(struct counter *counter,
+                          struct counter_snapshot *snap)
+{
+	seqlock_read(&counter->snap_seq, snap, &counter->snap_reg, sizeof(*snap));
+}
+
+void counter_get_stats(struct counter *counter, struct counter_stats *stats)
+{
+	stats_snapshot(stats, &counter->stats, sizeof(*stats));
 }
 
 static const char modes[] = {
@@ -141,15 +363,24 @@ static const char modes[] = {
 	0x32  /* 5 sec period off   */
 };
 
+static void command_done(struct libserial_port *port, void *priv,
+                         uint8_t cmd, int err)
+{
+	struct counter *counter = priv;
+
+	(void) port;
+
+	CALL_OPS(counter, command_done, cmd, err);
+}
+
 void counter_mode(struct counter *counter, enum counter_mode mode)
 {
 	if (mode > COUNTER_5SEC) {
-		printf("Invalid mode\n");
+		EVLOG(&counter->port->log, EVLOG_ERR, EVLOG_COUNTER_MODE, mode, 0);
 		return;
 	}
 
-	if (write(counter->port->fd, &modes[mode], 1) != 1)
-		printf("Error setting mode %s\n.", strerror(errno));
+	libserial_send(counter->port, &modes[mode], 1, command_done, counter);
 }
 
 /*
@@ -172,6 +403,24 @@ void counter_trigger(struct counter *counter, int8_t trig)
 	/* set trigger command bit */
 	trig |= 0x80;
 
-	if (write(counter->port->fd, &trig, 1) != 1)
-		printf("Error setting trigger %s\n.", strerror(errno));
+	libserial_send(counter->port, &trig, 1, command_done, counter);
+}
+
+int counter_export(struct counter *counter, struct exporter *exp)
+{
+	exporter_counter_destroy(counter->exporter);
+	counter->exporter = NULL;
+
+	if (exp == NULL)
+		return 0;
+
+	counter->exporter = exporter_counter_create(exp, counter->port->dev);
+
+	if (counter->exporter == NULL)
+		return -1;
+
+	exporter_counter_errors(counter->exporter, counter->stats.resync +
+	                        counter->stats.invalid_range);
+
+	return 0;
 }
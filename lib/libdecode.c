@@ -0,0 +1,466 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libvameter.h"
+#include "libcounter.h"
+#include "libdecode.h"
+
+#define DEFAULT_CHUNK (4 * 1024 * 1024)
+
+/*
+ * The parsers take uint32_t length, captures may be larger.
+ */
+#define MAX_PIECE (1u << 30)
+
+struct chunk {
+	/* counter seed start, last VAmeter ranges and references */
+	size_t seed;
+	struct vameter_seed vseed;
+	size_t start;
+	size_t end;
+
+	struct decode_record *recs;
+	size_t cnt;
+	size_t size;
+
+	int done;
+	int err;
+};
+
+struct job {
+	struct decode *dec;
+	const char *path;
+
+	const uint8_t *buf;
+	size_t len;
+
+	struct chunk *chunks;
+	unsigned int nchunks;
+
+	/* next chunk to decode, chunks emitted so far */
+	unsigned int next;
+	unsigned int emitted;
+
+	/* decoded chunks waiting to be emitted are limited to the window */
+	unsigned int window;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+void decode_init(struct decode *self, enum decode_type type,
+                 void (*emit)(struct decode *self,
+                              const struct decode_record *rec),
+                 void *priv)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->type       = type;
+	self->chunk_size = DEFAULT_CHUNK;
+	self->emit       = emit;
+	self->priv       = priv;
+}
+
+static void chunk_push(struct chunk *chunk, uint8_t chan, uint64_t t,
+                       float val, uint8_t range, uint8_t flags, char acdc)
+{
+	struct decode_record *rec;
+
+	if (chunk->err)
+		return;
+
+	if (chunk->cnt >= chunk->size) {
+		size_t size = chunk->size ? 2 * chunk->size : 1024;
+
+		rec = realloc(chunk->recs, size * sizeof(*rec));
+
+		if (rec == NULL) {
+			chunk->err = ENOMEM;
+			return;
+		}
+
+		chunk->recs = rec;
+		chunk->size = size;
+	}
+
+	rec = &chunk->recs[chunk->cnt++];
+
+	rec->t     = t;
+	rec->val   = val;
+	rec->chan  = chan;
+	rec->range = range;
+	rec->flags = flags;
+	rec->acdc  = acdc;
+}
+
+static void voltage_frame(struct VAmeter *meter, void *ctx,
+                          const struct vameter_sample *s)
+{
+	(void) meter;
+	chunk_push(ctx, DECODE_VOLTAGE, s->t, s->rms, s->range, s->flags, s->acdc);
+}
+
+static void current_frame(struct VAmeter *meter, void *ctx,
+                          const struct vameter_sample *s)
+{
+	(void) meter;
+	chunk_push(ctx, DECODE_CURRENT, s->t, s->rms, s->range, s->flags, s->acdc);
+}
+
+static const struct vameter_ops vameter_ops = {
+	.voltage_frame = voltage_frame,
+	.current_frame = current_frame,
+};
+
+static void counter_sample(struct counter *counter, void *ctx,
+                           const struct counter_sample *s)
+{
+	(void) counter;
+	chunk_push(ctx, DECODE_FREQ, s->t, s->val, s->range, 0, 0);
+}
+
+static const struct counter_ops counter_ops = {
+	.sample = counter_sample,
+};
+
+static void feed_vameter(struct VAmeter *meter, uint8_t *buf,
+                         size_t from, size_t to, uint32_t char_ns)
+{
+	size_t len;
+
+	while (from < to) {
+		len = to - from > MAX_PIECE ? MAX_PIECE : to - from;
+
+		vameter_process_ts(meter, buf + from, len,
+		                   (uint64_t)(from + len - 1) * char_ns);
+
+		from += len;
+	}
+}
+
+static void feed_counter(struct counter *counter, const uint8_t *buf,
+                         size_t from, size_t to, uint32_t char_ns)
+{
+	size_t len;
+
+	while (from < to) {
+		len = to - from > MAX_PIECE ? MAX_PIECE : to - from;
+
+		counter_process(counter, buf + from, len,
+		                (uint64_t)(from + len - 1) * char_ns);
+
+		from += len;
+	}
+}
+
+/*
+ * Runs the parser over the seed silently and then over the chunk, the
+ * frame that straddles the chunk start is completed by the first chunk
+ * byte and recorded.
+ */
+static void decode_vameter(struct job *job, struct chunk *chunk)
+{
+	struct vameter_listener listener;
+	struct VAmeter *meter;
+	uint8_t *buf = (uint8_t*)job->buf;
+	uint32_t char_ns;
+
+	meter = vameter_init(job->path);
+
+	if (meter == NULL) {
+		chunk->err = errno;
+		return;
+	}
+
+	if (job->dec->callib != NULL &&
+	    vameter_load_callib(meter, job->dec->callib)) {
+		chunk->err = EINVAL;
+		vameter_exit(meter);
+		return;
+	}
+
+	char_ns = meter->port->char_ns;
+
+	if (chunk->start)
+		vameter_seed_run(meter, buf, chunk->start, &chunk->vseed);
+
+	vameter_listen(meter, &listener, &vameter_ops, chunk);
+
+	feed_vameter(meter, buf, chunk->start, chunk->end, char_ns);
+
+	vameter_exit(meter);
+}
+
+static void decode_counter(struct job *job, struct chunk *chunk)
+{
+	struct counter_listener listener;
+	struct counter *counter;
+	uint32_t char_ns;
+
+	counter = counter_create(job->path, NULL, NULL);
+
+	if (counter == NULL) {
+		chunk->err = errno;
+		return;
+	}
+
+	char_ns = counter->port->char_ns;
+
+	feed_counter(counter, job->buf, chunk->seed, chunk->start, char_ns);
+
+	counter_listen(counter, &listener, &counter_ops, chunk);
+
+	feed_counter(counter, job->buf, chunk->start, chunk->end, char_ns);
+
+	counter_destroy(counter);
+}
+
+static void *worker(void *arg)
+{
+	struct job *job = arg;
+	struct chunk *chunk;
+
+	pthread_mutex_lock(&job->lock);
+
+	for (;;) {
+		while (job->next < job->nchunks &&
+		       job->next >= job->emitted + job->window)
+			pthread_cond_wait(&job->cond, &job->lock);
+
+		if (job->next >= job->nchunks)
+			break;
+
+		chunk = &job->chunks[job->next++];
+
+		pthread_mutex_unlock(&job->lock);
+
+		if (job->dec->type == DECODE_VAMETER)
+			decode_vameter(job, chunk);
+		else
+			decode_counter(job, chunk);
+
+		pthread_mutex_lock(&job->lock);
+		chunk->done = 1;
+		pthread_cond_broadcast(&job->cond);
+	}
+
+	pthread_mutex_unlock(&job->lock);
+
+	return NULL;
+}
+
+/*
+ * Splits the capture at frame starts close to multiples of chunk_size.
+ *
+ * The VAmeter seed is carried over from the previous chunk, each scan for
+ * the last ranges and references stops at the previous chunk start, so
+ * the capture is scanned once even if some frames are never sent.
+ */
+static int split(struct job *job)
+{
+	size_t size = job->dec->chunk_size ? job->dec->chunk_size : DEFAULT_CHUNK;
+	size_t n = job->len / size + 1;
+	size_t pos, start = 0, prev = 0;
+	struct vameter_seed vseed;
+	unsigned int i;
+
+	vameter_seed_init(&vseed);
+
+	job->chunks = calloc(n, sizeof(struct chunk));
+
+	if (job->chunks == NULL)
+		return -1;
+
+	for (i = 0; i < n && start < job->len; i++) {
+		struct chunk *chunk = &job->chunks[i];
+
+		pos = (i + 1) * size;
+
+		/* previous chunk may have been extended past this one */
+		if (pos <= start)
+			pos = start + 1;
+
+		if (job->dec->type == DECODE_VAMETER)
+			pos = vameter_sync(job->buf, job->len, pos);
+		else
+			pos = counter_sync(job->buf, job->len, pos);
+
+		chunk->start = start;
+		chunk->end   = pos < job->len ? pos : job->len;
+
+		if (start == 0) {
+			chunk->seed = 0;
+		} else if (job->dec->type == DECODE_VAMETER) {
+			vameter_seed_scan(&vseed, job->buf, prev, start);
+			chunk->vseed = vseed;
+		} else {
+			chunk->seed = counter_seed(job->buf, start);
+		}
+
+		prev  = start;
+		start = chunk->end;
+	}
+
+	job->nchunks = i;
+
+	return 0;
+}
+
+static int run(struct job *job)
+{
+	unsigned int threads = job->dec->threads;
+	unsigned int i, started;
+	pthread_t *tids;
+	size_t j;
+	int err = 0;
+
+	if (threads == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		threads = cpus > 0 ? cpus : 1;
+	}
+
+	if (threads > job->nchunks)
+		threads = job->nchunks;
+
+	job->window = 4 * threads;
+
+	tids = calloc(threads, sizeof(pthread_t));
+
+	if (tids == NULL)
+		return ENOMEM;
+
+	for (started = 0; started < threads; started++)
+		if (pthread_create(&tids[started], NULL, worker, job))
+			break;
+
+	/* at least one worker is needed to make any progress */
+	if (started == 0) {
+		free(tids);
+		return EAGAIN;
+	}
+
+	for (i = 0; i < job->nchunks; i++) {
+		struct chunk *chunk = &job->chunks[i];
+
+		pthread_mutex_lock(&job->lock);
+
+		while (!chunk->done)
+			pthread_cond_wait(&job->cond, &job->lock);
+
+		pthread_mutex_unlock(&job->lock);
+
+		if (chunk->err && !err)
+			err = chunk->err;
+
+		for (j = 0; !err && j < chunk->cnt; j++)
+			job->dec->emit(job->dec, &chunk->recs[j]);
+
+		if (!err)
+			job->dec->records += chunk->cnt;
+
+		free(chunk->recs);
+		chunk->recs = NULL;
+
+		pthread_mutex_lock(&job->lock);
+		job->emitted++;
+		pthread_cond_broadcast(&job->cond);
+		pthread_mutex_unlock(&job->lock);
+	}
+
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	free(tids);
+
+	return err;
+}
+
+int decode_file(struct decode *self, const char *path)
+{
+	struct job job;
+	struct stat st;
+	void *map;
+	int fd, err;
+
+	self->chunks  = 0;
+	self->records = 0;
+
+	fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	memset(&job, 0, sizeof(job));
+	job.dec  = self;
+	job.path = path;
+	job.buf  = map;
+	job.len  = st.st_size;
+
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+
+	if (split(&job))
+		err = errno;
+	else
+		err = run(&job);
+
+	self->chunks = job.nchunks;
+
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+	free(job.chunks);
+	munmap(map, st.st_size);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,219 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "libvameter.h"
+#include "libenergy.h"
+
+#define NS_PER_SEC  1000000000ull
+#define NS_PER_HOUR (3600 * NS_PER_SEC)
+
+/* voltage and current frames alternate, few frames per second */
+#define MAX_GAP (2 * NS_PER_SEC)
+
+/*
+ * Checkpoint is single line: energy charge seconds pairs gaps
+ *
+ * Gaps were added later, files without them are loaded with zero gaps.
+ */
+static void energy_load(struct vameter_energy *self)
+{
+	FILE *f = fopen(self->checkpoint, "r");
+	double energy, charge, seconds;
+	unsigned long long pairs;
+	unsigned int gaps = 0;
+
+	if (f == NULL)
+		return;
+
+	if (fscanf(f, "%lf %lf %lf %llu %u", &energy, &charge, &seconds,
+	           &pairs, &gaps) >= 4) {
+		self->energy  = energy;
+		self->charge  = charge;
+		self->seconds = seconds;
+		self->pairs   = pairs;
+		self->gaps    = gaps;
+	}
+
+	fclose(f);
+}
+
+struct vameter_energy *energy_create(const char *checkpoint, unsigned int period)
+{
+	struct vameter_energy *self = malloc(sizeof(struct vameter_energy));
+
+	if (self == NULL)
+		return NULL;
+
+	memset(self, 0, sizeof(*self));
+
+	self->max_gap = MAX_GAP;
+	self->period  = period * NS_PER_SEC;
+
+	if (checkpoint != NULL) {
+		self->checkpoint = strdup(checkpoint);
+
+		if (self->checkpoint == NULL) {
+			free(self);
+			return NULL;
+		}
+
+		energy_load(self);
+	}
+
+	return self;
+}
+
+void energy_destroy(struct vameter_energy *self)
+{
+	if (self == NULL)
+		return;
+
+	energy_checkpoint(self);
+	free(self->checkpoint);
+	free(self);
+}
+
+int energy_checkpoint(struct vameter_energy *self)
+{
+	size_t len;
+	char *tmp;
+	FILE *f;
+	int ret = -1;
+
+	if (self->checkpoint == NULL)
+		return 0;
+
+	len = strlen(self->checkpoint) + 5;
+	tmp = malloc(len);
+
+	if (tmp == NULL)
+		return -1;
+
+	/* write and rename so that the checkpoint is never half written */
+	snprintf(tmp, len, "%s.tmp", self->checkpoint);
+
+	f = fopen(tmp, "w");
+
+	if (f == NULL)
+		goto err;
+
+	fprintf(f, "%.9f %.9f %.3f %llu %u\n", self->energy, self->charge,
+	        self->seconds, (unsigned long long)self->pairs, self->gaps);
+
+	if (fclose(f))
+		goto err;
+
+	ret = rename(tmp, self->checkpoint);
+err:
+	free(tmp);
+	return ret;
+}
+
+int energy_poll(struct vameter_energy *self)
+{
+	if (!self->checkpoint_due)
+		return 0;
+
+	self->checkpoint_due = 0;
+
+	return energy_checkpoint(self);
+}
+
+void energy_reset(struct vameter_energy *self)
+{
+	self->energy   = 0;
+	self->charge   = 0;
+	self->seconds  = 0;
+	self->pairs    = 0;
+	self->gaps     = 0;
+	self->has_pair = 0;
+}
+
+/*
+ * Signed mean for DC, RMS for AC.
+ */
+static float frame_value(const struct vameter_sample *s)
+{
+	return s->acdc == VAMETER_AC ? s->rms : s->dc;
+}
+
+void energy_voltage(struct vameter_energy *self, const struct vameter_sample *s)
+{
+	self->voltage    = frame_value(s);
+	self->voltage_ac = s->acdc == VAMETER_AC;
+	self->t_voltage  = s->t;
+}
+
+void energy_current(struct vameter_energy *self, const struct vameter_sample *s)
+{
+	float current = frame_value(s);
+	float power, prev_power = self->power, prev_current = self->current;
+	uint64_t dt;
+
+	/* no voltage frame close enough */
+	if (self->t_voltage == 0 || s->t - self->t_voltage > self->max_gap) {
+		self->has_pair = 0;
+		return;
+	}
+
+	/* apparent power if any of them is AC */
+	if (self->voltage_ac || s->acdc == VAMETER_AC)
+		power = fabsf(self->voltage) * fabsf(current);
+	else
+		power = self->voltage * current;
+
+	self->current = current;
+	self->power   = power;
+
+	if (self->has_pair) {
+		dt = s->t - self->t_last;
+
+		if (dt <= self->max_gap) {
+			/* trapezoidal rule */
+			self->energy  += (power + prev_power) / 2 * dt / NS_PER_HOUR;
+			self->charge  += (current + prev_current) / 2 * dt / NS_PER_HOUR;
+			self->seconds += (double)dt / NS_PER_SEC;
+		} else {
+			self->gaps++;
+		}
+	}
+
+	self->pairs++;
+	self->has_pair = 1;
+	self->t_last   = s->t;
+
+	if (self->checkpoint == NULL || self->period == 0)
+		return;
+
+	if (self->t_checkpoint == 0)
+		self->t_checkpoint = s->t;
+
+	/* written from energy_poll(), outside of the parser */
+	if (s->t - self->t_checkpoint >= self->period) {
+		self->checkpoint_due = 1;
+		self->t_checkpoint   = s->t;
+	}
+}
@@ -0,0 +1,211 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "libevlog.h"
+
+#define NS_PER_SEC 1000000000ull
+
+static const char *level_names[] = {
+	[EVLOG_ERR]   = "error",
+	[EVLOG_WARN]  = "warning",
+	[EVLOG_INFO]  = "info",
+	[EVLOG_DEBUG] = "debug",
+};
+
+static const struct event_desc {
+	const char *fmt;
+	uint8_t     err;           /* arg is errno */
+} descs[] = {
+	[EVLOG_READ_ERROR]      = {"read: %s", 1},
+	[EVLOG_WRITE_ERROR]     = {"write of command 0x%2$02x: %1$s", 1},
+	[EVLOG_VAMETER_UNKNOWN] = {"unknown command 0x%02x", 0},
+	[EVLOG_VAMETER_VRANGE]  = {"invalid voltage range 0x%02x", 0},
+	[EVLOG_VAMETER_ARANGE]  = {"invalid current range 0x%02x", 0},
+	[EVLOG_COUNTER_LOST]    = {"lost 0x%02x", 0},
+	[EVLOG_COUNTER_RANGE]   = {"invalid range 0x%02x", 0},
+	[EVLOG_COUNTER_MODE]    = {"invalid mode %u", 0},
+	[EVLOG_GEN_LOST]        = {"lost 0x%02x", 0},
+	[EVLOG_GEN_ACK]         = {"operation successful", 0},
+	[EVLOG_GEN_STATE_START] = {"start of state packet", 0},
+	[EVLOG_GEN_STATE]       = {"state wave %u freq 0x%06x", 0},
+	[EVLOG_GEN_MEMORY]      = {"memory %u loaded", 0},
+	[EVLOG_GEN_FREQ]        = {"frequency word %u", 0},
+	[EVLOG_GEN_UNSUPPORTED] = {"cannot set frequency for wave %u", 0},
+};
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void evlog_init(struct evlog *self, const char *name)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->level = EVLOG_INFO;
+	self->name  = name;
+
+	evlog_rate(self, 10, 20);
+}
+
+void evlog_rate(struct evlog *self, uint32_t rate, uint32_t burst)
+{
+	self->rate   = rate;
+	self->burst  = burst ? burst : 1;
+	self->credit = rate ? self->burst * (NS_PER_SEC / rate) : 0;
+	self->t_last = 0;
+}
+
+void evlog_sink(struct evlog *self,
+                void (*sink)(const struct evlog *self, const struct evlog_event *ev),
+                void *priv)
+{
+	self->sink = sink;
+	self->priv = priv;
+}
+
+/*
+ * Token bucket, each event costs NS_PER_SEC / rate ns of credit.
+ */
+static int rate_limit(struct evlog *self, uint64_t t)
+{
+	uint64_t cost, max;
+
+	if (self->rate == 0)
+		return 0;
+
+	cost = NS_PER_SEC / self->rate;
+	max  = self->burst * cost;
+
+	if (self->t_last != 0 && t > self->t_last)
+		self->credit += t - self->t_last;
+
+	self->t_last = t;
+
+	if (self->credit > max)
+		self->credit = max;
+
+	if (self->credit < cost)
+		return 1;
+
+	self->credit -= cost;
+
+	return 0;
+}
+
+void evlog_emit(struct evlog *self, enum evlog_level level,
+                enum evlog_code code, uint32_t arg, uint32_t arg2)
+{
+	struct evlog_event *ev;
+	uint64_t t = now();
+
+	if (rate_limit(self, t)) {
+		self->suppressed++;
+		self->dropped++;
+		return;
+	}
+
+	ev = &self->ring[self->head % EVLOG_RING];
+
+	ev->t          = t;
+	ev->code       = code;
+	ev->level      = level;
+	ev->arg        = arg;
+	ev->arg2       = arg2;
+	ev->suppressed = self->suppressed;
+
+	self->suppressed = 0;
+	self->head++;
+
+	if (self->sink != NULL)
+		self->sink(self, ev);
+}
+
+int evlog_get(const struct evlog *self, uint32_t *pos, struct evlog_event *ev)
+{
+	if (*pos == self->head)
+		return 0;
+
+	/* overrun, skip to the oldest event */
+	if (self->head - *pos > EVLOG_RING)
+		*pos = self->head - EVLOG_RING;
+
+	*ev = self->ring[*pos % EVLOG_RING];
+	(*pos)++;
+
+	return 1;
+}
+
+const char *evlog_level_name(enum evlog_level level)
+{
+	if (level > EVLOG_DEBUG)
+		return "unknown";
+
+	return level_names[level];
+}
+
+int evlog_format(const struct evlog *self, const struct evlog_event *ev,
+                 char *buf, size_t size)
+{
+	const struct event_desc *desc;
+	int len;
+
+	len = snprintf(buf, size, "%s: %s: ", self->name ? self->name : "?",
+	               evlog_level_name(ev->level));
+
+	if (len < 0 || (size_t)len >= size)
+		return len;
+
+	if (ev->code >= EVLOG_CODES) {
+		len += snprintf(buf + len, size - len, "event %u", ev->code);
+	} else {
+		desc = &descs[ev->code];
+
+		if (desc->err)
+			len += snprintf(buf + len, size - len, desc->fmt,
+			                strerror(ev->arg), ev->arg2);
+		else
+			len += snprintf(buf + len, size - len, desc->fmt,
+			                ev->arg, ev->arg2);
+	}
+
+	if ((size_t)len < size && ev->suppressed)
+		len += snprintf(buf + len, size - len, " (%u suppressed)",
+		                ev->suppressed);
+
+	return len;
+}
+
+void evlog_stderr(const struct evlog *self, const struct evlog_event *ev)
+{
+	char buf[256];
+
+	evlog_format(self, ev, buf, sizeof(buf));
+	fprintf(stderr, "%s\n", buf);
+}
@@ -0,0 +1,914 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libvameter.h"
+#include "libcounter.h"
+#include "libexporter.h"
+
+#define HTTP_HEADER "HTTP/1.0 200 OK\r\n" \
+                    "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n" \
+                    "Connection: close\r\n" \
+                    "Content-Length: %zu\r\n\r\n"
+
+static int set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		return -1;
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* remove stale socket from previous run */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)))
+		goto err;
+
+	return fd;
+err:
+	close(fd);
+	return -1;
+}
+
+static int listen_tcp(const char *port)
+{
+	struct sockaddr_in addr;
+	char *end;
+	long p = strtol(port, &end, 10);
+	int fd, one = 1;
+
+	if (*end || p <= 0 || p > 65535) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_port        = htons(p);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+struct exporter *exporter_create(const char *addr)
+{
+	struct exporter *self = malloc(sizeof(struct exporter));
+	int i, err;
+
+	if (self == NULL)
+		return NULL;
+
+	self->path = NULL;
+
+	if (strchr(addr, '/') != NULL) {
+		self->path = strdup(addr);
+
+		if (self->path == NULL) {
+			free(self);
+			return NULL;
+		}
+
+		self->fd = listen_unix(addr);
+	} else {
+		self->fd = listen_tcp(addr);
+	}
+
+	if (self->fd < 0)
+		goto err;
+
+	if (listen(self->fd, EXPORTER_CLIENTS) || set_nonblock(self->fd)) {
+		close(self->fd);
+		goto err;
+	}
+
+	self->dirty     = 1;
+	self->scrapes   = 0;
+	self->renders   = 0;
+	self->families  = NULL;
+	self->buf       = NULL;
+	self->body      = NULL;
+	self->body_size = 0;
+
+	for (i = 0; i < EXPORTER_CLIENTS; i++) {
+		self->clients[i].fd  = -1;
+		self->clients[i].buf = NULL;
+	}
+
+	return self;
+err:
+	err = errno;
+	free(self->path);
+	free(self);
+	errno = err;
+	return NULL;
+}
+
+static void buf_put(struct exporter_buf *buf)
+{
+	if (buf != NULL && --buf->refs == 0)
+		free(buf);
+}
+
+static void client_close(struct exporter_client *client)
+{
+	close(client->fd);
+	buf_put(client->buf);
+	client->fd  = -1;
+	client->buf = NULL;
+}
+
+static void family_free(struct exporter_family *family)
+{
+	struct exporter_series *i, *next;
+
+	for (i = family->series; i != NULL; i = next) {
+		next = i->next;
+		free(i->labels);
+		free(i);
+	}
+
+	free(family->name);
+	free(family->help);
+	free(family);
+}
+
+void exporter_destroy(struct exporter *self)
+{
+	struct exporter_family *i, *next;
+	int j;
+
+	if (self == NULL)
+		return;
+
+	for (j = 0; j < EXPORTER_CLIENTS; j++)
+		if (self->clients[j].fd >= 0)
+			client_close(&self->clients[j]);
+
+	close(self->fd);
+
+	if (self->path != NULL) {
+		unlink(self->path);
+		free(self->path);
+	}
+
+	for (i = self->families; i != NULL; i = next) {
+		next = i->next;
+		family_free(i);
+	}
+
+	buf_put(self->buf);
+	free(self->body);
+	free(self);
+}
+
+static struct exporter_family *family_get(struct exporter *self,
+                                          const char *name,
+                                          enum exporter_type type,
+                                          const char *help)
+{
+	struct exporter_family *i, **last = &self->families;
+
+	for (i = self->families; i != NULL; i = i->next) {
+		if (!strcmp(i->name, name))
+			return i;
+		last = &i->next;
+	}
+
+	i = malloc(sizeof(struct exporter_family));
+
+	if (i == NULL)
+		return NULL;
+
+	i->name = strdup(name);
+	i->help = strdup(help ? help : "");
+
+	if (i->name == NULL || i->help == NULL) {
+		free(i->name);
+		free(i->help);
+		free(i);
+		return NULL;
+	}
+
+	i->type   = type;
+	i->series = NULL;
+	i->next   = NULL;
+
+	/* keep families in order of creation */
+	*last = i;
+
+	return i;
+}
+
+struct exporter_series *exporter_series(struct exporter *self,
+                                        const char *name,
+                                        enum exporter_type type,
+                                        const char *help,
+                                        const char *labels)
+{
+	struct exporter_family *family = family_get(self, name, type, help);
+	struct exporter_series *i, **last;
+
+	if (family == NULL)
+		return NULL;
+
+	if (labels == NULL)
+		labels = "";
+
+	last = &family->series;
+
+	for (i = family->series; i != NULL; i = i->next) {
+		if (!strcmp(i->labels, labels))
+			return i;
+		last = &i->next;
+	}
+
+	i = malloc(sizeof(struct exporter_series));
+
+	if (i == NULL)
+		return NULL;
+
+	i->labels = strdup(labels);
+
+	if (i->labels == NULL) {
+		free(i);
+		return NULL;
+	}
+
+	i->val    = 0;
+	i->family = family;
+	i->next   = NULL;
+	*last     = i;
+
+	self->dirty = 1;
+
+	return i;
+}
+
+void exporter_series_remove(struct exporter *self,
+                            struct exporter_series *series)
+{
+	struct exporter_family *family, **fi;
+	struct exporter_series **i;
+
+	if (series == NULL)
+		return;
+
+	family = series->family;
+
+	for (i = &family->series; *i != NULL; i = &(*i)->next)
+		if (*i == series) {
+			*i = series->next;
+			break;
+		}
+
+	free(series->labels);
+	free(series);
+
+	self->dirty = 1;
+
+	if (family->series != NULL)
+		return;
+
+	for (fi = &self->families; *fi != NULL; fi = &(*fi)->next)
+		if (*fi == family) {
+			*fi = family->next;
+			break;
+		}
+
+	family_free(family);
+}
+
+void exporter_set(struct exporter *self, struct exporter_series *series,
+                  double val)
+{
+	if (series == NULL)
+		return;
+
+	series->val = val;
+	self->dirty = 1;
+}
+
+/*
+ * Appends formatted string to the body, grows it as needed.
+ */
+static int body_printf(struct exporter *self, size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+	size_t avail, size;
+	char *body;
+	int ret;
+
+	for (;;) {
+		avail = self->body_size - *len;
+
+		va_start(ap, fmt);
+		ret = vsnprintf(avail ? self->body + *len : NULL, avail, fmt, ap);
+		va_end(ap);
+
+		if (ret < 0)
+			return -1;
+
+		if ((size_t)ret < avail) {
+			*len += ret;
+			return 0;
+		}
+
+		size = 2 * self->body_size + ret + 1;
+		body = realloc(self->body, size);
+
+		if (body == NULL)
+			return -1;
+
+		self->body      = body;
+		self->body_size = size;
+	}
+}
+
+static const char *type_names[] = {
+	[EXPORTER_GAUGE]   = "gauge",
+	[EXPORTER_COUNTER] = "counter",
+};
+
+static int render_body(struct exporter *self, size_t *len)
+{
+	struct exporter_family *f;
+	struct exporter_series *s;
+	const char *suffix;
+
+	*len = 0;
+
+	for (f = self->families; f != NULL; f = f->next) {
+		if (body_printf(self, len, "# TYPE %s %s\n", f->name, type_names[f->type]))
+			return -1;
+
+		if (f->help[0] && body_printf(self, len, "# HELP %s %s\n", f->name, f->help))
+			return -1;
+
+		suffix = f->type == EXPORTER_COUNTER ? "_total" : "";
+
+		for (s = f->series; s != NULL; s = s->next) {
+			const char *lo = s->labels[0] ? "{" : "";
+			const char *lc = s->labels[0] ? "}" : "";
+
+			if (body_printf(self, len, "%s%s%s%s%s %.9g\n", f->name, suffix,
+			                lo, s->labels, lc, s->val))
+				return -1;
+		}
+	}
+
+	return body_printf(self, len, "# EOF\n");
+}
+
+/*
+ * Renders complete HTTP response. The previous buffer is reused unless it's
+ * still being sent to a client.
+ */
+static int render(struct exporter *self)
+{
+	struct exporter_buf *buf = self->buf;
+	size_t body_len, size;
+	int hdr_len;
+
+	if (render_body(self, &body_len))
+		return -1;
+
+	hdr_len = snprintf(NULL, 0, HTTP_HEADER, body_len);
+	size = hdr_len + body_len + 1;
+
+	if (buf == NULL || buf->refs > 1 || buf->size < size) {
+		buf = malloc(sizeof(struct exporter_buf) + size);
+
+		if (buf == NULL)
+			return -1;
+
+		buf->refs = 1;
+		buf->size = size;
+
+		buf_put(self->buf);
+		self->buf = buf;
+	}
+
+	snprintf(buf->data, size, HTTP_HEADER, body_len);
+	memcpy(buf->data + hdr_len, self->body, body_len);
+	buf->len = hdr_len + body_len;
+
+	self->dirty = 0;
+	self->renders++;
+
+	return 0;
+}
+
+int exporter_pollfds(struct exporter *self, struct pollfd *fds, int max)
+{
+	int i, cnt = 0, free_slot = 0;
+
+	for (i = 0; i < EXPORTER_CLIENTS; i++) {
+		struct exporter_client *client = &self->clients[i];
+
+		if (client->fd < 0) {
+			free_slot = 1;
+			continue;
+		}
+
+		if (cnt >= max)
+			continue;
+
+		fds[cnt].fd     = client->fd;
+		fds[cnt].events = client->buf == NULL ? POLLIN : POLLOUT;
+		cnt++;
+	}
+
+	/*
+	 * Connections are not accepted while all slots are busy, the
+	 * listening socket would stay readable and poll() would spin.
+	 */
+	if (free_slot && cnt < max) {
+		fds[cnt].fd     = self->fd;
+		fds[cnt].events = POLLIN;
+		cnt++;
+	}
+
+	return cnt;
+}
+
+int exporter_timeout(struct exporter *self)
+{
+	uint64_t now = now_ms(), first = UINT64_MAX;
+	int i;
+
+	for (i = 0; i < EXPORTER_CLIENTS; i++) {
+		if (self->clients[i].fd >= 0 && self->clients[i].deadline < first)
+			first = self->clients[i].deadline;
+	}
+
+	if (first == UINT64_MAX)
+		return -1;
+
+	return first > now ? (int)(first - now) : 0;
+}
+
+static void client_accept(struct exporter *self)
+{
+	int i, fd;
+
+	for (;;) {
+		for (i = 0; i < EXPORTER_CLIENTS; i++)
+			if (self->clients[i].fd < 0)
+				break;
+
+		/* all slots are busy, leave the rest in the backlog */
+		if (i == EXPORTER_CLIENTS)
+			return;
+
+		fd = accept(self->fd, NULL, NULL);
+
+		if (fd < 0)
+			return;
+
+		if (set_nonblock(fd)) {
+			close(fd);
+			continue;
+		}
+
+		self->clients[i].fd       = fd;
+		self->clients[i].newlines = 0;
+		self->clients[i].pos      = 0;
+		self->clients[i].deadline = now_ms() + EXPORTER_TIMEOUT_MS;
+		self->clients[i].buf      = NULL;
+	}
+}
+
+/*
+ * Reads request up to the empty line, returns 1 once it's complete.
+ * Content of the request is ignored, every request gets the metrics.
+ */
+static int client_read(struct exporter_client *client)
+{
+	char buf[256];
+	ssize_t ret, i;
+
+	for (;;) {
+		ret = read(client->fd, buf, sizeof(buf));
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return errno == EAGAIN ? 0 : -1;
+		}
+
+		/* closed before the request was complete */
+		if (ret == 0)
+			return -1;
+
+		for (i = 0; i < ret; i++) {
+			switch (buf[i]) {
+			case '\r':
+			break;
+			case '\n':
+				if (++client->newlines == 2)
+					return 1;
+			break;
+			default:
+				client->newlines = 0;
+			}
+		}
+	}
+}
+
+static void client_write(struct exporter_client *client)
+{
+	struct exporter_buf *buf = client->buf;
+	ssize_t ret;
+
+	while (client->pos < buf->len) {
+		ret = write(client->fd, buf->data + client->pos,
+		            buf->len - client->pos);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN)
+				client_close(client);
+
+			return;
+		}
+
+		client->pos += ret;
+	}
+
+	shutdown(client->fd, SHUT_WR);
+	client_close(client);
+}
+
+void exporter_poll(struct exporter *self)
+{
+	uint64_t now = now_ms();
+	int i;
+
+	/* stalled clients first, so that their slots can be reused */
+	for (i = 0; i < EXPORTER_CLIENTS; i++) {
+		struct exporter_client *client = &self->clients[i];
+
+		if (client->fd >= 0 && client->deadline <= now)
+			client_close(client);
+	}
+
+	client_accept(self);
+
+	for (i = 0; i < EXPORTER_CLIENTS; i++) {
+		struct exporter_client *client = &self->clients[i];
+
+		if (client->fd < 0)
+			continue;
+
+		if (client->buf == NULL) {
+			switch (client_read(client)) {
+			case -1:
+				client_close(client);
+				continue;
+			case 0:
+				continue;
+			}
+
+			if ((self->dirty || self->buf == NULL) && render(self)) {
+				client_close(client);
+				continue;
+			}
+
+			client->buf = self->buf;
+			client->buf->refs++;
+			self->scrapes++;
+		}
+
+		client_write(client);
+	}
+}
+
+int exporter_wait(struct exporter *self, int fd)
+{
+	struct pollfd fds[EXPORTER_CLIENTS + 2];
+	int cnt;
+
+	fds[0].fd     = fd;
+	fds[0].events = POLLIN;
+
+	cnt = 1 + exporter_pollfds(self, fds + 1, EXPORTER_CLIENTS + 1);
+
+	if (poll(fds, cnt, exporter_timeout(self)) < 0)
+		return 0;
+
+	exporter_poll(self);
+
+	return (fds[0].revents & (POLLIN | POLLHUP)) != 0;
+}
+
+/*
+ * Builds device="path" label, the whole path is used so that devices with
+ * the same name in different directories get different series.
+ */
+static char *device_label(const char *device)
+{
+	char *label, *p;
+
+	/* worst case every character is escaped */
+	label = malloc(2 * strlen(device) + 16);
+
+	if (label == NULL)
+		return NULL;
+
+	p = label + sprintf(label, "device=\"");
+
+	for (; *device; device++) {
+		switch (*device) {
+		case '"':
+		case '\\':
+			*p++ = '\\';
+			*p++ = *device;
+		break;
+		case '\n':
+			*p++ = '\\';
+			*p++ = 'n';
+		break;
+		default:
+			*p++ = *device;
+		}
+	}
+
+	strcpy(p, "\"");
+
+	return label;
+}
+
+/*
+ * Returns 1 if series name with labels exists already.
+ */
+static int series_exists(struct exporter *exp, const char *name,
+                         const char *labels)
+{
+	struct exporter_family *f;
+	struct exporter_series *i;
+
+	for (f = exp->families; f != NULL; f = f->next) {
+		if (strcmp(f->name, name))
+			continue;
+
+		for (i = f->series; i != NULL; i = i->next)
+			if (!strcmp(i->labels, labels))
+				return 1;
+	}
+
+	return 0;
+}
+
+static struct exporter_series *chan_series(struct exporter *exp,
+                                           const char *name,
+                                           enum exporter_type type,
+                                           const char *help,
+                                           const char *dev,
+                                           const char *chan)
+{
+	char labels[strlen(dev) + 32];
+
+	snprintf(labels, sizeof(labels), "%s,channel=\"%s\"", dev, chan);
+
+	return exporter_series(exp, name, type, help, labels);
+}
+
+struct exporter_vameter *exporter_vameter_create(struct exporter *exp,
+                                                 const char *device)
+{
+	struct exporter_vameter *self = malloc(sizeof(struct exporter_vameter));
+	char *dev = device_label(device);
+
+	if (self == NULL || dev == NULL)
+		goto err;
+
+	/* the series would be shared and freed by whoever is destroyed first */
+	if (series_exists(exp, "vameter_voltage_volts", dev)) {
+		errno = EEXIST;
+		goto err;
+	}
+
+	self->exp = exp;
+
+	self->voltage = exporter_series(exp, "vameter_voltage_volts", EXPORTER_GAUGE,
+	                                "True RMS voltage of the last frame.", dev);
+	self->current = exporter_series(exp, "vameter_current_amperes", EXPORTER_GAUGE,
+	                                "True RMS current of the last frame.", dev);
+	self->voltage_range = exporter_series(exp, "vameter_voltage_range", EXPORTER_GAUGE,
+	                                      "Voltage range, 0 - 7 for A - H.", dev);
+	self->current_range = exporter_series(exp, "vameter_current_range", EXPORTER_GAUGE,
+	                                      "Current range, 4 * hw_switch + 0 - 3 for A - D.", dev);
+	self->voltage_ac = exporter_series(exp, "vameter_voltage_ac", EXPORTER_GAUGE,
+	                                   "1 if voltage is AC, 0 if DC.", dev);
+	self->current_ac = exporter_series(exp, "vameter_current_ac", EXPORTER_GAUGE,
+	                                   "1 if current is AC, 0 if DC.", dev);
+	self->voltage_frames = chan_series(exp, "vameter_frames", EXPORTER_COUNTER,
+	                                   "Sample frames processed.", dev, "voltage");
+	self->current_frames = chan_series(exp, "vameter_frames", EXPORTER_COUNTER,
+	                                   "Sample frames processed.", dev, "current");
+	self->errors = exporter_series(exp, "vameter_errors", EXPORTER_COUNTER,
+	                               "Protocol errors.", dev);
+
+	free(dev);
+
+	if (!self->voltage || !self->current || !self->voltage_range ||
+	    !self->current_range || !self->voltage_ac || !self->current_ac ||
+	    !self->voltage_frames || !self->current_frames || !self->errors) {
+		exporter_vameter_destroy(self);
+		return NULL;
+	}
+
+	return self;
+err:
+	free(dev);
+	free(self);
+	return NULL;
+}
+
+void exporter_vameter_destroy(struct exporter_vameter *self)
+{
+	if (self == NULL)
+		return;
+
+	exporter_series_remove(self->exp, self->voltage);
+	exporter_series_remove(self->exp, self->current);
+	exporter_series_remove(self->exp, self->voltage_range);
+	exporter_series_remove(self->exp, self->current_range);
+	exporter_series_remove(self->exp, self->voltage_ac);
+	exporter_series_remove(self->exp, self->current_ac);
+	exporter_series_remove(self->exp, self->voltage_frames);
+	exporter_series_remove(self->exp, self->current_frames);
+	exporter_series_remove(self->exp, self->errors);
+
+	free(self);
+}
+
+void exporter_vameter_voltage(struct exporter_vameter *self,
+                              const struct vameter_sample *s)
+{
+	float sign = s->acdc == VAMETER_DC_NEG ? -1 : 1;
+
+	exporter_set(self->exp, self->voltage, sign * s->rms);
+	exporter_set(self->exp, self->voltage_range, s->range);
+	exporter_set(self->exp, self->voltage_ac, s->acdc == VAMETER_AC);
+	exporter_set(self->exp, self->voltage_frames, self->voltage_frames->val + 1);
+}
+
+void exporter_vameter_current(struct exporter_vameter *self,
+                              const struct vameter_sample *s,
+                              uint8_t hw_switch)
+{
+	float sign = s->acdc == VAMETER_DC_NEG ? -1 : 1;
+
+	exporter_set(self->exp, self->current, sign * s->rms);
+	exporter_set(self->exp, self->current_range, 4 * hw_switch + s->range);
+	exporter_set(self->exp, self->current_ac, s->acdc == VAMETER_AC);
+	exporter_set(self->exp, self->current_frames, self->current_frames->val + 1);
+}
+
+void exporter_vameter_errors(struct exporter_vameter *self, uint32_t errors)
+{
+	exporter_set(self->exp, self->errors, errors);
+}
+
+struct exporter_counter *exporter_counter_create(struct exporter *exp,
+                                                 const char *device)
+{
+	struct exporter_counter *self = malloc(sizeof(struct exporter_counter));
+	char *dev = device_label(device);
+
+	if (self == NULL || dev == NULL)
+		goto err;
+
+	/* the series would be shared and freed by whoever is destroyed first */
+	if (series_exists(exp, "counter_frequency_hertz", dev)) {
+		errno = EEXIST;
+		goto err;
+	}
+
+	self->exp = exp;
+
+	self->freq = exporter_series(exp, "counter_frequency_hertz", EXPORTER_GAUGE,
+	                             "Last measured frequency.", dev);
+	self->range = exporter_series(exp, "counter_range", EXPORTER_GAUGE,
+	                              "Range character code.", dev);
+	self->samples = exporter_series(exp, "counter_samples", EXPORTER_COUNTER,
+	                                "Measurements received.", dev);
+	self->errors = exporter_series(exp, "counter_errors", EXPORTER_COUNTER,
+	                               "Protocol errors.", dev);
+
+	free(dev);
+
+	if (!self->freq || !self->range || !self->samples || !self->errors) {
+		exporter_counter_destroy(self);
+		return NULL;
+	}
+
+	return self;
+err:
+	free(dev);
+	free(self);
+	return NULL;
+}
+
+void exporter_counter_destroy(struct exporter_counter *self)
+{
+	if (self == NULL)
+		return;
+
+	exporter_series_remove(self->exp, self->freq);
+	exporter_series_remove(self->exp, self->range);
+	exporter_series_remove(self->exp, self->samples);
+	exporter_series_remove(self->exp, self->errors);
+
+	free(self);
+}
+
+void exporter_counter_sample(struct exporter_counter *self,
+                             const struct counter_sample *s)
+{
+	exporter_set(self->exp, self->freq, s->val);
+	exporter_set(self->exp, self->range, s->range);
+	exporter_set(self->exp, self->samples, self->samples->val + 1);
+}
+
+void exporter_counter_errors(struct exporter_counter *self, uint32_t errors)
+{
+	exporter_set(self->exp, self->errors, errors);
+}
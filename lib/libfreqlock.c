@@ -0,0 +1,186 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <math.h>
+#include <poll.h>
+
+#include "libfreqlock.h"
+
+/* counter readings are thrown away after gate or frequency change */
+#define SKIP_READINGS 1
+
+void freqlock_init(struct freqlock *self, struct counter *counter,
+                   struct generator *gen, float target)
+{
+	self->counter    = counter;
+	self->gen        = gen;
+	self->target     = target;
+	self->gain       = 0.7;
+	self->coarse_ppm = 1000;
+	self->lock_ppm   = 10;
+	self->lock_cnt   = 2;
+
+	self->word       = 0;
+	self->fine       = 0;
+	self->skip       = 0;
+	self->locked     = 0;
+	self->in_lock    = 0;
+
+	self->steps      = 0;
+	self->freq       = 0;
+	self->error_ppm  = 0;
+	self->lock_time  = 0;
+}
+
+static float secs_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+	       (float)(now.tv_nsec - start->tv_nsec) / 1000000000;
+}
+
+int freqlock_start(struct freqlock *self)
+{
+	if (generator_freq_word(self->gen, self->target, &self->word))
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &self->start);
+
+	self->fine    = 0;
+	self->locked  = 0;
+	self->in_lock = 0;
+	self->steps   = 0;
+	self->skip    = SKIP_READINGS;
+
+	counter_mode(self->counter, COUNTER_05SEC);
+	generator_set_freq(self->gen, self->word);
+
+	return 0;
+}
+
+void freqlock_feed(struct freqlock *self, float freq)
+{
+	float ideal, delta;
+	int32_t step;
+
+	if (self->locked)
+		return;
+
+	if (self->skip) {
+		self->skip--;
+		return;
+	}
+
+	/* no input or nonsense reading */
+	if (!(freq > 0))
+		return;
+
+	self->freq      = freq;
+	self->error_ppm = 1000000 * (freq - self->target) / self->target;
+
+	/* frequency is linear in the 24 bit value */
+	ideal = (float)self->word * self->target / freq;
+	delta = ideal - self->word;
+
+	/* within lock window or at the resolution of the generator */
+	if (fabsf(self->error_ppm) <= self->lock_ppm || fabsf(delta) <= 0.5) {
+		if (!self->fine) {
+			self->fine = 1;
+			self->skip = SKIP_READINGS;
+			counter_mode(self->counter, COUNTER_5SEC);
+			return;
+		}
+
+		if (++self->in_lock >= self->lock_cnt) {
+			self->locked    = 1;
+			self->lock_time = secs_since(&self->start);
+		}
+		return;
+	}
+
+	self->in_lock = 0;
+
+	if (!self->fine && fabsf(self->error_ppm) < self->coarse_ppm) {
+		self->fine = 1;
+		self->skip = SKIP_READINGS;
+		counter_mode(self->counter, COUNTER_5SEC);
+	}
+
+	step = lroundf(self->gain * delta);
+
+	if (step == 0)
+		step = delta > 0 ? 1 : -1;
+
+	self->word = (self->word + step) & 0xffffff;
+	self->steps++;
+	self->skip = SKIP_READINGS;
+
+	generator_set_freq(self->gen, self->word);
+}
+
+static void freqlock_measure(struct counter *counter, void *ctx, float val)
+{
+	(void) counter;
+	freqlock_feed(ctx, val);
+}
+
+static const struct counter_ops freqlock_ops = {
+	.measure = freqlock_measure,
+};
+
+int freqlock_run(struct freqlock *self, int timeout_ms)
+{
+	struct pollfd pfd[2] = {
+		{.fd = self->counter->port->fd, .events = POLLIN},
+		{.fd = self->gen->port->fd, .events = POLLIN},
+	};
+	struct timespec start;
+	int left;
+
+	counter_listen(self->counter, &self->listener, &freqlock_ops, self);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (!self->locked) {
+		left = timeout_ms - 1000 * secs_since(&start);
+
+		if (left <= 0)
+			break;
+
+		if (poll(pfd, 2, left) < 0)
+			break;
+
+		if (pfd[0].revents & POLLIN)
+			counter_read(self->counter);
+
+		/* drain generator acks */
+		if (pfd[1].revents & POLLIN)
+			generator_read(self->gen);
+	}
+
+	counter_unlisten(self->counter, &self->listener);
+
+	return self->locked ? 0 : -1;
+}
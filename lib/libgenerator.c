@@ -26,6 +26,8 @@
 #include <errno.h>
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
+#include <poll.h>
 
 #include "libgenerator.h"
 
@@ -66,7 +68,9 @@ struct generator *generator_create(const char *port,
 	}
 
 	/* callback */
-	generator->update = update;
+	generator->update       = update;
+	generator->command_done = NULL;
+	generator->ctx          = NULL;
 
 	/* state initalization */
 	generator->wave      = GENERATOR_WAVE_UNKNOWN;
@@ -75,11 +79,14 @@ struct generator *generator_create(const char *port,
 	generator->offset    = 0;
 	generator->freq      = 0;
 	generator->mem       = 0;
+	generator->loaded    = -1;
 
 	/* serial data buffer */
 	generator->data_pos  = 0;
 	generator->data_flag = 0;
 
+	memset(&generator->stats, 0, sizeof(generator->stats));
+
 	return generator;
 }
 
@@ -102,13 +109,6 @@ void generator_destroy(struct generator *self)
  */
 static void generator_parse_state(struct generator *self)
 {
-	unsigned int i;
-
-	for (i = 0; i < self->data_pos; i++)
-		printf("0x%02x ", self->data[i]);
-
-	printf("\n");
-
 	self->wave      = self->data[1];
 	self->freq      = self->data[2]<<16 | self->data[3]<<8 | self->data[4];
 	self->offset    = self->data[5];
@@ -122,39 +122,31 @@ static void generator_parse_state(struct generator *self)
 		self->freq = -self->freq;
 	}
 
+	EVLOG(&self->port->log, EVLOG_DEBUG, EVLOG_GEN_STATE,
+	      self->wave, self->data[2]<<16 | self->data[3]<<8 | self->data[4]);
+
 	/* end of data packet */
 	self->data_pos  = 0;
 	self->data_flag = 0;
 
-	/* Call update if set */
-	if (self->update != NULL)
-		self->update(self);
-}
-
-static void dump(uint8_t *buf, int len)
-{
-	int i;
+	stats_inc(&self->stats.states);
 
-	printf("RAW: ");
+	/* Call update if set */
+	if (self->update != NULL) {
+		uint64_t cb_start = libserial_time();
 
-	for (i = 0; i < len; i++)
-		printf("0x%02x ", buf[i]);
+		self->update(self);
 
-	printf("\n");
+		stats_add(&self->stats.callback_ns, libserial_time() - cb_start);
+	}
 }
 
-void generator_read(struct generator *self)
+/*
+ * Parses bytes in the data buffer.
+ */
+static void generator_parse(struct generator *self)
 {
-	int len, i;
-
-	if ((len = read(self->port->fd, self->data + self->data_pos,
-	    sizeof(self->data) - self->data_pos)) > 0) {
-
-	//	dump(self->data + self->data_pos, len);
-
-		self->data_pos += len;
-
-	}
+	int i;
 
 	/* in the middle of generator state packet */
 	if (self->data_flag) {
@@ -168,23 +160,29 @@ void generator_read(struct generator *self)
 		switch (self->data[i]) {
 		/* memory loaded state */
 		case 0x30 ... 0x37:
-			printf("Memory %i\n", self->data[i] & 0x07);
+			EVLOG(&self->port->log, EVLOG_INFO, EVLOG_GEN_MEMORY,
+			      self->data[i] & 0x07, 0);
+			self->loaded = self->data[i] & 0x07;
+			stats_inc(&self->stats.loaded);
 			generator_load_state(self);
 		break;
 		/* ack from generator */
 		case 0xd3:
-			printf("Operation successful\n");
+			EVLOG(&self->port->log, EVLOG_DEBUG, EVLOG_GEN_ACK, 0, 0);
+			stats_inc(&self->stats.acks);
 		break;
 		/* generator state is send */
 		case 0xd2:
-			printf("Start of state packet\n");
+			EVLOG(&self->port->log, EVLOG_DEBUG, EVLOG_GEN_STATE_START, 0, 0);
 			self->data_flag = 1;
 			memmove(self->data, self->data+i, self->data_pos - i);
 			self->data_pos -= i;
 			return;
 		break;
 		default:
-			printf("Lost 0x%02x\n", self->data[i]);
+			EVLOG(&self->port->log, EVLOG_WARN, EVLOG_GEN_LOST,
+			      self->data[i], 0);
+			stats_inc(&self->stats.resync);
 		break;
 		}
 	}
@@ -192,6 +190,65 @@ void generator_read(struct generator *self)
 	self->data_pos = 0;
 }
 
+void generator_read(struct generator *self)
+{
+	int len;
+	uint64_t t;
+
+	if ((len = libserial_read(self->port, self->data + self->data_pos,
+	    sizeof(self->data) - self->data_pos, &t)) > 0) {
+
+		self->data_pos += len;
+
+	}
+
+	generator_parse(self);
+}
+
+void generator_process(struct generator *self, const uint8_t *buf, size_t len)
+{
+	size_t n;
+
+	do {
+		n = sizeof(self->data) - self->data_pos;
+
+		if (n > len)
+			n = len;
+
+		memcpy(self->data + self->data_pos, buf, n);
+		self->data_pos += n;
+		buf += n;
+		len -= n;
+
+		generator_parse(self);
+	} while (len);
+}
+
+void generator_get_stats(struct generator *self, struct generator_stats *stats)
+{
+	stats_snapshot(stats, &self->stats, sizeof(*stats));
+}
+
+static void command_done(struct libserial_port *port, void *priv,
+                         uint8_t cmd, int err)
+{
+	struct generator *self = priv;
+
+	(void) port;
+
+	if (self->command_done != NULL)
+		self->command_done(self, cmd, err);
+}
+
+/*
+ * Queues command, the write never blocks.
+ */
+static void generator_send(struct generator *self, const uint8_t *buf,
+                           uint32_t len)
+{
+	libserial_send(self->port, buf, len, command_done, self);
+}
+
 #define SAVE(x) (0x60 | (0x07 & (x)))
 #define LOAD(x) (0x70 | (0x07 & (x)))
 
@@ -199,16 +256,14 @@ void generator_save(struct generator *self, uint8_t pos)
 {
 	uint8_t s = SAVE(pos);
 
-	if (write(self->port->fd, &s, 1) != 1)
-		printf("Error saving state: %s\n.", strerror(errno));
+	generator_send(self, &s, 1);
 }
 
 void generator_load(struct generator *self, uint8_t pos)
 {
 	uint8_t l = LOAD(pos);
 
-	if (write(self->port->fd, &l, 1) != 1)
-		printf("Error loading state: %s\n.", strerror(errno));
+	generator_send(self, &l, 1);
 }
 
 #define WAVE(x) (0x30 | (0x07 & (x)))
@@ -220,8 +275,7 @@ void generator_set_wave(struct generator *self, enum generator_wave wave)
 	if (wave == 0)
 		return;
 
-	if (write(self->port->fd, &w, 1) != 1)
-		printf("Error setting output wave: %s\n.", strerror(errno));
+	generator_send(self, &w, 1);
 }
 
 #define FILTER(x) (0x03 & (x))
@@ -230,24 +284,21 @@ void generator_set_filter(struct generator *self, enum generator_filter filter)
 {
 	uint8_t f[] = {'F', FILTER(filter)};
 
-	if (write(self->port->fd, f, 2) != 2)
-		printf("Error setting output filter: %s\n.", strerror(errno));
+	generator_send(self, f, 2);
 }
 
 void generator_set_amplitude(struct generator *self, uint8_t amplitude)
 {
 	uint8_t a[] = {'V', amplitude};
 
-	if (write(self->port->fd, a, 2) != 2)
-		printf("Error setting output amplitude: %s\n.", strerror(errno));
+	generator_send(self, a, 2);
 }
 
 void generator_set_offset(struct generator *self, uint8_t offset)
 {
 	uint8_t o[] = {'O', offset};
 
-	if (write(self->port->fd, o, 2) != 2)
-		printf("Error setting output offset: %s\n.", strerror(errno));
+	generator_send(self, o, 2);
 }
 
 #define F1(x) ((uint8_t)(((x)>>16) & 0xff))
@@ -258,38 +309,45 @@ void generator_set_freq(struct generator *self, uint32_t freq)
 {
 	uint8_t f[] = {'S', F1(freq), F2(freq), F3(freq)};
 
-	if (write(self->port->fd, f, 4) != 4)
-		printf("Error setting output frequency: %s\n.", strerror(errno));
+	generator_send(self, f, 4);
 }
 
-void generator_set_freq_float(struct generator *self, float freq)
+int generator_freq_word(struct generator *self, float freq, uint32_t *fval)
 {
-	uint32_t fval;
-
 	switch (self->wave) {
 	case GENERATOR_WAVE_UNKNOWN:
 	case GENERATOR_WAVE_BW_VIDEO:
-		printf("Cannot set frequency for BW video\n");
-		return;
+		return -1;
 	case GENERATOR_WAVE_TRIANGLE:
 	case GENERATOR_WAVE_SINE:
-		fval = round((16777216 * 9 * freq) / 20000000);
+		*fval = round((16777216 * 9 * freq) / 20000000);
 	break;
 	case GENERATOR_WAVE_SAWTOOTH:
-		fval = round((16777216 * 6 * freq) / 20000000);
+		*fval = round((16777216 * 6 * freq) / 20000000);
 	break;
 	case GENERATOR_WAVE_SQUARE:
-		fval = round((16777216 * 7 * freq) / 20000000);
+		*fval = round((16777216 * 7 * freq) / 20000000);
 	break;
 	case GENERATOR_WAVE_SERIAL:
 	case GENERATOR_WAVE_SERIAL_INV:
 		//return 200000000.00 / (self->freq >> 8);
-		printf("TODO\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void generator_set_freq_float(struct generator *self, float freq)
+{
+	uint32_t fval;
+
+	if (generator_freq_word(self, freq, &fval)) {
+		EVLOG(&self->port->log, EVLOG_WARN, EVLOG_GEN_UNSUPPORTED,
+		      self->wave, 0);
 		return;
-	break;
 	}
 
-	printf("%f %u\n", freq, fval);
+	EVLOG(&self->port->log, EVLOG_DEBUG, EVLOG_GEN_FREQ, fval, 0);
 
 	generator_set_freq(self, fval);
 }
@@ -298,8 +356,7 @@ void generator_load_state(struct generator *self)
 {
 	uint8_t q = '?';
 
-	if (write(self->port->fd, &q, 1) != 1)
-		printf("Error requesting state: %s\n.", strerror(errno));
+	generator_send(self, &q, 1);
 }
 
 float generator_convert_freq(struct generator *self)
@@ -335,3 +392,147 @@ float generator_convert_offset(struct generator *self)
 {
 	return -(float)self->amplitude * 4.81 / 255 / 2;
 }
+
+void generator_presets_init(struct generator_presets *self,
+                            struct generator *gen)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->gen    = gen;
+	self->active = -1;
+}
+
+static int preset_lookup(struct generator_presets *self,
+                         const struct generator_preset *preset)
+{
+	int i;
+
+	for (i = 0; i < GENERATOR_SLOTS; i++) {
+		if (self->last_use[i] == 0)
+			continue;
+
+		if (!strncmp(self->slot[i].name, preset->name, GENERATOR_PRESET_NAME))
+			return i;
+	}
+
+	return -1;
+}
+
+static int preset_same(const struct generator_preset *a,
+                       const struct generator_preset *b)
+{
+	return a->wave == b->wave && a->filter == b->filter &&
+	       a->amplitude == b->amplitude && a->offset == b->offset &&
+	       (a->freq & 0xffffff) == (b->freq & 0xffffff);
+}
+
+/*
+ * Returns either empty or least recently used slot.
+ */
+static int preset_victim(struct generator_presets *self)
+{
+	int i, lru = 0;
+
+	for (i = 0; i < GENERATOR_SLOTS; i++) {
+		if (self->last_use[i] == 0)
+			return i;
+
+		if (self->last_use[i] < self->last_use[lru])
+			lru = i;
+	}
+
+	return lru;
+}
+
+static void preset_touch(struct generator_presets *self, int slot)
+{
+	self->last_use[slot] = ++self->clock;
+}
+
+int generator_preset_upload(struct generator_presets *self,
+                            const struct generator_preset *preset)
+{
+	struct generator *gen = self->gen;
+	int slot = preset_lookup(self, preset);
+
+	if (slot >= 0 && preset_same(&self->slot[slot], preset)) {
+		preset_touch(self, slot);
+		return slot;
+	}
+
+	if (slot < 0)
+		slot = preset_victim(self);
+
+	/* configure the output, then store it */
+	generator_set_wave(gen, preset->wave);
+	generator_set_freq(gen, preset->freq);
+	generator_set_amplitude(gen, preset->amplitude);
+	generator_set_offset(gen, preset->offset);
+	generator_set_filter(gen, preset->filter);
+	generator_save(gen, slot);
+
+	self->slot[slot] = *preset;
+	self->slot[slot].name[GENERATOR_PRESET_NAME - 1] = '\0';
+	self->active = slot;
+	preset_touch(self, slot);
+
+	return slot;
+}
+
+int generator_preset_switch(struct generator_presets *self,
+                            const struct generator_preset *preset)
+{
+	int slot = generator_preset_upload(self, preset);
+
+	self->gen->loaded = -1;
+	self->active = slot;
+	generator_load(self->gen, slot);
+
+	return slot;
+}
+
+static long ms_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+int generator_preset_wait(struct generator_presets *self, int timeout_ms)
+{
+	struct generator *gen = self->gen;
+	struct pollfd pfd = {.fd = gen->port->fd};
+	struct timespec start;
+	long left;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (gen->loaded < 0) {
+		left = timeout_ms - ms_since(&start);
+
+		if (left <= 0)
+			return -1;
+
+		/* the load command may still be queued */
+		pfd.events = POLLIN;
+		if (libserial_pending(gen->port))
+			pfd.events |= POLLOUT;
+
+		if (poll(&pfd, 1, left) <= 0)
+			return -1;
+
+		if ((pfd.revents & POLLOUT) && libserial_flush(gen->port) < 0)
+			return -1;
+
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+			generator_read(gen);
+	}
+
+	if (gen->loaded != self->active)
+		return -2;
+
+	return 0;
+}
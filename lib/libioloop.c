@@ -0,0 +1,701 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "libvameter.h"
+#include "libcounter.h"
+#include "libgenerator.h"
+#include "libioloop.h"
+
+/*
+ * The io_uring is set up with raw syscalls, so that there is no dependency
+ * on liburing.
+ */
+struct uring {
+	int fd;
+
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_local;
+	unsigned int to_submit;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+#define UDATA_WRITE  1
+/* completions of cancel requests are ignored */
+#define UDATA_CANCEL UINT64_MAX
+
+static int set_nonblock(int fd, int nonblock)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		return -1;
+
+	if (nonblock)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+
+	return fcntl(fd, F_SETFL, flags);
+}
+
+static void uring_free(struct uring *ring)
+{
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_size);
+
+	if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_size);
+
+	if (ring->sq_ptr != NULL)
+		munmap(ring->sq_ptr, ring->sq_size);
+
+	close(ring->fd);
+	free(ring);
+}
+
+static struct uring *uring_setup(unsigned int entries)
+{
+	struct io_uring_params p;
+	struct uring *ring;
+	uint8_t *sq, *cq;
+
+	ring = calloc(1, sizeof(*ring));
+
+	if (ring == NULL)
+		return NULL;
+
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+
+	/* timeouts are passed with IORING_ENTER_EXT_ARG */
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		close(ring->fd);
+		free(ring);
+		errno = ENOSYS;
+		return NULL;
+	}
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	sq = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+	          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+	if (sq == MAP_FAILED)
+		goto err;
+
+	ring->sq_ptr = sq;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+		          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+
+		if (cq == MAP_FAILED)
+			goto err;
+	}
+
+	ring->cq_ptr = cq;
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto err;
+	}
+
+	ring->sq_head    = (unsigned int*)(sq + p.sq_off.head);
+	ring->sq_tail    = (unsigned int*)(sq + p.sq_off.tail);
+	ring->sq_mask    = (unsigned int*)(sq + p.sq_off.ring_mask);
+	ring->sq_array   = (unsigned int*)(sq + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_local   = *ring->sq_tail;
+
+	ring->cq_head = (unsigned int*)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	return ring;
+err:
+	uring_free(ring);
+	return NULL;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int idx;
+	struct io_uring_sqe *sqe;
+
+	if (ring->sq_local - head >= ring->sq_entries)
+		return NULL;
+
+	idx = ring->sq_local & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	ring->sq_array[idx] = idx;
+	ring->sq_local++;
+	ring->to_submit++;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+static void uring_prep(struct uring *ring, uint8_t op, int fd, void *buf,
+                       uint32_t len, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+
+	/* ring has two entries per port, this can't happen */
+	if (sqe == NULL)
+		return;
+
+	sqe->opcode    = op;
+	sqe->fd        = fd;
+	sqe->addr      = (uintptr_t)buf;
+	sqe->len       = len;
+	/* use and update the file position, works for files and ttys */
+	sqe->off       = (uint64_t)-1;
+	sqe->user_data = user_data;
+}
+
+int ioloop_add(struct ioloop *self, struct libserial_port *port,
+               ioloop_process process, void *inst)
+{
+	struct ioloop_port *p;
+
+	if (self->used >= self->size) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	/*
+	 * The poll backend must not block in read(), io_uring on the other
+	 * hand would complete a non-blocking read with -EAGAIN instead of
+	 * waiting for the data.
+	 */
+	if (set_nonblock(port->fd, self->backend == IOLOOP_POLL))
+		return -1;
+
+	p = &self->ports[self->used++];
+
+	memset(p, 0, sizeof(*p));
+	p->port    = port;
+	p->process = process;
+	p->inst    = inst;
+	p->writes  = port->stats.writes;
+
+	/* writes are submitted along with the reads */
+	if (self->backend == IOLOOP_URING)
+		port->outq.async = 1;
+
+	self->active++;
+
+	return 0;
+}
+
+static void vameter_cb(void *inst, const uint8_t *buf, uint32_t len, uint64_t t)
+{
+	vameter_process_ts(inst, (uint8_t*)buf, len, t);
+}
+
+int ioloop_add_vameter(struct ioloop *self, struct VAmeter *meter)
+{
+	return ioloop_add(self, meter->port, vameter_cb, meter);
+}
+
+static void counter_cb(void *inst, const uint8_t *buf, uint32_t len, uint64_t t)
+{
+	counter_process(inst, buf, len, t);
+}
+
+int ioloop_add_counter(struct ioloop *self, struct counter *counter)
+{
+	return ioloop_add(self, counter->port, counter_cb, counter);
+}
+
+static void generator_cb(void *inst, const uint8_t *buf, uint32_t len,
+                         uint64_t t)
+{
+	(void) t;
+	generator_process(inst, buf, len);
+}
+
+int ioloop_add_generator(struct ioloop *self, struct generator *gen)
+{
+	return ioloop_add(self, gen->port, generator_cb, gen);
+}
+
+static void read_done(struct ioloop *self, struct ioloop_port *p, int ret)
+{
+	uint64_t t = libserial_time();
+
+	/* port was removed */
+	if (p->port == NULL)
+		return;
+
+	libserial_account(p->port, ret, ret < 0 ? -ret : 0);
+
+	if (ret > 0) {
+		p->process(p->inst, p->rbuf, ret, t);
+		return;
+	}
+
+	if (ret == -EAGAIN || ret == -EINTR)
+		return;
+
+	p->done = 1;
+	self->active--;
+}
+
+static void write_done(struct ioloop_port *p, int ret)
+{
+	p->wflight = 0;
+
+	if (p->port != NULL)
+		libserial_out_done(p->port, ret < 0 ? -1 : ret, ret < 0 ? -ret : 0);
+}
+
+/*
+ * Moves completions from the ring to the ports, they are dispatched later
+ * by uring_dispatch(). This way ioloop_remove() can wait for completions
+ * of one port without calling callbacks of the others.
+ */
+static void uring_reap(struct ioloop *self)
+{
+	struct uring *ring = self->priv;
+	unsigned int head, tail;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		struct ioloop_port *p;
+
+		if (cqe->user_data == UDATA_CANCEL)
+			continue;
+
+		p = &self->ports[cqe->user_data >> 1];
+
+		if (cqe->user_data & UDATA_WRITE) {
+			p->wres   = cqe->res;
+			p->wready = 1;
+		} else {
+			p->rres   = cqe->res;
+			p->rready = 1;
+		}
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int uring_dispatch(struct ioloop *self)
+{
+	unsigned int i;
+	int cnt = 0;
+
+	for (i = 0; i < self->used; i++) {
+		struct ioloop_port *p = &self->ports[i];
+
+		if (p->wready) {
+			p->wready = 0;
+			write_done(p, p->wres);
+			cnt++;
+		}
+
+		if (p->rready) {
+			p->rready = 0;
+			p->armed  = 0;
+			read_done(self, p, p->rres);
+			cnt++;
+		}
+	}
+
+	return cnt;
+}
+
+static int uring_run_once(struct ioloop *self, int timeout_ms)
+{
+	struct uring *ring = self->priv;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = IORING_ENTER_GETEVENTS;
+	unsigned int i, wait = 1;
+	int ret, cnt;
+
+	/* reaped by ioloop_remove() called from a callback */
+	cnt = uring_dispatch(self);
+
+	if (cnt)
+		timeout_ms = 0;
+
+	for (i = 0; i < self->used; i++) {
+		struct ioloop_port *p = &self->ports[i];
+
+		if (!p->armed && !p->done) {
+			uring_prep(ring, IORING_OP_READ, p->port->fd, p->rbuf,
+			           IOLOOP_RBUF, (uint64_t)i << 1);
+			p->armed = 1;
+		}
+
+		/*
+		 * Written through the blocking fd, the ring waits for the port
+		 * to become writable.
+		 */
+		if (p->port != NULL && libserial_pending(p->port) &&
+		    !p->wflight) {
+			const uint8_t *buf;
+			uint32_t len = libserial_out_buf(p->port, &buf);
+
+			uring_prep(ring, IORING_OP_WRITE, p->port->fd, (void*)buf,
+			           len, (uint64_t)i << 1 | UDATA_WRITE);
+			p->wflight = 1;
+		}
+	}
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+
+	memset(&arg, 0, sizeof(arg));
+
+	if (timeout_ms >= 0) {
+		ts.tv_sec  = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+		arg.ts     = (uintptr_t)&ts;
+		flags     |= IORING_ENTER_EXT_ARG;
+		wait       = timeout_ms > 0;
+	}
+
+	stats_add(&self->stats.submitted, ring->to_submit);
+	stats_inc(&self->stats.waits);
+	stats_inc(&self->stats.syscalls);
+
+	ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait,
+	              flags, timeout_ms >= 0 ? (void*)&arg : NULL, sizeof(arg));
+
+	if (ret >= 0)
+		ring->to_submit -= ret;
+	else if (errno != ETIME && errno != EINTR)
+		return -1;
+
+	uring_reap(self);
+
+	cnt += uring_dispatch(self);
+
+	stats_add(&self->stats.completions, cnt);
+
+	return cnt;
+}
+
+/*
+ * Commands are written by libserial_send() as they are queued, i.e. also
+ * outside of the loop, the write() calls are counted from the port stats.
+ */
+static void poll_writes(struct ioloop *self)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->used; i++) {
+		struct ioloop_port *p = &self->ports[i];
+
+		if (p->port == NULL)
+			continue;
+
+		stats_add(&self->stats.syscalls, p->port->stats.writes - p->writes);
+		p->writes = p->port->stats.writes;
+	}
+}
+
+static int poll_run_once(struct ioloop *self, int timeout_ms)
+{
+	struct pollfd *fds = self->priv;
+	unsigned int i;
+	int ret, cnt = 0;
+
+	for (i = 0; i < self->used; i++) {
+		struct ioloop_port *p = &self->ports[i];
+
+		fds[i].revents = 0;
+
+		if (p->done) {
+			fds[i].fd = -1;
+			continue;
+		}
+
+		fds[i].fd      = p->port->fd;
+		fds[i].events  = POLLIN | (libserial_pending(p->port) ? POLLOUT : 0);
+	}
+
+	poll_writes(self);
+
+	stats_inc(&self->stats.waits);
+	stats_inc(&self->stats.syscalls);
+
+	ret = poll(fds, self->used, timeout_ms);
+
+	if (ret <= 0)
+		return (ret < 0 && errno != EINTR) ? -1 : 0;
+
+	for (i = 0; i < self->used; i++) {
+		struct ioloop_port *p = &self->ports[i];
+
+		if (fds[i].revents & POLLOUT) {
+			libserial_flush(p->port);
+			cnt++;
+		}
+
+		if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+			stats_inc(&self->stats.syscalls);
+			ret = read(p->port->fd, p->rbuf, IOLOOP_RBUF);
+			read_done(self, p, ret < 0 ? -errno : ret);
+			cnt++;
+		}
+	}
+
+	poll_writes(self);
+
+	stats_add(&self->stats.completions, cnt);
+
+	return cnt;
+}
+
+static void uring_cancel(struct ioloop *self, uint64_t user_data)
+{
+	struct uring *ring = self->priv;
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+
+	/* submission queue is full, submit and retry */
+	if (sqe == NULL) {
+		int ret;
+
+		stats_inc(&self->stats.syscalls);
+
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+		                  0, 0, NULL, 0);
+
+		if (ret > 0)
+			ring->to_submit -= ret;
+
+		sqe = uring_sqe(ring);
+
+		if (sqe == NULL)
+			return;
+	}
+
+	sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+	sqe->fd        = -1;
+	sqe->addr      = user_data;
+	sqe->user_data = UDATA_CANCEL;
+}
+
+/*
+ * Cancels read and write of the port and waits for their completions, the
+ * kernel must not write into rbuf nor read the port outbound queue, and
+ * must drop its reference to the tty, once the port is removed.
+ */
+static void uring_remove(struct ioloop *self, unsigned int idx)
+{
+	struct ioloop_port *p = &self->ports[idx];
+	struct uring *ring = self->priv;
+	int ret;
+
+	if (p->armed && !p->rready)
+		uring_cancel(self, (uint64_t)idx << 1);
+
+	if (p->wflight && !p->wready)
+		uring_cancel(self, (uint64_t)idx << 1 | UDATA_WRITE);
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+
+	while ((p->armed && !p->rready) || (p->wflight && !p->wready)) {
+		stats_inc(&self->stats.syscalls);
+
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+		              IORING_ENTER_GETEVENTS, NULL, 0);
+
+		if (ret < 0 && errno != EINTR)
+			break;
+
+		if (ret > 0)
+			ring->to_submit -= ret;
+
+		uring_reap(self);
+	}
+
+	/*
+	 * A finished write moves the queue head on, the bytes of a cancelled
+	 * one are written again once the port is written directly.
+	 */
+	if (p->wready && p->wres != -ECANCELED && p->wres != -EINTR) {
+		p->wready = 0;
+		write_done(p, p->wres);
+	}
+
+	if (p->wflight)
+		p->port->outq.busy = 0;
+
+	p->port->outq.async = 0;
+
+	p->armed   = 0;
+	p->rready  = 0;
+	p->wflight = 0;
+	p->wready  = 0;
+}
+
+int ioloop_remove(struct ioloop *self, struct libserial_port *port)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->used; i++) {
+		struct ioloop_port *p = &self->ports[i];
+
+		if (p->port != port)
+			continue;
+
+		if (self->backend == IOLOOP_URING)
+			uring_remove(self, i);
+
+		/* the slot is not reused */
+		if (!p->done)
+			self->active--;
+
+		p->done = 1;
+		p->port = NULL;
+
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+int ioloop_run_once(struct ioloop *self, int timeout_ms)
+{
+	if (self->backend == IOLOOP_URING)
+		return uring_run_once(self, timeout_ms);
+
+	return poll_run_once(self, timeout_ms);
+}
+
+struct ioloop *ioloop_create(unsigned int nports, enum ioloop_backend backend)
+{
+	struct ioloop *self;
+
+	self = calloc(1, sizeof(*self) + nports * sizeof(struct ioloop_port));
+
+	if (self == NULL)
+		return NULL;
+
+	self->size = nports;
+
+	if (backend != IOLOOP_POLL) {
+		/* one read and one write in flight per port */
+		self->priv = uring_setup(2 * nports);
+
+		if (self->priv != NULL) {
+			self->backend = IOLOOP_URING;
+			return self;
+		}
+
+		if (backend == IOLOOP_URING) {
+			free(self);
+			return NULL;
+		}
+	}
+
+	self->backend = IOLOOP_POLL;
+	self->priv    = calloc(nports, sizeof(struct pollfd));
+
+	if (self->priv == NULL) {
+		free(self);
+		return NULL;
+	}
+
+	return self;
+}
+
+void ioloop_destroy(struct ioloop *self)
+{
+	unsigned int i;
+
+	if (self == NULL)
+		return;
+
+	/* wait for the kernel to let go of the port buffers and ttys */
+	for (i = 0; i < self->used; i++) {
+		if (self->ports[i].port != NULL)
+			ioloop_remove(self, self->ports[i].port);
+	}
+
+	if (self->backend == IOLOOP_URING)
+		uring_free(self->priv);
+	else
+		free(self->priv);
+
+	free(self);
+}
+
+const char *ioloop_backend_name(struct ioloop *self)
+{
+	return self->backend == IOLOOP_URING ? "io_uring" : "poll";
+}
@@ -0,0 +1,233 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <string.h>
+
+#include "libjoin.h"
+
+static void ring_push(struct join_ring *ring, uint64_t t, float val)
+{
+	ring->t[ring->head]   = t;
+	ring->val[ring->head] = val;
+	ring->head = (ring->head + 1) % JOIN_DEPTH;
+
+	if (ring->cnt < JOIN_DEPTH)
+		ring->cnt++;
+}
+
+/*
+ * Index of n-th value, 0 is the oldest one.
+ */
+static unsigned int ring_idx(struct join_ring *ring, unsigned int n)
+{
+	return (ring->head + JOIN_DEPTH - ring->cnt + n) % JOIN_DEPTH;
+}
+
+static unsigned int ring_last(struct join_ring *ring)
+{
+	return ring_idx(ring, ring->cnt - 1);
+}
+
+int join_init(struct join *self, unsigned int channels,
+              enum join_policy policy,
+              void (*emit)(struct join *self, const struct join_record *rec),
+              void *priv)
+{
+	if (channels == 0 || channels > JOIN_MAX_CHANNELS)
+		return -1;
+
+	memset(self, 0, sizeof(*self));
+
+	self->channels = channels;
+	self->policy   = policy;
+	self->emit     = emit;
+	self->priv     = priv;
+
+	return 0;
+}
+
+/*
+ * Fills record with the latest values.
+ */
+static void join_latest(struct join *self, struct join_record *rec)
+{
+	unsigned int i;
+
+	rec->valid = 0;
+
+	for (i = 0; i < self->channels; i++) {
+		struct join_ring *ring = &self->chan[i];
+
+		rec->val[i] = 0;
+
+		if (ring->cnt == 0)
+			continue;
+
+		rec->val[i] = ring->val[ring_last(ring)];
+		rec->valid |= 1u<<i;
+	}
+}
+
+/*
+ * Value of the channel at time t, interpolated between the two values around
+ * t, values outside of the buffered interval are held.
+ *
+ * Returns 0 if there are no values.
+ */
+static int join_value_at(struct join_ring *ring, uint64_t t, float *val)
+{
+	unsigned int i, a, b;
+
+	if (ring->cnt == 0)
+		return 0;
+
+	a = ring_idx(ring, 0);
+
+	if (t <= ring->t[a]) {
+		*val = ring->val[a];
+		return 1;
+	}
+
+	for (i = 1; i < ring->cnt; i++) {
+		b = ring_idx(ring, i);
+
+		if (t <= ring->t[b]) {
+			float k = (float)(t - ring->t[a]) / (ring->t[b] - ring->t[a]);
+
+			*val = ring->val[a] + k * (ring->val[b] - ring->val[a]);
+			return 1;
+		}
+
+		a = b;
+	}
+
+	*val = ring->val[a];
+	return 1;
+}
+
+/*
+ * Emits oldest pending record if all channels have values past it or if
+ * forced.
+ */
+static int join_emit_pending(struct join *self, int force)
+{
+	struct join_ring *pending = &self->pending;
+	struct join_record rec;
+	unsigned int i, idx;
+	uint64_t t;
+
+	if (pending->cnt == 0)
+		return 0;
+
+	idx = ring_idx(pending, 0);
+	t   = pending->t[idx];
+
+	if (!force) {
+		for (i = 1; i < self->channels; i++) {
+			struct join_ring *ring = &self->chan[i];
+
+			if (ring->cnt == 0 || ring->t[ring_last(ring)] < t)
+				return 0;
+		}
+	}
+
+	rec.t      = t;
+	rec.val[0] = pending->val[idx];
+	rec.valid  = 1;
+
+	for (i = 1; i < self->channels; i++) {
+		rec.val[i] = 0;
+
+		if (join_value_at(&self->chan[i], t, &rec.val[i]))
+			rec.valid |= 1u<<i;
+	}
+
+	pending->cnt--;
+
+	if (self->emit != NULL)
+		self->emit(self, &rec);
+
+	return 1;
+}
+
+void join_push(struct join *self, unsigned int chan, uint64_t t, float val)
+{
+	struct join_record rec;
+	uint32_t all = (1u<<self->channels) - 1;
+	unsigned int i;
+
+	if (chan >= self->channels)
+		return;
+
+	switch (self->policy) {
+	case JOIN_LATEST:
+		ring_push(&self->chan[chan], t, val);
+		join_latest(self, &rec);
+		rec.t = t;
+		if (self->emit != NULL)
+			self->emit(self, &rec);
+	break;
+	case JOIN_WAIT_ALL:
+		if (self->fresh & (1u<<chan))
+			self->dropped++;
+
+		ring_push(&self->chan[chan], t, val);
+		self->fresh |= 1u<<chan;
+
+		if (self->fresh != all)
+			return;
+
+		join_latest(self, &rec);
+		rec.t = 0;
+
+		for (i = 0; i < self->channels; i++) {
+			struct join_ring *ring = &self->chan[i];
+
+			if (ring->t[ring_last(ring)] > rec.t)
+				rec.t = ring->t[ring_last(ring)];
+		}
+
+		self->fresh = 0;
+
+		if (self->emit != NULL)
+			self->emit(self, &rec);
+	break;
+	case JOIN_INTERPOLATE:
+		if (chan == 0) {
+			/* make room, oldest record is emitted incomplete */
+			if (self->pending.cnt == JOIN_DEPTH) {
+				join_emit_pending(self, 1);
+				self->dropped++;
+			}
+			ring_push(&self->pending, t, val);
+		} else {
+			ring_push(&self->chan[chan], t, val);
+		}
+
+		while (join_emit_pending(self, 0));
+	break;
+	}
+}
+
+void join_flush(struct join *self)
+{
+	while (join_emit_pending(self, 1));
+}
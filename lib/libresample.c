@@ -0,0 +1,198 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <string.h>
+#include <math.h>
+
+#include "libresample.h"
+
+static void acc_reset(struct resample_acc *acc, unsigned int channels)
+{
+	unsigned int i;
+
+	for (i = 0; i < channels; i++) {
+		memset(&acc[i], 0, sizeof(acc[i]));
+		acc[i].min = INFINITY;
+		acc[i].max = -INFINITY;
+	}
+}
+
+int resample_init(struct resample *self, unsigned int channels,
+                  uint64_t period, uint64_t hold,
+                  void (*emit)(struct resample *self,
+                               const struct resample_record *rec),
+                  void *priv)
+{
+	if (channels == 0 || channels > RESAMPLE_MAX_CHANNELS)
+		return -1;
+
+	if (period == 0 || hold > period)
+		return -1;
+
+	memset(self, 0, sizeof(*self));
+
+	self->channels = channels;
+	self->period   = period;
+	self->hold     = hold;
+	self->emit     = emit;
+	self->priv     = priv;
+
+	acc_reset(self->acc[0], channels);
+	acc_reset(self->acc[1], channels);
+
+	return 0;
+}
+
+int resample_agg(struct resample *self, unsigned int chan,
+                 enum resample_agg agg)
+{
+	if (chan >= self->channels || agg > RESAMPLE_COUNT)
+		return -1;
+
+	self->agg[chan] = agg;
+
+	return 0;
+}
+
+static float acc_value(const struct resample_acc *acc, enum resample_agg agg)
+{
+	if (agg == RESAMPLE_COUNT)
+		return acc->cnt;
+
+	if (acc->cnt == 0)
+		return NAN;
+
+	switch (agg) {
+	case RESAMPLE_MEAN:
+		return acc->sum / acc->cnt;
+	case RESAMPLE_LAST:
+		return acc->last;
+	case RESAMPLE_MIN:
+		return acc->min;
+	case RESAMPLE_MAX:
+		return acc->max;
+	case RESAMPLE_RMS:
+		return sqrt(acc->sumsq / acc->cnt);
+	default:
+		return NAN;
+	}
+}
+
+/*
+ * Emits the current interval and makes the next one current.
+ */
+static void resample_close(struct resample *self)
+{
+	struct resample_acc *acc = self->acc[self->cur];
+	struct resample_record rec;
+	unsigned int i;
+
+	rec.t   = self->start;
+	rec.gap = 0;
+
+	for (i = 0; i < self->channels; i++) {
+		rec.chan[i].val = acc_value(&acc[i], self->agg[i]);
+		rec.chan[i].min = acc[i].cnt ? acc[i].min : NAN;
+		rec.chan[i].max = acc[i].cnt ? acc[i].max : NAN;
+		rec.chan[i].cnt = acc[i].cnt;
+
+		if (acc[i].cnt == 0)
+			rec.gap |= 1u<<i;
+	}
+
+	if (self->emit != NULL)
+		self->emit(self, &rec);
+
+	acc_reset(acc, self->channels);
+	self->cur   = !self->cur;
+	self->start += self->period;
+}
+
+void resample_advance(struct resample *self, uint64_t now)
+{
+	if (self->start == 0)
+		return;
+
+	while (now >= self->start + self->period + self->hold)
+		resample_close(self);
+}
+
+void resample_push(struct resample *self, unsigned int chan, uint64_t t,
+                   float val)
+{
+	struct resample_acc *acc;
+
+	if (chan >= self->channels)
+		return;
+
+	/* first value, align the interval to the period */
+	if (self->start == 0)
+		self->start = t - t % self->period;
+
+	if (t < self->start) {
+		self->late++;
+		return;
+	}
+
+	resample_advance(self, t);
+
+	/* hold <= period so the value is in current or next interval */
+	if (t < self->start + self->period)
+		acc = &self->acc[self->cur][chan];
+	else
+		acc = &self->acc[!self->cur][chan];
+
+	acc->sum   += val;
+	acc->sumsq += (double)val * val;
+	acc->last   = val;
+	acc->cnt++;
+
+	if (val < acc->min)
+		acc->min = val;
+
+	if (val > acc->max)
+		acc->max = val;
+}
+
+static int acc_used(struct resample *self, unsigned int idx)
+{
+	unsigned int i;
+
+	for (i = 0; i < self->channels; i++)
+		if (self->acc[idx][i].cnt)
+			return 1;
+
+	return 0;
+}
+
+void resample_flush(struct resample *self)
+{
+	if (self->start == 0)
+		return;
+
+	if (!acc_used(self, self->cur) && !acc_used(self, !self->cur))
+		return;
+
+	resample_close(self);
+
+	if (acc_used(self, self->cur))
+		resample_close(self);
+}
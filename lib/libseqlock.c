@@ -0,0 +1,86 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include "libseqlock.h"
+
+static inline void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void copy_words(uint64_t *d, const uint64_t *s, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size / sizeof(uint64_t); i++)
+		__atomic_store_n(&d[i], __atomic_load_n(&s[i], __ATOMIC_RELAXED),
+		                 __ATOMIC_RELAXED);
+}
+
+void seqlock_write(uint64_t *seq, void *reg, const void *val, size_t size)
+{
+	uint64_t s = __atomic_load_n(seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(seq, s + 1, __ATOMIC_RELAXED);
+	/* the odd sequence must be visible before any of the data */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	copy_words(reg, val, size);
+
+	__atomic_store_n(seq, s + 2, __ATOMIC_RELEASE);
+}
+
+int seqlock_read_try(const uint64_t *seq, void *val, const void *reg,
+                     size_t size, uint64_t *updates)
+{
+	uint64_t s1, s2;
+
+	s1 = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+
+	if (s1 & 1)
+		return -1;
+
+	copy_words(val, reg, size);
+
+	/* the data must be read before the sequence is checked again */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	s2 = __atomic_load_n(seq, __ATOMIC_RELAXED);
+
+	if (s1 != s2)
+		return -1;
+
+	*updates = s1 / 2;
+
+	return 0;
+}
+
+uint64_t seqlock_read(const uint64_t *seq, void *val, const void *reg,
+                      size_t size)
+{
+	uint64_t updates;
+
+	while (seqlock_read_try(seq, val, reg, size, &updates))
+		cpu_relax();
+
+	return updates;
+}
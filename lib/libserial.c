@@ -26,15 +26,27 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <termios.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/serial.h>
 
 #include "libserial.h"
 
 #define FHS_LOCK_PREFIX "/var/lock/LCK.."
 
-#define DEBUG(...) printf(__VA_ARGS__);
+
+/* USB serial adapter latency timer in ms */
+#define LATENCY_TIMER 1
+
+static const char *sysfs_root = "/sys";
+
+void libserial_sysfs_root(const char *root)
+{
+	sysfs_root = root;
+}
 
 /*
  * Initalize serial port sppeed.
@@ -60,6 +72,90 @@ static int ser_init(int fd, tcflag_t baudrate)
 	return 0;
 }
 
+/*
+ * Returns speed in bauds.
+ */
+static unsigned int ser_speed(tcflag_t baudrate)
+{
+	switch (baudrate) {
+	case B50:     return 50;
+	case B75:     return 75;
+	case B110:    return 110;
+	case B134:    return 134;
+	case B150:    return 150;
+	case B200:    return 200;
+	case B300:    return 300;
+	case B600:    return 600;
+	case B1200:   return 1200;
+	case B1800:   return 1800;
+	case B2400:   return 2400;
+	case B4800:   return 4800;
+	case B9600:   return 9600;
+	case B19200:  return 19200;
+	case B38400:  return 38400;
+	case B57600:  return 57600;
+	case B115200: return 115200;
+	}
+
+	return 19200;
+}
+
+/*
+ * Lowers USB serial adapter latency timer (16 ms by default on FTDI).
+ *
+ * The tty is looked up by its device number so that symlinks such as
+ * /dev/serial/by-id/ works too. Returns the timer value read back or -1.
+ */
+static int ser_latency_timer(struct libserial_port *port)
+{
+	char path[512];
+	FILE *f;
+	int val;
+
+	snprintf(path, sizeof(path), "%s/dev/char/%u:%u/device/latency_timer",
+	         sysfs_root, major(port->st.st_rdev), minor(port->st.st_rdev));
+
+	f = fopen(path, "w");
+
+	if (f != NULL) {
+		fprintf(f, "%i\n", LATENCY_TIMER);
+		fclose(f);
+	}
+
+	f = fopen(path, "r");
+
+	if (f == NULL)
+		return -1;
+
+	if (fscanf(f, "%i", &val) != 1)
+		val = -1;
+
+	fclose(f);
+
+	return val;
+}
+
+/*
+ * Asks the driver to push received data to the tty layer immediately.
+ */
+static int ser_low_latency(int fd)
+{
+	struct serial_struct ser;
+
+	if (ioctl(fd, TIOCGSERIAL, &ser))
+		return 0;
+
+	if (ser.flags & ASYNC_LOW_LATENCY)
+		return 1;
+
+	ser.flags |= ASYNC_LOW_LATENCY;
+
+	if (ioctl(fd, TIOCSSERIAL, &ser))
+		return 0;
+
+	return 1;
+}
+
 /*
  * Returns last part of the path
  *
@@ -90,8 +186,6 @@ static int try_lock(const char *dev)
 
 	snprintf(lock, 255, "%s%s", FHS_LOCK_PREFIX, ser_name(dev));
 
-	DEBUG("Trying lock on %s\n", lock);
-
 	/* try to open lock exclusively */
 	lock_fd = open(lock, O_CREAT | O_WRONLY | O_EXCL,
 	               S_IROTH | S_IRGRP | S_IRUSR | S_IWUSR);
@@ -123,8 +217,6 @@ static int release_lock(const char *dev)
 	
 	snprintf(lock, 255, "%s%s", FHS_LOCK_PREFIX, ser_name(dev));
 	
-	DEBUG("Releasing lock on %s\n", lock);
-
 	return unlink(lock);
 }
 
@@ -150,12 +242,40 @@ struct libserial_port *libserial_open(const char *dev, tcflag_t baudrate)
 	/* open serial port */
 	port->fd = open(dev, O_RDWR);
 
+	/* captures may be read only */
+	if (port->fd < 0 && !S_ISCHR(port->st.st_mode) &&
+	    (errno == EACCES || errno == EROFS))
+		port->fd = open(dev, O_RDONLY);
+
 	if (port->fd < 0)
 		goto err1;
 
 	if (ser_init(port->fd, baudrate))
 		goto err2;
 
+	port->wfd = port->fd;
+
+	if (S_ISCHR(port->st.st_mode)) {
+		port->wfd = open(dev, O_WRONLY | O_NOCTTY | O_NONBLOCK);
+
+		if (port->wfd < 0)
+			goto err2;
+	}
+
+	port->latency_timer = -1;
+	port->low_latency   = 0;
+	memset(&port->stats, 0, sizeof(port->stats));
+	memset(&port->outq, 0, sizeof(port->outq));
+	evlog_init(&port->log, port->dev);
+
+	/* start bit, 8 data bits, stop bit */
+	port->char_ns = 10 * 1000000000ull / ser_speed(baudrate);
+
+	if (S_ISCHR(port->st.st_mode)) {
+		port->latency_timer = ser_latency_timer(port);
+		port->low_latency   = ser_low_latency(port->fd);
+	}
+
 	strcpy(port->dev, dev);
 
 	return port;
@@ -175,6 +295,9 @@ void libserial_close(struct libserial_port *port)
 	if (port == NULL)
 		return;
 	
+	if (port->wfd != port->fd)
+		close(port->wfd);
+
 	close(port->fd);
 	
 	if (S_ISCHR(port->st.st_mode))
@@ -182,3 +305,185 @@ void libserial_close(struct libserial_port *port)
 	
 	free(port);
 }
+
+uint64_t libserial_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void libserial_account(struct libserial_port *port, ssize_t ret, int err)
+{
+	stats_inc(&port->stats.reads);
+
+	if (ret > 0) {
+		stats_add(&port->stats.bytes, ret);
+		stats_hist(&port->stats.read_bytes, ret);
+	} else if (ret < 0) {
+		if (err == EAGAIN) {
+			stats_inc(&port->stats.again);
+		} else {
+			stats_inc(&port->stats.errors);
+			EVLOG(&port->log, EVLOG_ERR, EVLOG_READ_ERROR, err, 0);
+		}
+	}
+}
+
+ssize_t libserial_read(struct libserial_port *port, void *buf, size_t len,
+                       uint64_t *t)
+{
+	ssize_t ret;
+
+	if (libserial_pending(port))
+		libserial_flush(port);
+
+	ret = read(port->fd, buf, len);
+
+	*t = libserial_time();
+
+	libserial_account(port, ret, errno);
+
+	return ret;
+}
+
+/*
+ * Completes commands whose last byte has been written.
+ */
+static void outq_complete(struct libserial_port *port, int err)
+{
+	struct libserial_outq *q = &port->outq;
+
+	while (q->cmd_head != q->cmd_tail) {
+		struct libserial_cmd *cmd = &q->cmds[q->cmd_head % LIBSERIAL_CMDS];
+
+		if (!err && (int32_t)(cmd->end - q->head) > 0)
+			break;
+
+		q->cmd_head++;
+
+		if (cmd->done != NULL)
+			cmd->done(port, cmd->priv, cmd->cmd, err);
+	}
+}
+
+int libserial_send(struct libserial_port *port, const void *buf, uint32_t len,
+                   libserial_done done, void *priv)
+{
+	struct libserial_outq *q = &port->outq;
+	const uint8_t *data = buf;
+	struct libserial_cmd *cmd;
+	uint32_t i;
+
+	if (len > LIBSERIAL_OUTQ - libserial_pending(port) ||
+	    q->cmd_tail - q->cmd_head >= LIBSERIAL_CMDS) {
+		EVLOG(&port->log, EVLOG_ERR, EVLOG_WRITE_ERROR, ENOSPC,
+		      len ? data[0] : 0);
+
+		if (done != NULL)
+			done(port, priv, len ? data[0] : 0, ENOSPC);
+
+		errno = ENOSPC;
+		return -1;
+	}
+
+	for (i = 0; i < len; i++)
+		q->buf[(q->tail + i) % LIBSERIAL_OUTQ] = data[i];
+
+	q->tail += len;
+
+	cmd = &q->cmds[q->cmd_tail++ % LIBSERIAL_CMDS];
+	cmd->end  = q->tail;
+	cmd->cmd  = len ? data[0] : 0;
+	cmd->done = done;
+	cmd->priv = priv;
+
+	libserial_flush(port);
+
+	return 0;
+}
+
+uint32_t libserial_out_buf(struct libserial_port *port, const uint8_t **buf)
+{
+	struct libserial_outq *q = &port->outq;
+	uint32_t off = q->head % LIBSERIAL_OUTQ;
+	uint32_t len = libserial_pending(port);
+
+	if (len > LIBSERIAL_OUTQ - off)
+		len = LIBSERIAL_OUTQ - off;
+
+	*buf = q->buf + off;
+	q->busy = 1;
+
+	return len;
+}
+
+void libserial_out_done(struct libserial_port *port, ssize_t ret, int err)
+{
+	struct libserial_outq *q = &port->outq;
+
+	q->busy = 0;
+
+	stats_inc(&port->stats.writes);
+
+	if (ret >= 0) {
+		stats_add(&port->stats.written, ret);
+		q->head += ret;
+		outq_complete(port, 0);
+		return;
+	}
+
+	if (err == EAGAIN || err == EINTR) {
+		stats_inc(&port->stats.write_again);
+		return;
+	}
+
+	stats_inc(&port->stats.write_errors);
+	EVLOG(&port->log, EVLOG_ERR, EVLOG_WRITE_ERROR, err,
+	      q->buf[q->head % LIBSERIAL_OUTQ]);
+
+	/* commands can't be resumed in the middle, drop the whole queue */
+	q->head = q->tail;
+	outq_complete(port, err);
+}
+
+int libserial_flush(struct libserial_port *port)
+{
+	const uint8_t *buf;
+	uint32_t len;
+	ssize_t ret;
+	int err;
+
+	/* asynchronous write is in flight or the loop does the writes */
+	if (port->outq.busy || port->outq.async)
+		return libserial_pending(port);
+
+	while (libserial_pending(port)) {
+		len = libserial_out_buf(port, &buf);
+		ret = write(port->wfd, buf, len);
+		err = errno;
+
+		libserial_out_done(port, ret, err);
+
+		if (ret < 0) {
+			if (err == EAGAIN || err == EINTR)
+				break;
+
+			errno = err;
+			return -1;
+		}
+
+		if ((uint32_t)ret < len)
+			break;
+	}
+
+	return libserial_pending(port);
+}
+
+void libserial_get_stats(struct libserial_port *port,
+                         struct libserial_stats *stats)
+{
+	stats_snapshot(stats, &port->stats, sizeof(*stats));
+}
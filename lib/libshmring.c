@@ -0,0 +1,251 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libseqlock.h"
+#include "libshmring.h"
+
+/*
+ * Slot is the seqlock sequence followed by the record.
+ */
+static uint8_t *slot(struct shmring *self, uint64_t pos)
+{
+	return self->slots + (pos & self->mask) * self->slot_size;
+}
+
+static struct shmring *ring_alloc(const char *name, int writer)
+{
+	struct shmring *self = calloc(1, sizeof(*self) + strlen(name) + 1);
+
+	if (self == NULL)
+		return NULL;
+
+	strcpy(self->name, name);
+	self->writer = writer;
+
+	return self;
+}
+
+static void ring_setup(struct shmring *self, void *map, size_t size)
+{
+	self->hdr       = map;
+	self->slots     = (uint8_t*)map + sizeof(struct shmring_hdr);
+	self->map_size  = size;
+	self->rec_size  = self->hdr->rec_size;
+	self->slot_size = sizeof(uint64_t) + self->rec_size;
+	self->mask      = self->hdr->slots - 1;
+}
+
+struct shmring *shmring_create(const char *name, uint32_t kind,
+                               uint32_t rec_size, uint32_t slots)
+{
+	struct shmring *self;
+	struct shmring_hdr *hdr;
+	uint32_t n = 1;
+	size_t size;
+	void *map;
+	int fd;
+
+	if (rec_size == 0 || rec_size % sizeof(uint64_t) || slots == 0 ||
+	    slots > (1u<<24)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	while (n < slots)
+		n <<= 1;
+
+	size = sizeof(struct shmring_hdr) + (size_t)n * (sizeof(uint64_t) + rec_size);
+
+	self = ring_alloc(name, 1);
+
+	if (self == NULL)
+		return NULL;
+
+	/* start over, readers of a previous ring keep their mapping */
+	shm_unlink(name);
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	if (fd < 0)
+		goto err;
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		shm_unlink(name);
+		goto err;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		shm_unlink(name);
+		goto err;
+	}
+
+	hdr = map;
+	hdr->version  = SHMRING_VERSION;
+	hdr->kind     = kind;
+	hdr->rec_size = rec_size;
+	hdr->slots    = n;
+
+	/* readers check the magic, it's set once the header is complete */
+	__atomic_store_n(&hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+
+	ring_setup(self, map, size);
+
+	return self;
+err:
+	free(self);
+	return NULL;
+}
+
+void shmring_destroy(struct shmring *self)
+{
+	if (self == NULL)
+		return;
+
+	munmap(self->hdr, self->map_size);
+	shm_unlink(self->name);
+	free(self);
+}
+
+void shmring_write(struct shmring *self, const void *rec)
+{
+	uint64_t head = self->hdr->head;
+	uint8_t *s = slot(self, head);
+
+	seqlock_write((uint64_t*)s, s + sizeof(uint64_t), rec, self->rec_size);
+
+	__atomic_store_n(&self->hdr->head, head + 1, __ATOMIC_RELEASE);
+}
+
+struct shmring *shmring_attach(const char *name, uint32_t kind)
+{
+	struct shmring_hdr *hdr;
+	struct shmring *self;
+	struct stat st;
+	size_t size;
+	void *map;
+	int fd;
+
+	self = ring_alloc(name, 0);
+
+	if (self == NULL)
+		return NULL;
+
+	fd = shm_open(name, O_RDONLY, 0);
+
+	if (fd < 0)
+		goto err;
+
+	if (fstat(fd, &st)) {
+		close(fd);
+		goto err;
+	}
+
+	if ((size_t)st.st_size < sizeof(struct shmring_hdr)) {
+		close(fd);
+		errno = EPROTO;
+		goto err;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		goto err;
+
+	hdr  = map;
+	size = sizeof(struct shmring_hdr) +
+	       (size_t)hdr->slots * (sizeof(uint64_t) + hdr->rec_size);
+
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC ||
+	    hdr->version != SHMRING_VERSION || size != (size_t)st.st_size ||
+	    hdr->slots == 0 || (hdr->slots & (hdr->slots - 1)) ||
+	    (kind && hdr->kind != kind)) {
+		munmap(map, st.st_size);
+		errno = EPROTO;
+		goto err;
+	}
+
+	ring_setup(self, map, size);
+
+	self->cursor = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+	return self;
+err:
+	free(self);
+	return NULL;
+}
+
+void shmring_detach(struct shmring *self)
+{
+	if (self == NULL)
+		return;
+
+	munmap(self->hdr, self->map_size);
+	free(self);
+}
+
+int shmring_read(struct shmring *self, void *rec)
+{
+	uint64_t head, updates;
+	uint32_t slots = self->mask + 1;
+	uint8_t *s;
+
+	for (;;) {
+		head = __atomic_load_n(&self->hdr->head, __ATOMIC_ACQUIRE);
+
+		if (self->cursor == head)
+			return 0;
+
+		/* skip what has been overwritten already */
+		if (head - self->cursor > slots) {
+			self->lost  += head - slots - self->cursor;
+			self->cursor = head - slots;
+		}
+
+		s = slot(self, self->cursor);
+
+		/*
+		 * The slot is written for the n-th time when the writer gets to
+		 * record n * slots + pos, anything else is a newer record.
+		 */
+		if (!seqlock_read_try((uint64_t*)s, rec, s + sizeof(uint64_t),
+		                      self->rec_size, &updates) &&
+		    updates == self->cursor / slots + 1) {
+			self->cursor++;
+			return 1;
+		}
+
+		self->lost++;
+		self->cursor++;
+	}
+}
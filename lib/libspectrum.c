@@ -0,0 +1,212 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <math.h>
+#include <pthread.h>
+
+#include "libspectrum.h"
+
+/*
+ * Real FFT of size N is computed as complex FFT of size N/2 on even/odd
+ * samples followed by a split step.
+ */
+#define N SPECTRUM_SIZE
+#define M (SPECTRUM_SIZE/2)
+
+#if (N & (N - 1)) || N < 32
+# error SPECTRUM_SIZE must be power of two and at least 32
+#endif
+
+/* W_N^k = exp(-2*pi*i*k/N) for k < N/2, used by the split step */
+static float tw_re[N/2];
+static float tw_im[N/2];
+
+/*
+ * FFT twiddles stored per stage, the stage with butterfly distance half
+ * starts at half - 1 and holds W_(2*half)^j for j < half, so the butterfly
+ * loop reads them contiguously.
+ */
+static float st_re[M];
+static float st_im[M];
+
+static uint16_t bit_rev[M];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static void spectrum_tables(void)
+{
+	unsigned int i, j, bits = 0;
+
+	for (i = 0; i < N/2; i++) {
+		tw_re[i] = cos(2 * M_PI * i / N);
+		tw_im[i] = -sin(2 * M_PI * i / N);
+	}
+
+	/* W_(2*half)^j = W_N^(j*N/(2*half)) */
+	for (i = 1; i < M; i <<= 1) {
+		for (j = 0; j < i; j++) {
+			st_re[i - 1 + j] = tw_re[j * (N/(2*i))];
+			st_im[i - 1 + j] = tw_im[j * (N/(2*i))];
+		}
+	}
+
+	while ((1u<<bits) < M)
+		bits++;
+
+	for (i = 0; i < M; i++) {
+		bit_rev[i] = 0;
+		for (j = 0; j < bits; j++)
+			if (i & (1u<<j))
+				bit_rev[i] |= 1u<<(bits - 1 - j);
+	}
+}
+
+void spectrum_init(struct spectrum *self,
+                   void (*done)(struct VAmeter *meter, const struct spectrum *self),
+                   void *priv)
+{
+	unsigned int i;
+
+	/* meters may be set up from different threads */
+	pthread_once(&tables_once, spectrum_tables);
+
+	for (i = 0; i < SPECTRUM_BINS; i++)
+		self->mag[i] = 0;
+
+	for (i = 0; i < SPECTRUM_HARMONICS; i++)
+		self->harm[i] = 0;
+
+	self->fundamental = 0;
+	self->thd         = 0;
+	self->done        = done;
+	self->priv        = priv;
+	self->pos         = 0;
+	self->frame_start = 0;
+}
+
+/*
+ * In place radix-2 complex FFT of size M, separate real and imaginary arrays
+ * so that the butterfly loop vectorizes.
+ */
+static void fft_kernel(float *restrict re, float *restrict im)
+{
+	unsigned int len, half, i, j;
+
+	for (len = 2; len <= M; len <<= 1) {
+		const float *restrict wre, *restrict wim;
+
+		half = len/2;
+		wre  = st_re + half - 1;
+		wim  = st_im + half - 1;
+
+		for (i = 0; i < M; i += len) {
+			float *restrict are = re + i, *restrict aim = im + i;
+			float *restrict bre = re + i + half, *restrict bim = im + i + half;
+
+			for (j = 0; j < half; j++) {
+				float wr = wre[j];
+				float wi = wim[j];
+				float tr = bre[j] * wr - bim[j] * wi;
+				float ti = bre[j] * wi + bim[j] * wr;
+
+				bre[j] = are[j] - tr;
+				bim[j] = aim[j] - ti;
+				are[j] = are[j] + tr;
+				aim[j] = aim[j] + ti;
+			}
+		}
+	}
+}
+
+void spectrum_compute(struct spectrum *self)
+{
+	float re[M], im[M];
+	float max = 0, sum = 0;
+	unsigned int i, k, fund;
+
+	/* pack even samples to real and odd to imaginary part */
+	for (i = 0; i < M; i++) {
+		re[bit_rev[i]] = self->buf[2*i];
+		im[bit_rev[i]] = self->buf[2*i+1];
+	}
+
+	fft_kernel(re, im);
+
+	/* split into spectrum of the real signal */
+	self->mag[0] = fabsf(re[0] + im[0]) / N;
+	self->mag[M] = fabsf(re[0] - im[0]) / N;
+
+	for (k = 1; k < M; k++) {
+		float zr = re[k], zi = im[k];
+		float cr = re[M - k], ci = -im[M - k];
+		float er = (zr + cr) / 2, ei = (zi + ci) / 2;
+		float o_re = (zi - ci) / 2, o_im = -(zr - cr) / 2;
+		float xr = er + tw_re[k] * o_re - tw_im[k] * o_im;
+		float xi = ei + tw_re[k] * o_im + tw_im[k] * o_re;
+
+		self->mag[k] = 2 * sqrtf(xr * xr + xi * xi) / N;
+	}
+
+	fund = 1;
+
+	for (k = 1; k <= M; k++) {
+		if (self->mag[k] > max) {
+			max  = self->mag[k];
+			fund = k;
+		}
+	}
+
+	self->fundamental = fund;
+
+	for (i = 0; i < SPECTRUM_HARMONICS; i++) {
+		k = (i + 1) * fund;
+		self->harm[i] = k <= M ? self->mag[k] : 0;
+
+		if (i > 0)
+			sum += self->harm[i] * self->harm[i];
+	}
+
+	self->thd = max > 0 ? sqrtf(sum) / max : 0;
+}
+
+int spectrum_frame(struct spectrum *self, float scale, int valid)
+{
+	unsigned int i;
+
+	if (!valid) {
+		self->pos = self->frame_start;
+		return 0;
+	}
+
+	for (i = self->frame_start; i < self->pos; i++)
+		self->buf[i] *= scale;
+
+	self->frame_start = self->pos;
+
+	if (self->pos < SPECTRUM_SIZE)
+		return 0;
+
+	spectrum_compute(self);
+
+	self->pos         = 0;
+	self->frame_start = 0;
+
+	return 1;
+}
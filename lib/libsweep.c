@@ -0,0 +1,232 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+
+#include "libsweep.h"
+
+/* voltage frame in progress when frequency was changed */
+#define SKIP_FRAMES 1
+
+int sweep_init(struct sweep *self, struct generator *gen,
+               struct VAmeter *meter, const float *freqs, unsigned int cnt)
+{
+	unsigned int i;
+
+	self->points = malloc(cnt * sizeof(struct sweep_point));
+
+	if (self->points == NULL)
+		return -1;
+
+	for (i = 0; i < cnt; i++) {
+		self->points[i].freq    = freqs[i];
+		self->points[i].vrms    = 0;
+		self->points[i].acdc    = VAMETER_AC;
+		self->points[i].settled = 0;
+		self->points[i].frames  = 0;
+		self->points[i].time    = 0;
+	}
+
+	self->gen   = gen;
+	self->meter = meter;
+	self->cnt   = cnt;
+	self->cur   = 0;
+	self->ref   = 0;
+
+	self->tolerance  = 0.005;
+	self->floor      = 0.002;
+	self->hold       = 3;
+	self->max_frames = 50;
+
+	return 0;
+}
+
+void sweep_free(struct sweep *self)
+{
+	free(self->points);
+	self->points = NULL;
+	self->cnt = 0;
+}
+
+void sweep_log_freqs(float *freqs, unsigned int cnt, float start, float stop)
+{
+	unsigned int i;
+
+	if (cnt == 1) {
+		freqs[0] = start;
+		return;
+	}
+
+	for (i = 0; i < cnt; i++)
+		freqs[i] = start * powf(stop/start, (float)i / (cnt - 1));
+}
+
+static float secs_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) +
+	       (float)(now.tv_nsec - start->tv_nsec) / 1000000000;
+}
+
+static int sweep_set_point(struct sweep *self)
+{
+	uint32_t fval;
+
+	if (generator_freq_word(self->gen, self->points[self->cur].freq, &fval))
+		return -1;
+
+	generator_set_freq(self->gen, fval);
+
+	vameter_voltage_settle(self->meter, self->tolerance, self->floor, self->hold);
+	self->skip = SKIP_FRAMES;
+	clock_gettime(CLOCK_MONOTONIC, &self->start);
+
+	return 0;
+}
+
+static void sweep_next_point(struct sweep *self, uint8_t settled)
+{
+	struct sweep_point *point = &self->points[self->cur];
+
+	point->settled = settled;
+	point->time    = secs_since(&self->start);
+
+	if (++self->cur < self->cnt)
+		sweep_set_point(self);
+}
+
+static void sweep_voltage(struct sweep *self, const struct vameter_sample *s)
+{
+	struct sweep_point *point;
+
+	if (self->cur >= self->cnt)
+		return;
+
+	point = &self->points[self->cur];
+	point->frames++;
+
+	if (self->skip) {
+		self->skip--;
+		vameter_settle_restart(self->meter);
+		return;
+	}
+
+	point->vrms = s->ac_rms;
+	point->acdc = s->acdc;
+
+	if (!(self->meter->voltage_flags & VAMETER_SETTLING)) {
+		sweep_next_point(self, 1);
+		return;
+	}
+
+	if (point->frames >= self->max_frames)
+		sweep_next_point(self, 0);
+}
+
+static void sweep_voltage_frame(struct VAmeter *meter, void *ctx,
+                                const struct vameter_sample *s)
+{
+	(void) meter;
+	sweep_voltage(ctx, s);
+}
+
+static const struct vameter_ops sweep_ops = {
+	.voltage_frame = sweep_voltage_frame,
+};
+
+int sweep_run(struct sweep *self, int timeout_ms)
+{
+	struct pollfd pfd[2] = {
+		{.fd = vameter_get_fd(self->meter), .events = POLLIN},
+		{.fd = self->gen->port->fd, .events = POLLIN},
+	};
+	struct vameter_settle user_settle = self->meter->voltage_settle;
+	struct timespec start;
+	int left;
+
+	if (self->cnt == 0)
+		return -1;
+
+	self->cur = 0;
+
+	if (sweep_set_point(self))
+		return -1;
+
+	vameter_listen(self->meter, &self->listener, &sweep_ops, self);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (self->cur < self->cnt) {
+		left = timeout_ms - 1000 * secs_since(&start);
+
+		if (left <= 0)
+			break;
+
+		if (poll(pfd, 2, left) < 0)
+			break;
+
+		if (pfd[0].revents & POLLIN) {
+			if (vameter_read(self->meter) <= 0)
+				break;
+		}
+
+		/* drain generator acks */
+		if (pfd[1].revents & POLLIN)
+			generator_read(self->gen);
+	}
+
+	vameter_unlisten(self->meter, &self->listener);
+	self->meter->voltage_settle = user_settle;
+
+	return self->cur < self->cnt ? -1 : 0;
+}
+
+void sweep_write_table(struct sweep *self, FILE *f)
+{
+	float ref = self->ref;
+	unsigned int i;
+
+	if (ref <= 0) {
+		for (i = 0; i < self->cnt; i++)
+			if (self->points[i].vrms > ref)
+				ref = self->points[i].vrms;
+	}
+
+	fprintf(f, "# freq[Hz]      V[V]    gain[dB] settled frames time[s]\n");
+
+	for (i = 0; i < self->cnt; i++) {
+		struct sweep_point *point = &self->points[i];
+		float gain = -INFINITY;
+
+		if (point->vrms > 0 && ref > 0)
+			gain = 20 * log10f(point->vrms / ref);
+
+		fprintf(f, "%12.3f %10.6f %9.3f %5u %7u %7.2f\n",
+		        point->freq, point->vrms, gain, point->settled,
+		        point->frames, point->time);
+	}
+}
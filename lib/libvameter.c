@@ -28,10 +28,13 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <math.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
 
 #include "libvameter.h"
+#include "listeners.h"
 
-#define DPRINT(...) { fprintf(stderr, "%s: %i: ", __FILE__, __LINE__); fprintf(stderr, __VA_ARGS__); }
 
 /***************************************
  *                                     *
@@ -70,6 +73,27 @@
  */
 #define CONTROL_CMD 0x80
 
+/*
+ * Bits in ref_known and ref_fresh.
+ */
+#define REF_V_ZERO  0x01
+#define REF_V       0x02
+#define REF_V_RANGE 0x04
+#define REF_A_ZERO  0x08
+#define REF_A       0x10
+#define REF_A_RANGE 0x20
+
+#define REF_V_ALL (REF_V_ZERO | REF_V | REF_V_RANGE)
+#define REF_A_ALL (REF_A_ZERO | REF_A | REF_A_RANGE)
+
+/*
+ * Number of two byte samples in reference and sample frames.
+ */
+#define FRAME_SAMPLES 32
+
+#define REF_CACHE_DIR "/.usb-instruments/"
+#define SERIAL_BY_ID  "/dev/serial/by-id"
+
 static char *current_range_A[] = 
 {
 	"220mA",
@@ -124,52 +148,305 @@ static float current_magick[] =
 	5.00,
 };
 
-struct VAmeter *vameter_init(const char *device_path)
+/*
+ * Looks up the /dev/serial/by-id/ name of the port, the name contains the
+ * adapter serial number so it doesn't change when the adapter is plugged
+ * into another port or the ttyUSB numbers are shuffled. Returns NULL for
+ * adapters without a by-id link.
+ */
+static char *serial_id(struct libserial_port *port)
 {
-	struct VAmeter *new; 
-	struct libserial_port *port;
+	struct dirent *ent;
+	struct stat st;
+	char path[PATH_MAX];
+	char *id = NULL;
+	DIR *dir;
 
-	port = libserial_open(device_path, B19200); 
+	dir = opendir(SERIAL_BY_ID);
 
-	if (port == NULL)
+	if (dir == NULL)
 		return NULL;
 
-	new = malloc(sizeof (struct VAmeter) + strlen(device_path) + 1);
+	while (id == NULL && (ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
 
-	if (new == NULL) {
-		libserial_close(port);		
-		return NULL;
+		snprintf(path, sizeof(path), "%s/%s", SERIAL_BY_ID, ent->d_name);
+
+		if (stat(path, &st) || !S_ISCHR(st.st_mode))
+			continue;
+
+		if (st.st_rdev == port->st.st_rdev)
+			id = strdup(ent->d_name);
 	}
 
+	closedir(dir);
+
+	return id;
+}
+
+/*
+ * Sets default cache file $HOME/.usb-instruments/ID.ref, where ID is the
+ * by-id name of the port. The cache is not used when there is no stable
+ * name, references cached under ttyUSBn may belong to another meter.
+ */
+static void ref_cache_default(struct VAmeter *meter)
+{
+	const char *home = getenv("HOME");
+	char *path, *id;
+	size_t len;
+
+	if (home == NULL)
+		return;
+
+	id = serial_id(meter->port);
+
+	if (id == NULL)
+		return;
+
+	len = strlen(home) + sizeof(REF_CACHE_DIR) + strlen(id) + 4;
+	path = malloc(len);
+
+	if (path != NULL) {
+		snprintf(path, len, "%s%s%s.ref", home, REF_CACHE_DIR, id);
+		meter->ref_cache = path;
+	}
+
+	free(id);
+}
+
+/*
+ * Initalizes meter, hot points either into a pool or to the same allocation.
+ */
+static void vameter_setup(struct VAmeter *new, struct vameter_hot *hot,
+                          struct libserial_port *port)
+{
+	new->hot  = hot;
+	new->pool = NULL;
 	new->port = port;
 
-	new->cur_voltage_range    = 0xff;
-	new->cur_current_range    = 0xff;
-	new->sample_low           = 0;
-	new->command              = 0x00;
-	new->neg_volt_samp        = 0;
-	new->neg_curr_samp        = 0;
-	new->sample_cnt           = 0;
+	memset(hot, 0, sizeof(*hot));
+
+	hot->char_ns           = port->char_ns;
+	hot->cur_voltage_range = 0xff;
+	hot->cur_current_range = 0xff;
+	hot->sample_min        = INFINITY;
+	hot->sample_max        = -INFINITY;
+
+	new->voltage_flags        = 0;
+	new->current_flags        = 0;
+
+	/* settling detector is disabled by default */
+	vameter_voltage_settle(new, 0, 0, 0);
+	vameter_current_settle(new, 0, 0, 0);
+
+	/* references are not known until loaded or received */
+	new->ref_cache            = NULL;
+
+	/* cache references for devices only, not for captures */
+	if (S_ISCHR(port->st.st_mode))
+		ref_cache_default(new);
+
+	if (new->ref_cache != NULL)
+		vameter_load_refs(new, new->ref_cache);
 
 	/* set callbacks to NULL */
 	new->current_range        = NULL;
 	new->voltage_range        = NULL;
 	new->voltage_sample       = NULL;
 	new->current_sample       = NULL;
+	new->voltage_stable       = NULL;
+	new->current_stable       = NULL;
+	new->voltage_frame        = NULL;
+	new->current_frame        = NULL;
+	new->cond                 = NULL;
+	new->listeners            = NULL;
+	new->walks                = NULL;
+	new->events               = NULL;
+	new->nevents              = 0;
+	new->listener.ops         = NULL;
+	new->energy               = NULL;
+	new->exporter             = NULL;
+	new->ring                 = NULL;
+	new->t_voltage            = 0;
+	new->t_current            = 0;
+	memset(&new->stats, 0, sizeof(new->stats));
+
+	memset(&new->snap, 0, sizeof(new->snap));
+	new->snap.voltage_range = 0xff;
+	new->snap.current_range = 0xff;
+	new->snap_seq = 0;
+	new->snap_reg = new->snap;
 
 	/* set callibrations to 1 */
 	vameter_unload_callib(new);
+}
+
+struct VAmeter *vameter_init(const char *device_path)
+{
+	struct vameter_hot *hot;
+	struct VAmeter *new; 
+	struct libserial_port *port;
+
+	port = libserial_open(device_path, B19200); 
+
+	if (port == NULL)
+		return NULL;
+
+	/* cache line aligned hot part followed by the meter */
+	if (posix_memalign((void**)&hot, 64, sizeof(struct vameter_hot) +
+	                                     sizeof(struct VAmeter))) {
+		libserial_close(port);		
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	new = (struct VAmeter*)(hot + 1);
+
+	vameter_setup(new, hot, port);
 
 	return new;
 }
 
+struct vameter_pool *vameter_pool_create(unsigned int size)
+{
+	struct vameter_pool *pool = malloc(sizeof(struct vameter_pool));
+
+	if (pool == NULL)
+		return NULL;
+
+	pool->size   = size;
+	pool->used   = 0;
+	pool->meters = malloc(size * sizeof(struct VAmeter));
+	pool->in_use = calloc(size, 1);
+
+	if (posix_memalign((void**)&pool->hot, 64, size * sizeof(struct vameter_hot)))
+		pool->hot = NULL;
+
+	if (pool->meters == NULL || pool->in_use == NULL || pool->hot == NULL) {
+		vameter_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+struct VAmeter *vameter_pool_init(struct vameter_pool *pool,
+                                  const char *device_path)
+{
+	struct libserial_port *port;
+	struct VAmeter *new;
+	unsigned int i;
+
+	for (i = 0; i < pool->size; i++)
+		if (!pool->in_use[i])
+			break;
+
+	if (i == pool->size) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	port = libserial_open(device_path, B19200);
+
+	if (port == NULL)
+		return NULL;
+
+	new = &pool->meters[i];
+
+	vameter_setup(new, &pool->hot[i], port);
+
+	new->pool = pool;
+	pool->in_use[i] = 1;
+	pool->used++;
+
+	return new;
+}
+
+void vameter_pool_destroy(struct vameter_pool *pool)
+{
+	if (pool == NULL)
+		return;
+
+	free(pool->meters);
+	free(pool->in_use);
+	free(pool->hot);
+	free(pool);
+}
+
+struct VAmeter *vameter_init_ops(const char *device_path,
+                                 const struct vameter_ops *ops, void *ctx)
+{
+	struct VAmeter *meter = vameter_init(device_path);
+
+	if (meter != NULL)
+		vameter_set_ops(meter, ops, ctx);
+
+	return meter;
+}
+
 void vameter_exit(struct VAmeter *meter)
 {
 	if (meter == NULL)
 		return;
 	
+	if (meter->ref_cache != NULL && meter->hot->ref_fresh)
+		vameter_save_refs(meter, meter->ref_cache);
+
+	vameter_energy_stop(meter);
+	exporter_vameter_destroy(meter->exporter);
+	shmring_destroy(meter->ring);
+
 	libserial_close(meter->port);
-	free(meter);
+	free(meter->ref_cache);
+
+	if (meter->pool != NULL) {
+		meter->pool->in_use[meter - meter->pool->meters] = 0;
+		meter->pool->used--;
+		return;
+	}
+
+	free(meter->hot);
+}
+
+void vameter_listen(struct VAmeter *meter, struct vameter_listener *listener,
+                    const struct vameter_ops *ops, void *ctx)
+{
+	struct vameter_listener **i;
+
+	listener->ops  = ops;
+	listener->ctx  = ctx;
+	listener->next = NULL;
+
+	for (i = &meter->listeners; *i != NULL; i = &(*i)->next);
+
+	*i = listener;
+}
+
+void vameter_unlisten(struct VAmeter *meter, struct vameter_listener *listener)
+{
+	struct vameter_listener **i;
+
+	UNLISTEN_OPS(meter, listener);
+
+	for (i = &meter->listeners; *i != NULL; i = &(*i)->next) {
+		if (*i == listener) {
+			*i = listener->next;
+			return;
+		}
+	}
+}
+
+void vameter_set_ops(struct VAmeter *meter, const struct vameter_ops *ops,
+                     void *ctx)
+{
+	if (meter->listener.ops != NULL)
+		vameter_unlisten(meter, &meter->listener);
+
+	meter->listener.ops = NULL;
+
+	if (ops != NULL)
+		vameter_listen(meter, &meter->listener, ops, ctx);
 }
 
 /*
@@ -186,6 +463,62 @@ int vameter_get_fd(struct VAmeter *meter)
 }
 
 
+/*
+ * Returns non-zero if all references in mask are known, sets flags
+ * accordingly.
+ */
+static int ref_check(struct VAmeter *meter, uint8_t mask, uint8_t *flags)
+{
+	if ((meter->hot->ref_known & mask) != mask)
+		return 0;
+
+	if ((meter->hot->ref_fresh & mask) != mask)
+		*flags |= VAMETER_PROVISIONAL;
+	else
+		*flags &= ~VAMETER_PROVISIONAL;
+
+	return 1;
+}
+
+static void settle_reset(struct vameter_settle *settle)
+{
+	settle->cnt  = 0;
+	settle->last = NAN;
+}
+
+/*
+ * Updates settling detector, returns non-zero for the first stable sample.
+ */
+static int settle_update(struct vameter_settle *settle, float val, uint8_t *flags)
+{
+	if (settle->hold == 0) {
+		*flags &= ~VAMETER_SETTLING;
+		return 0;
+	}
+
+	/* comparsion with NAN is always false */
+	if (fabsf(val - settle->last) <= settle->tolerance * fabsf(val) + settle->floor) {
+		if (settle->cnt < settle->hold)
+			settle->cnt++;
+	} else {
+		settle->cnt = 0;
+	}
+
+	settle->last = val;
+
+	if (settle->cnt < settle->hold) {
+		*flags |= VAMETER_SETTLING;
+		return 0;
+	}
+
+	if (*flags & VAMETER_SETTLING) {
+		*flags &= ~VAMETER_SETTLING;
+		return 1;
+	}
+
+	return 0;
+}
+
 /*
  * Test for negative/possitive or AC.
  */
@@ -200,93 +533,387 @@ static char calc_acdc(uint8_t neg_samp, uint8_t samp_cnt)
 	return VAMETER_AC;
 }
 
+/*
+ * Computes frame values from the accumulated samples.
+ */
+static void sample_stats(struct VAmeter *meter, struct vameter_sample *s,
+                         float scale, uint8_t neg_samp)
+{
+	float mean_sq = meter->hot->sample_sum / meter->hot->sample_cnt;
+	float mean    = meter->hot->sample_lin / meter->hot->sample_cnt;
+	float peak    = fmaxf(fabsf(meter->hot->sample_min), fabsf(meter->hot->sample_max));
+
+	s->acdc   = calc_acdc(neg_samp, meter->hot->sample_cnt);
+	s->cnt    = meter->hot->sample_cnt;
+	s->rms    = sqrtf(mean_sq) * scale;
+	s->dc     = mean * scale;
+	s->ac_rms = sqrtf(fmaxf(mean_sq - mean * mean, 0)) * scale;
+	s->min    = meter->hot->sample_min * scale;
+	s->max    = meter->hot->sample_max * scale;
+	s->pp     = (meter->hot->sample_max - meter->hot->sample_min) * scale;
+	s->crest  = s->rms > 0 ? peak * scale / s->rms : 0;
+}
+
+static void proto_error(struct VAmeter *meter, uint64_t *cnt)
+{
+	stats_inc(cnt);
+
+	if (meter->exporter != NULL)
+		exporter_vameter_errors(meter->exporter, vameter_errors(&meter->stats));
+}
+
+/*
+ * Counts finished frame, checks length of sample frames.
+ */
+static void frame_end(struct VAmeter *meter, enum vameter_frame type)
+{
+	stats_inc(&meter->stats.frames[type]);
+
+	switch (type) {
+	case VAMETER_FRAME_V_RANGE:
+	case VAMETER_FRAME_A_RANGE:
+	break;
+	default:
+		if (meter->hot->sample_cnt != FRAME_SAMPLES || meter->hot->sample_low != 0)
+			proto_error(meter, &meter->stats.truncated);
+	}
+}
+
+static void frame_interval(struct stats_hist *hist, uint64_t *last, uint64_t t)
+{
+	if (*last != 0 && t > *last)
+		stats_hist(hist, (t - *last) / 1000);
+
+	*last = t;
+}
+
+/* seqlock copies whole uint64_t words */
+_Static_assert(sizeof(struct vameter_snapshot) % sizeof(uint64_t) == 0,
+               "vameter_snapshot size must be multiple of 8");
+
+static void snapshot_publish(struct VAmeter *meter, uint64_t t)
+{
+	meter->snap.seq++;
+	meter->snap.t = t;
+
+	seqlock_write(&meter->snap_seq, &meter->snap_reg, &meter->snap,
+	              sizeof(meter->snap));
+}
+
+void vameter_get_snapshot(struct VAmeter *meter, struct vameter_snapshot *snap)
+{
+	seqlock_read(&meter->snap_seq, snap, &meter->snap_reg, sizeof(*snap));
+}
+
+static void ring_publish(struct VAmeter *meter, const struct vameter_sample *s,
+                         char chan, uint8_t hw_switch)
+{
+	struct vameter_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.s         = *s;
+	rec.chan      = chan;
+	rec.hw_switch = hw_switch;
+
+	shmring_write(meter->ring, &rec);
+}
+
+static void add_event(struct VAmeter *meter, const struct vameter_sample *s,
+                      char chan, uint8_t hw_switch)
+{
+	struct vameter_event *ev = &meter->events[meter->nevents++];
+
+	ev->s         = *s;
+	ev->chan      = chan;
+	ev->hw_switch = hw_switch;
+}
+
+/*
+ * End of voltage samples frame.
+ */
+static void voltage_done(struct VAmeter *meter, uint64_t t)
+{
+	struct vameter_sample s;
+	uint8_t range = meter->hot->cur_voltage_range;
+	uint64_t cb_start;
+	float scale;
+	int stable;
+
+	frame_interval(&meter->stats.voltage_interval, &meter->t_voltage, t);
+
+	if (meter->hot->sample_cnt == 0 ||
+	    !ref_check(meter, REF_V_ALL, &meter->voltage_flags)) {
+		meter->hot->neg_volt_samp = 0;
+		if (meter->hot->voltage_spectrum != NULL)
+			spectrum_frame(meter->hot->voltage_spectrum, 0, 0);
+		return;
+	}
+
+	scale  = voltage_magick[range] / fabsf(meter->hot->voltage_ref - meter->hot->voltage_zero);
+	scale *= meter->voltage_callib[range];
+
+	sample_stats(meter, &s, scale, meter->hot->neg_volt_samp);
+	meter->hot->neg_volt_samp = 0;
+
+	meter->voltage = s.rms;
+
+	stable = settle_update(&meter->voltage_settle, s.rms, &meter->voltage_flags);
+
+	s.range = range;
+	s.flags = meter->voltage_flags;
+	s.t     = t;
+	s.dt    = 2 * meter->hot->char_ns;
+
+	meter->snap.voltage       = s.rms;
+	meter->snap.voltage_t     = t;
+	meter->snap.voltage_range = range;
+	meter->snap.voltage_acdc  = s.acdc;
+	meter->snap.voltage_flags = s.flags;
+	snapshot_publish(meter, t);
+
+	if (meter->energy != NULL)
+		energy_voltage(meter->energy, &s);
+
+	if (meter->exporter != NULL)
+		exporter_vameter_voltage(meter->exporter, &s);
+
+	if (meter->ring != NULL)
+		ring_publish(meter, &s, 'V', 0);
+
+	if (meter->events != NULL)
+		add_event(meter, &s, 'V', 0);
+
+	cb_start = libserial_time();
+
+	if (meter->voltage_sample != NULL)
+		meter->voltage_sample(s.acdc, s.rms);
+
+	if (meter->voltage_frame != NULL)
+		meter->voltage_frame(meter, &s);
+
+	if (stable && meter->voltage_stable != NULL)
+		meter->voltage_stable(s.acdc, s.rms);
+
+	CALL_OPS(meter, voltage_sample, s.acdc, s.rms);
+	CALL_OPS(meter, voltage_frame, &s);
+
+	if (stable)
+		CALL_OPS(meter, voltage_stable, s.acdc, s.rms);
+
+	if (meter->cond != NULL)
+		cond_eval(meter->cond, COND_VOLTAGE, s.rms);
+
+	if (meter->hot->voltage_spectrum != NULL) {
+		struct spectrum *spectrum = meter->hot->voltage_spectrum;
+
+		if (spectrum_frame(spectrum, scale, 1) && spectrum->done != NULL)
+			spectrum->done(meter, spectrum);
+	}
+
+	stats_add(&meter->stats.callback_ns, libserial_time() - cb_start);
+}
+
+/*
+ * End of current samples frame.
+ */
+static void current_done(struct VAmeter *meter, uint64_t t)
+{
+	struct vameter_sample s;
+	uint8_t range = meter->hot->cur_current_range;
+	uint64_t cb_start;
+	float scale;
+	int stable;
+
+	frame_interval(&meter->stats.current_interval, &meter->t_current, t);
+
+	if (meter->hot->sample_cnt == 0 ||
+	    !ref_check(meter, REF_A_ALL, &meter->current_flags)) {
+		meter->hot->neg_curr_samp = 0;
+		if (meter->hot->current_spectrum != NULL)
+			spectrum_frame(meter->hot->current_spectrum, 0, 0);
+		return;
+	}
+
+	scale  = current_magick[range] / fabsf(meter->hot->current_ref - meter->hot->current_zero);
+	scale *= meter->current_callib[range];
+
+	sample_stats(meter, &s, scale, meter->hot->neg_curr_samp);
+	meter->hot->neg_curr_samp = 0;
+
+	meter->current = s.rms;
+
+	stable = settle_update(&meter->current_settle, s.rms, &meter->current_flags);
+
+	s.range = range;
+	s.flags = meter->current_flags;
+	s.t     = t;
+	s.dt    = 2 * meter->hot->char_ns;
+
+	meter->snap.current       = s.rms;
+	meter->snap.current_t     = t;
+	meter->snap.current_range = range;
+	meter->snap.hw_switch     = meter->hot->hw_switch;
+	meter->snap.current_acdc  = s.acdc;
+	meter->snap.current_flags = s.flags;
+	snapshot_publish(meter, t);
+
+	if (meter->energy != NULL)
+		energy_current(meter->energy, &s);
+
+	if (meter->exporter != NULL)
+		exporter_vameter_current(meter->exporter, &s, meter->hot->hw_switch);
+
+	if (meter->ring != NULL)
+		ring_publish(meter, &s, 'A', meter->hot->hw_switch);
+
+	if (meter->events != NULL)
+		add_event(meter, &s, 'A', meter->hot->hw_switch);
+
+	cb_start = libserial_time();
+
+	if (meter->current_sample != NULL)
+		meter->current_sample(s.acdc, s.rms);
+
+	if (meter->current_frame != NULL)
+		meter->current_frame(meter, &s);
+
+	if (stable && meter->current_stable != NULL)
+		meter->current_stable(s.acdc, s.rms);
+
+	CALL_OPS(meter, current_sample, s.acdc, s.rms);
+	CALL_OPS(meter, current_frame, &s);
+
+	if (stable)
+		CALL_OPS(meter, current_stable, s.acdc, s.rms);
+
+	if (meter->cond != NULL)
+		cond_eval(meter->cond, COND_CURRENT, s.rms);
+
+	if (meter->hot->current_spectrum != NULL) {
+		struct spectrum *spectrum = meter->hot->current_spectrum;
+
+		if (spectrum_frame(spectrum, scale, 1) && spectrum->done != NULL)
+			spectrum->done(meter, spectrum);
+	}
+
+	stats_add(&meter->stats.callback_ns, libserial_time() - cb_start);
+}
+
+/*
+ * End of reference frame, a frame without samples leaves the reference
+ * as it was.
+ */
+static void ref_frame(struct vameter_hot *h, float *ref, uint8_t bit)
+{
+	if (h->sample_cnt == 0)
+		return;
+
+	*ref = h->sample_sum / h->sample_cnt;
+	h->ref_known |= bit;
+	h->ref_fresh |= bit;
+}
+
 /*
  * Process next part of the buffer. Current possition in data packet is
  * remebered in struct vameter.
  */
-void vameter_process(struct VAmeter *meter, uint8_t *buf, uint32_t buf_len)
+static void process(struct VAmeter *meter, const uint8_t *buf, uint32_t buf_len,
+                    uint64_t t)
 {
+	struct vameter_hot *h = meter->hot;
 	uint32_t i;
 	uint8_t range;
+	uint64_t t_end;
 
 	for (i = 0; i < buf_len; i++) {
 		
 		/* Parse control character from the stream. */
 		if (buf[i] & CONTROL_CMD) {
+			/* frame has ended with the previous byte */
+			t_end = libserial_byte_time(t, h->char_ns, i, buf_len) - h->char_ns;
 			
-			switch (meter->command) {
+			switch (h->command) {
 				
 				case 0x00:
+				break;
+
 				case V_RANGE:
+					frame_end(meter, VAMETER_FRAME_V_RANGE);
+				break;
+
 				case A_RANGE_2A:
 				case A_RANGE_600mA:
+					frame_end(meter, VAMETER_FRAME_A_RANGE);
 				break;
 
 				case V_ZERO_REF:
-					meter->voltage_zero = meter->sample_sum / meter->sample_cnt;
+					frame_end(meter, VAMETER_FRAME_V_ZERO_REF);
+					ref_frame(h, &h->voltage_zero, REF_V_ZERO);
 				break;
 				
 				case V_REF:
-					meter->voltage_ref = meter->sample_sum / meter->sample_cnt;
+					frame_end(meter, VAMETER_FRAME_V_REF);
+					ref_frame(h, &h->voltage_ref, REF_V);
 				break;
 
 				case V_SAMPLE:
-					range = meter->cur_voltage_range;
-
-					meter->voltage  = sqrtf(meter->sample_sum/meter->sample_cnt) * voltage_magick[range];
-					meter->voltage /= fabsf(meter->voltage_ref - meter->voltage_zero);
-					meter->voltage *= meter->voltage_callib[range];
-
-					if (meter->voltage_sample != NULL)
-						meter->voltage_sample(calc_acdc(meter->neg_volt_samp, meter->sample_cnt), meter->voltage);
-
-					meter->neg_volt_samp = 0;
+					frame_end(meter, VAMETER_FRAME_V_SAMPLE);
+					voltage_done(meter, t_end);
 				break;
 
 				case A_ZERO_REF:
-					meter->current_zero = meter->sample_sum / meter->sample_cnt;
+					frame_end(meter, VAMETER_FRAME_A_ZERO_REF);
+					ref_frame(h, &h->current_zero, REF_A_ZERO);
 				break;
 				case A_REF:
-					meter->current_ref  = meter->sample_sum / meter->sample_cnt;
+					frame_end(meter, VAMETER_FRAME_A_REF);
+					ref_frame(h, &h->current_ref, REF_A);
 				break;
 				case A_SAMPLE:
-					range = meter->cur_current_range;
-
-					meter->current  = sqrtf(meter->sample_sum/meter->sample_cnt) * current_magick[range];
-					meter->current /= fabsf(meter->current_ref - meter->current_zero);
-					meter->current *= meter->current_callib[range];
-
-					if (meter->current_sample != NULL)
-						meter->current_sample(calc_acdc(meter->neg_curr_samp, meter->sample_cnt), meter->current);
-					
-					meter->neg_curr_samp = 0;
+					frame_end(meter, VAMETER_FRAME_A_SAMPLE);
+					current_done(meter, t_end);
 				break;
 
 				default:
-					printf("ERROR: Unknown command %x.\n", buf[i]);
+					EVLOG(&meter->port->log, EVLOG_WARN,
+					      EVLOG_VAMETER_UNKNOWN, h->command, 0);
+					proto_error(meter, &meter->stats.unknown);
 			}
 
-			meter->command     = buf[i];
-			meter->sample_sum  = 0;
-			meter->sample_cnt  = 0;
+			h->command     = buf[i];
+			h->sample_sum  = 0;
+			h->sample_lin  = 0;
+			h->sample_min  = INFINITY;
+			h->sample_max  = -INFINITY;
+			h->sample_cnt  = 0;
 
 			continue;
 		}
 
-		switch (meter->command) {
+		switch (h->command) {
 			case V_RANGE:
 				/* Invalid voltage range */
 				if (buf[i] < V_RANGE_MIN || buf[i] > V_RANGE_MAX) {
-					printf("ERROR: Invalid voltage range %x\n", buf[i]);
+					EVLOG(&meter->port->log, EVLOG_WARN,
+					      EVLOG_VAMETER_VRANGE, buf[i], 0);
+					proto_error(meter, &meter->stats.invalid_range);
 					continue;
 				}
 				
-				/* voltage range has changed */
-				if (meter->cur_voltage_range != buf[i] - V_RANGE_MIN) {
+				/* voltage range has changed (or was preloaded) */
+				if (h->cur_voltage_range != buf[i] - V_RANGE_MIN ||
+				    !(h->ref_fresh & REF_V_RANGE)) {
 					range = buf[i] - V_RANGE_MIN;
-					meter->cur_voltage_range = range;
+					stats_inc(&meter->stats.range_changes);
+					h->cur_voltage_range = range;
+					settle_reset(&meter->voltage_settle);
+					h->ref_known |= REF_V_RANGE;
+					h->ref_fresh |= REF_V_RANGE;
 					if (meter->voltage_range != NULL)
 						meter->voltage_range(range, voltage_range[range]);
+					CALL_OPS(meter, voltage_range, range, voltage_range[range]);
+					if (meter->cond != NULL)
+						cond_eval(meter->cond, COND_VOLTAGE_RANGE, range);
 				}
 			break;
 			
@@ -294,17 +921,27 @@ void vameter_process(struct VAmeter *meter, uint8_t *buf, uint32_t buf_len)
 			case A_RANGE_2A:
 				/* invalid current range */
 				if (buf[i] < A_RANGE_MIN || buf[i] > A_RANGE_MAX) {
-					printf("ERROR: Invalid current range %x\n", buf[i]);
+					EVLOG(&meter->port->log, EVLOG_WARN,
+					      EVLOG_VAMETER_ARANGE, buf[i], 0);
+					proto_error(meter, &meter->stats.invalid_range);
 					continue;
 				}
 				
-				/* current range has changed */
-				if (meter->cur_current_range != buf[i] - A_RANGE_MIN || meter->command - A_RANGE_2A != meter->hw_switch) {
+				/* current range has changed (or was preloaded) */
+				if (h->cur_current_range != buf[i] - A_RANGE_MIN || h->command - A_RANGE_2A != h->hw_switch ||
+				    !(h->ref_fresh & REF_A_RANGE)) {
 					range = buf[i] - A_RANGE_MIN;
-					meter->cur_current_range = range;
-					meter->hw_switch         = meter->command - A_RANGE_2A; 
+					stats_inc(&meter->stats.range_changes);
+					h->cur_current_range = range;
+					h->hw_switch         = h->command - A_RANGE_2A; 
+					settle_reset(&meter->current_settle);
+					h->ref_known |= REF_A_RANGE;
+					h->ref_fresh |= REF_A_RANGE;
 					if (meter->current_range != NULL)
-						meter->current_range(meter->hw_switch, range, meter->hw_switch ? current_range_B[range] : current_range_A[range]);
+						meter->current_range(h->hw_switch, range, h->hw_switch ? current_range_B[range] : current_range_A[range]);
+					CALL_OPS(meter, current_range, h->hw_switch, range, h->hw_switch ? current_range_B[range] : current_range_A[range]);
+					if (meter->cond != NULL)
+						cond_eval(meter->cond, COND_CURRENT_RANGE, 4 * h->hw_switch + range);
 				}
 			break;
 
@@ -312,45 +949,209 @@ void vameter_process(struct VAmeter *meter, uint8_t *buf, uint32_t buf_len)
 			case V_REF:
 			case A_ZERO_REF:
 			case A_REF:
-				if (meter->sample_low == 0) {
-					meter->sample_low = buf[i];
+				if (h->sample_low == 0) {
+					h->sample_low = buf[i];
 				} else {
-					meter->sample_sum += (buf[i] & 0x0F)<<6 | ((0x3F & meter->sample_low));
-					meter->sample_cnt++;
-					meter->sample_low = 0;
+					h->sample_sum += (buf[i] & 0x0F)<<6 | ((0x3F & h->sample_low));
+					h->sample_cnt++;
+					h->sample_low = 0;
 				}
 			break;
 			
 			case V_SAMPLE:
 			case A_SAMPLE:
-				if (meter->sample_low == 0) {
-					meter->sample_low = buf[i];
+				if (h->sample_low == 0) {
+					h->sample_low = buf[i];
 				} else {
-					float sample = (buf[i] & 0x0F)<<6 | ((0x3F & meter->sample_low));
+					float sample = (buf[i] & 0x0F)<<6 | ((0x3F & h->sample_low));
 	
-					if (meter->command == V_SAMPLE) {
-						if (sample - meter->voltage_zero < 0)
-							meter->neg_volt_samp++;
-						sample -= meter->voltage_zero;
+					if (h->command == V_SAMPLE) {
+						if (sample - h->voltage_zero < 0)
+							h->neg_volt_samp++;
+						sample -= h->voltage_zero;
+						if (h->voltage_spectrum != NULL)
+							spectrum_sample(h->voltage_spectrum, sample);
 					} else {
-						if (sample - meter->current_zero < 0)
-							meter->neg_curr_samp++;
-						sample -= meter->current_zero;
+						if (sample - h->current_zero < 0)
+							h->neg_curr_samp++;
+						sample -= h->current_zero;
+						if (h->current_spectrum != NULL)
+							spectrum_sample(h->current_spectrum, sample);
 					}
 					
-					meter->sample_sum += sample*sample;
+					h->sample_sum += sample*sample;
+					h->sample_lin += sample;
+
+					if (sample < h->sample_min)
+						h->sample_min = sample;
+
+					if (sample > h->sample_max)
+						h->sample_max = sample;
 					
-					meter->sample_cnt++;
-					meter->sample_low = 0;
+					h->sample_cnt++;
+					h->sample_low = 0;
 				}
 			break;
 			
+			/* waiting for the first control byte or unknown frame */
 			default:
+				stats_inc(&meter->stats.resync);
 			break;
 		}
 	}
 }
 
+void vameter_process_ts(struct VAmeter *meter, uint8_t *buf, uint32_t buf_len,
+                        uint64_t t)
+{
+	struct vameter_event *events = meter->events;
+
+	/* called from a callback of vameter_process_events() */
+	meter->events = NULL;
+	process(meter, buf, buf_len, t);
+	meter->events = events;
+}
+
+uint32_t vameter_process_events(struct VAmeter *meter, const uint8_t *buf,
+                                uint32_t buf_len, uint64_t t,
+                                struct vameter_event *ev)
+{
+	struct vameter_event *events = meter->events;
+	uint32_t nevents = meter->nevents, ret;
+
+	meter->events  = ev;
+	meter->nevents = 0;
+
+	process(meter, buf, buf_len, t);
+
+	ret = meter->nevents;
+
+	meter->events  = events;
+	meter->nevents = nevents;
+
+	return ret;
+}
+
+size_t vameter_sync(const uint8_t *buf, size_t len, size_t pos)
+{
+	while (pos < len && !(buf[pos] & CONTROL_CMD))
+		pos++;
+
+	return pos;
+}
+
+void vameter_seed_init(struct vameter_seed *seed)
+{
+	unsigned int i;
+
+	for (i = 0; i < VAMETER_SEED_FRAMES; i++)
+		seed->frame[i] = SIZE_MAX;
+}
+
+static int seed_kind(uint8_t cmd)
+{
+	switch (cmd) {
+	case V_RANGE:
+		return 0;
+	case A_RANGE_2A:
+	case A_RANGE_600mA:
+		return 1;
+	case V_ZERO_REF:
+		return 2;
+	case V_REF:
+		return 3;
+	case A_ZERO_REF:
+		return 4;
+	case A_REF:
+		return 5;
+	}
+
+	return -1;
+}
+
+void vameter_seed_scan(struct vameter_seed *seed, const uint8_t *buf,
+                       size_t from, size_t pos)
+{
+	unsigned int found = 0;
+	int kind;
+
+	while (pos > from && found != (1u << VAMETER_SEED_FRAMES) - 1) {
+		kind = seed_kind(buf[--pos]);
+
+		if (kind < 0 || (found & (1u << kind)))
+			continue;
+
+		found |= 1u << kind;
+		seed->frame[kind] = pos;
+	}
+}
+
+/*
+ * The parser takes uint32_t length, captures may be larger.
+ */
+#define SEED_PIECE (1u << 30)
+
+static void seed_feed(struct VAmeter *meter, const uint8_t *buf,
+                      size_t from, size_t to)
+{
+	uint32_t char_ns = meter->hot->char_ns;
+	size_t len;
+
+	while (from < to) {
+		len = to - from > SEED_PIECE ? SEED_PIECE : to - from;
+
+		vameter_process_ts(meter, (uint8_t*)buf + from, len,
+		                   (uint64_t)(from + len - 1) * char_ns);
+
+		from += len;
+	}
+}
+
+void vameter_seed_run(struct VAmeter *meter, const uint8_t *buf, size_t pos,
+                      const struct vameter_seed *seed)
+{
+	size_t start = pos, frames[VAMETER_SEED_FRAMES], tmp;
+	unsigned int i, j, n = 0;
+
+	/* frame that is completed by the control byte at pos */
+	while (start > 0 && !(buf[--start] & CONTROL_CMD));
+
+	for (i = 0; i < VAMETER_SEED_FRAMES; i++) {
+		if (seed->frame[i] < start)
+			frames[n++] = seed->frame[i];
+	}
+
+	/* in file order, the ranges are reported as they change */
+	for (i = 1; i < n; i++) {
+		for (j = i; j > 0 && frames[j - 1] > frames[j]; j--) {
+			tmp           = frames[j];
+			frames[j]     = frames[j - 1];
+			frames[j - 1] = tmp;
+		}
+	}
+
+	/* each frame is ended by the control byte of the next one */
+	for (i = 0; i < n; i++)
+		seed_feed(meter, buf, frames[i], vameter_sync(buf, start, frames[i] + 1));
+
+	seed_feed(meter, buf, start, pos);
+}
+
+void vameter_get_stats(struct VAmeter *meter, struct vameter_stats *stats)
+{
+	stats_snapshot(stats, &meter->stats, sizeof(*stats));
+}
+
+uint64_t vameter_errors(const struct vameter_stats *stats)
+{
+	return stats->unknown + stats->invalid_range + stats->truncated;
+}
+
+void vameter_process(struct VAmeter *meter, uint8_t *buf, uint32_t buf_len)
+{
+	vameter_process_ts(meter, buf, buf_len, libserial_time());
+}
+
 void vameter_read_blocked(struct VAmeter *meter, bool blocked)
 {
 	long flags;
@@ -369,8 +1170,9 @@ int vameter_read(struct VAmeter *meter)
 {
 	uint8_t buf[512];
 	int32_t len;
+	uint64_t t;
 	
-	len = read(meter->port->fd, &buf, 512);
+	len = libserial_read(meter->port, buf, 512, &t);
 
 	/* end of file */
 	if (len == 0)
@@ -380,11 +1182,13 @@ int vameter_read(struct VAmeter *meter)
 		if (errno == EAGAIN)
 			return 1;
 
-		printf("ERROR: %s read: %s\n", meter->port->dev, strerror(errno));
 		return len;
 	}
 
-	vameter_process(meter, buf, len);
+	vameter_process_ts(meter, buf, len, t);
+
+	if (meter->energy != NULL)
+		energy_poll(meter->energy);
 
 	return 1;
 }
@@ -441,3 +1245,203 @@ void vameter_unload_callib(struct VAmeter *meter)
 	for (i = 0; i < 4; i++)
 		meter->current_callib[i] = 1;
 }
+
+int vameter_energy_start(struct VAmeter *meter, const char *checkpoint,
+                         unsigned int period)
+{
+	vameter_energy_stop(meter);
+
+	meter->energy = energy_create(checkpoint, period);
+
+	return meter->energy == NULL ? -1 : 0;
+}
+
+void vameter_energy_stop(struct VAmeter *meter)
+{
+	energy_destroy(meter->energy);
+	meter->energy = NULL;
+}
+
+int vameter_export(struct VAmeter *meter, struct exporter *exp)
+{
+	exporter_vameter_destroy(meter->exporter);
+	meter->exporter = NULL;
+
+	if (exp == NULL)
+		return 0;
+
+	meter->exporter = exporter_vameter_create(exp, meter->port->dev);
+
+	if (meter->exporter == NULL)
+		return -1;
+
+	exporter_vameter_errors(meter->exporter, vameter_errors(&meter->stats));
+
+	return 0;
+}
+
+int vameter_publish(struct VAmeter *meter, const char *name, uint32_t slots)
+{
+	shmring_destroy(meter->ring);
+	meter->ring = NULL;
+
+	if (name == NULL)
+		return 0;
+
+	meter->ring = shmring_create(name, SHMRING_VAMETER,
+	                             sizeof(struct vameter_record), slots);
+
+	return meter->ring == NULL ? -1 : 0;
+}
+
+void vameter_set_spectrum(struct VAmeter *meter, struct spectrum *voltage,
+                          struct spectrum *current)
+{
+	meter->hot->voltage_spectrum = voltage;
+	meter->hot->current_spectrum = current;
+}
+
+static void settle_set(struct vameter_settle *settle, float tolerance,
+                       float floor, uint8_t hold)
+{
+	settle->tolerance = tolerance;
+	settle->floor     = floor;
+	settle->hold      = hold;
+	settle_reset(settle);
+}
+
+void vameter_voltage_settle(struct VAmeter *meter, float tolerance,
+                            float floor, uint8_t hold)
+{
+	settle_set(&meter->voltage_settle, tolerance, floor, hold);
+}
+
+void vameter_current_settle(struct VAmeter *meter, float tolerance,
+                            float floor, uint8_t hold)
+{
+	settle_set(&meter->current_settle, tolerance, floor, hold);
+}
+
+void vameter_settle_restart(struct VAmeter *meter)
+{
+	settle_reset(&meter->voltage_settle);
+	settle_reset(&meter->current_settle);
+}
+
+/*
+ * Reference cache file consists of single line:
+ *
+ * V-range V-zero V-ref hw-switch A-range A-zero A-ref known-mask
+ */
+int vameter_load_refs(struct VAmeter *meter, const char *file)
+{
+	FILE *f;
+	unsigned int vrange, hw_switch, arange, known;
+	float vzero, vref, azero, aref;
+	int ret;
+
+	f = fopen(file, "r");
+
+	if (f == NULL)
+		return -1;
+
+	ret = fscanf(f, "%u %f %f %u %u %f %f %u", &vrange, &vzero, &vref,
+	             &hw_switch, &arange, &azero, &aref, &known);
+
+	fclose(f);
+
+	if (ret != 8 || vrange > V_RANGE_MAX - V_RANGE_MIN ||
+	    arange > A_RANGE_MAX - A_RANGE_MIN || hw_switch > 1)
+		return -2;
+
+	known &= REF_V_ALL | REF_A_ALL;
+
+	/* don't overwrite references received from the device */
+	known &= ~meter->hot->ref_fresh;
+
+	if (known & REF_V_RANGE)
+		meter->hot->cur_voltage_range = vrange;
+
+	if (known & REF_V_ZERO)
+		meter->hot->voltage_zero = vzero;
+
+	if (known & REF_V)
+		meter->hot->voltage_ref = vref;
+
+	if (known & REF_A_RANGE) {
+		meter->hot->hw_switch = hw_switch;
+		meter->hot->cur_current_range = arange;
+	}
+
+	if (known & REF_A_ZERO)
+		meter->hot->current_zero = azero;
+
+	if (known & REF_A)
+		meter->hot->current_ref = aref;
+
+	meter->hot->ref_known |= known;
+
+	return 0;
+}
+
+/*
+ * Creates parent directory of the file if needed.
+ */
+static void mkdir_parent(const char *file)
+{
+	char *dir = strdup(file);
+	char *slash;
+
+	if (dir == NULL)
+		return;
+
+	slash = strrchr(dir, '/');
+
+	if (slash != NULL && slash != dir) {
+		*slash = '\0';
+		mkdir(dir, 0755);
+	}
+
+	free(dir);
+}
+
+int vameter_save_refs(struct VAmeter *meter, const char *file)
+{
+	FILE *f;
+
+	mkdir_parent(file);
+
+	f = fopen(file, "w");
+
+	if (f == NULL)
+		return -1;
+
+	fprintf(f, "%u %.9g %.9g %u %u %.9g %.9g %u\n",
+	        meter->hot->ref_known & REF_V_RANGE ? meter->hot->cur_voltage_range : 0,
+	        meter->hot->voltage_zero, meter->hot->voltage_ref,
+	        meter->hot->ref_known & REF_A_RANGE ? meter->hot->hw_switch : 0,
+	        meter->hot->ref_known & REF_A_RANGE ? meter->hot->cur_current_range : 0,
+	        meter->hot->current_zero, meter->hot->current_ref, meter->hot->ref_known);
+
+	if (fclose(f))
+		return -1;
+
+	return 0;
+}
+
+int vameter_ref_cache(struct VAmeter *meter, const char *file)
+{
+	char *path = NULL;
+
+	if (file != NULL) {
+		path = strdup(file);
+
+		if (path == NULL)
+			return -1;
+	}
+
+	free(meter->ref_cache);
+	meter->ref_cache = path;
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Listener dispatch shared by the instrument libraries, the instrument
+ * structure has listeners and walks pointers, the listener has ops, ctx and
+ * next.
+ */
+
+#ifndef __LISTENERS_H__
+#define __LISTENERS_H__
+
+#include <stddef.h>
+
+/*
+ * One dispatch in progress, kept on the stack of CALL_OPS. Dispatches nest
+ * when a callback sends a command that completes right away, so the
+ * instrument keeps a list of them.
+ */
+struct listener_walk {
+	/* next listener to call */
+	void *next;
+	struct listener_walk *up;
+};
+
+/*
+ * Calls op of all listeners. Any listener may be detached from the callback,
+ * including the one that is called and the one after it, unlisten moves the
+ * next pointer of all dispatches in progress on.
+ */
+#define CALL_OPS(self, op, ...) do {                                  \
+	struct listener_walk w_ = {NULL, (self)->walks};              \
+	__typeof__((self)->listeners) l_;                             \
+	(self)->walks = &w_;                                          \
+	for (l_ = (self)->listeners; l_ != NULL; l_ = w_.next) {      \
+		w_.next = l_->next;                                   \
+		if (l_->ops->op != NULL)                              \
+			l_->ops->op(self, l_->ctx, __VA_ARGS__);      \
+	}                                                             \
+	(self)->walks = w_.up;                                        \
+} while (0)
+
+/*
+ * Called by unlisten, skips the listener in dispatches that call it next.
+ */
+#define UNLISTEN_OPS(self, listener) do {                             \
+	struct listener_walk *w_;                                     \
+	for (w_ = (self)->walks; w_ != NULL; w_ = w_->up) {           \
+		if (w_->next == (void*)(listener))                    \
+			w_->next = (listener)->next;                  \
+	}                                                             \
+} while (0)
+
+#endif /* __LISTENERS_H__ */
@@ -0,0 +1,167 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "libsweep.h"
+
+static int state_loaded = 0;
+
+static void update(struct generator *generator)
+{
+	(void) generator;
+	state_loaded = 1;
+}
+
+static char *help =
+	"Usage: %s -g /dev/generator -m /dev/vameter -s start -e stop\n\n"
+	" -n number of points (logarithmic spacing)\n"
+	" -r reference voltage for gain, default is maximum\n"
+	" -t settling tolerance (relative)\n"
+	" -c VAmeter callibration file\n"
+	" -h prints this help\n";
+
+static void print_help(const char *name, int ret)
+{
+	fprintf(stderr, help, name);
+	exit(ret);
+}
+
+int main(int argc, char *argv[])
+{
+	struct generator *generator;
+	struct VAmeter *meter;
+	struct sweep sweep;
+	struct pollfd pfd;
+	char *gdev = NULL, *mdev = NULL, *callib = NULL;
+	float start = 0, stop = 0, ref = 0, tol = 0;
+	float *freqs;
+	int opt, cnt = 20, ret;
+
+	while ((opt = getopt(argc, argv, "c:e:g:hm:n:r:s:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			callib = optarg;
+		break;
+		case 'e':
+			stop = atof(optarg);
+		break;
+		case 'g':
+			gdev = optarg;
+		break;
+		case 'h':
+			print_help(argv[0], 0);
+		break;
+		case 'm':
+			mdev = optarg;
+		break;
+		case 'n':
+			cnt = atoi(optarg);
+		break;
+		case 'r':
+			ref = atof(optarg);
+		break;
+		case 's':
+			start = atof(optarg);
+		break;
+		case 't':
+			tol = atof(optarg);
+		break;
+		default:
+			print_help(argv[0], 1);
+		}
+	}
+
+	if (gdev == NULL || mdev == NULL || start <= 0 || stop <= 0 || cnt < 1)
+		print_help(argv[0], 1);
+
+	freqs = malloc(cnt * sizeof(float));
+
+	if (freqs == NULL)
+		return 1;
+
+	sweep_log_freqs(freqs, cnt, start, stop);
+
+	meter = vameter_init(mdev);
+
+	if (meter == NULL) {
+		fprintf(stderr, "%s: %s\n", mdev, strerror(errno));
+		return 1;
+	}
+
+	evlog_sink(&meter->port->log, evlog_stderr, NULL);
+
+	if (callib != NULL && vameter_load_callib(meter, callib))
+		fprintf(stderr, "Cannot load callibration: %s\n", callib);
+
+	generator = generator_create(gdev, update);
+
+	if (generator == NULL) {
+		fprintf(stderr, "failed to initalize generator: %s\n", strerror(errno));
+		vameter_exit(meter);
+		return 1;
+	}
+
+	evlog_sink(&generator->port->log, evlog_stderr, NULL);
+
+	/* we need to know the output wave */
+	generator_load_state(generator);
+
+	pfd.fd = generator->port->fd;
+	pfd.events = POLLIN;
+
+	while (!state_loaded) {
+		if (poll(&pfd, 1, 2000) <= 0) {
+			fprintf(stderr, "generator doesn't respond\n");
+			ret = 1;
+			goto exit;
+		}
+		generator_read(generator);
+	}
+
+	if (sweep_init(&sweep, generator, meter, freqs, cnt)) {
+		ret = 1;
+		goto exit;
+	}
+
+	sweep.ref = ref;
+
+	if (tol > 0)
+		sweep.tolerance = tol;
+
+	ret = sweep_run(&sweep, 1000 * 60 * 60) ? 1 : 0;
+
+	if (ret)
+		fprintf(stderr, "sweep was not finished\n");
+
+	sweep_write_table(&sweep, stdout);
+	sweep_free(&sweep);
+exit:
+	generator_destroy(generator);
+	vameter_exit(meter);
+	free(freqs);
+	return ret;
+}
@@ -48,9 +48,10 @@ static void sighandler(int signum)
 int main(int argc, char *argv[])
 {
 	struct counter *counter;
+	struct exporter *exp = NULL;
 	
-	if (argc != 2) {
-		printf("usage: ./counter /dev/serial\n");
+	if (argc != 2 && argc != 3) {
+		printf("usage: ./counter /dev/serial [exporter port or socket]\n");
 		return 1;
 	}
 
@@ -61,14 +62,32 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	evlog_sink(&counter->port->log, evlog_stderr, NULL);
+
+	if (argc == 3) {
+		exp = exporter_create(argv[2]);
+
+		if (exp == NULL || counter_export(counter, exp)) {
+			printf("failed to export to %s: %s\n", argv[2], strerror(errno));
+			exporter_destroy(exp);
+			counter_destroy(counter);
+			return 1;
+		}
+	}
+
 	signal(SIGINT, sighandler);
 
 	counter_trigger(counter, 10);
 
-	while (ready)
+	while (ready) {
+		if (exp != NULL && !exporter_wait(exp, counter->port->fd))
+			continue;
+
 		counter_read(counter);
+	}
 
 	counter_destroy(counter);
+	exporter_destroy(exp);
 
 	return 0;
 }
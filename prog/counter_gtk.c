@@ -33,6 +33,40 @@ static char dev[128] = "/dev/ttyUSB0";
 static GtkWidget *freq_label;
 static GtkWidget *range_label;
 
+static int wr_tag;
+
+/*
+ * Called when the port is writable while commands are queued.
+ */
+static void write_callback(gpointer data __attribute__((unused)),
+                           gint source __attribute__((unused)),
+                           GdkInputCondition condition __attribute__((unused)));
+
+/*
+ * Commands that could not be written without blocking stay queued, the
+ * port is watched for writing until the queue is drained.
+ */
+static void watch_write(void)
+{
+	int pending = counter != NULL && libserial_pending(counter->port);
+
+	if (pending && !wr_tag)
+		wr_tag = gdk_input_add(counter->port->wfd, GDK_INPUT_WRITE, write_callback, NULL);
+
+	if (!pending && wr_tag) {
+		gdk_input_remove(wr_tag);
+		wr_tag = 0;
+	}
+}
+
+static void write_callback(gpointer data __attribute__((unused)),
+                           gint source __attribute__((unused)),
+                           GdkInputCondition condition __attribute__((unused)))
+{
+	libserial_flush(counter->port);
+	watch_write();
+}
+
 static void destroy(GtkWidget *widget, gpointer data)
 {
 	counter_destroy(counter);
@@ -85,6 +119,7 @@ static void counter_callback(gpointer data __attribute__((unused)),
                              GdkInputCondition condition __attribute__((unused)))
 {
 	counter_read(counter);
+	watch_write();
 }
 
 static void connect(GtkWidget *widget, gpointer data)
@@ -100,6 +135,7 @@ static void disconnect(GtkWidget *widget, gpointer data)
 	gdk_input_remove(fd_tag);
 	counter_destroy(counter);
 	counter = NULL;
+	watch_write();
 	gtk_label_set_text(GTK_LABEL(freq_label), "--- Mhz");
 }
 
@@ -144,6 +180,7 @@ static void radio_button_callback_1(GtkWidget *widget,
 		return;
 
 	counter_mode(counter, COUNTER_05SEC_PERIOD);
+	watch_write();
 }
 
 static void radio_button_callback_2(GtkWidget *widget,
@@ -156,6 +193,7 @@ static void radio_button_callback_2(GtkWidget *widget,
 		return;
 
 	counter_mode(counter, COUNTER_05SEC);
+	watch_write();
 }
 
 static void radio_button_callback_3(GtkWidget *widget,
@@ -168,14 +206,17 @@ static void radio_button_callback_3(GtkWidget *widget,
 		return;
 
 	counter_mode(counter, COUNTER_5SEC);
+	watch_write();
 }
 
 static void slider_callback(GtkRange *range, gpointer *priv)
 {
 	int val = gtk_range_get_value(range);
 	
-	if (counter != NULL)
+	if (counter != NULL) {
 		counter_trigger(counter, val);
+		watch_write();
+	}
 }
 
 static GtkWidget *create_counter(void)
@@ -0,0 +1,164 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "libfreqlock.h"
+
+static int state_loaded = 0;
+
+static void update(struct generator *generator)
+{
+	(void) generator;
+	state_loaded = 1;
+}
+
+static void measure(float val)
+{
+	(void) val;
+}
+
+static void range(unsigned char range)
+{
+	(void) range;
+}
+
+static char *help =
+	"Usage: %s -c /dev/counter -g /dev/generator -f freq\n\n"
+	" -b loop gain (0 - 1]\n"
+	" -p lock window in ppm\n"
+	" -t timeout in seconds\n"
+	" -h prints this help\n";
+
+static void print_help(const char *name, int ret)
+{
+	fprintf(stderr, help, name);
+	exit(ret);
+}
+
+int main(int argc, char *argv[])
+{
+	struct counter *counter;
+	struct generator *generator;
+	struct freqlock lock;
+	struct pollfd pfd;
+	char *cdev = NULL, *gdev = NULL;
+	float freq = 0, gain = 0, ppm = 0;
+	int opt, timeout = 120, ret;
+
+	while ((opt = getopt(argc, argv, "b:c:f:g:hp:t:")) != -1) {
+		switch (opt) {
+		case 'b':
+			gain = atof(optarg);
+		break;
+		case 'c':
+			cdev = optarg;
+		break;
+		case 'f':
+			freq = atof(optarg);
+		break;
+		case 'g':
+			gdev = optarg;
+		break;
+		case 'h':
+			print_help(argv[0], 0);
+		break;
+		case 'p':
+			ppm = atof(optarg);
+		break;
+		case 't':
+			timeout = atoi(optarg);
+		break;
+		default:
+			print_help(argv[0], 1);
+		}
+	}
+
+	if (cdev == NULL || gdev == NULL || freq <= 0)
+		print_help(argv[0], 1);
+
+	counter = counter_create(cdev, measure, range);
+
+	if (counter == NULL) {
+		fprintf(stderr, "failed to initalize counter: %s\n", strerror(errno));
+		return 1;
+	}
+
+	evlog_sink(&counter->port->log, evlog_stderr, NULL);
+
+	generator = generator_create(gdev, update);
+
+	if (generator == NULL) {
+		fprintf(stderr, "failed to initalize generator: %s\n", strerror(errno));
+		counter_destroy(counter);
+		return 1;
+	}
+
+	evlog_sink(&generator->port->log, evlog_stderr, NULL);
+
+	/* we need to know the output wave */
+	generator_load_state(generator);
+
+	pfd.fd = generator->port->fd;
+	pfd.events = POLLIN;
+
+	while (!state_loaded) {
+		if (poll(&pfd, 1, 2000) <= 0) {
+			fprintf(stderr, "generator doesn't respond\n");
+			ret = 1;
+			goto exit;
+		}
+		generator_read(generator);
+	}
+
+	freqlock_init(&lock, counter, generator, freq);
+
+	if (gain > 0)
+		lock.gain = gain;
+
+	if (ppm > 0)
+		lock.lock_ppm = ppm;
+
+	if (freqlock_start(&lock)) {
+		fprintf(stderr, "cannot set frequency for %s\n",
+		        generator_wave_names[generator->wave]);
+		ret = 1;
+		goto exit;
+	}
+
+	ret = freqlock_run(&lock, 1000 * timeout);
+
+	printf("%s after %u steps\n", ret ? "Not locked" : "Locked", lock.steps);
+	printf("Lock time:      %.1f s\n", ret ? 0 : lock.lock_time);
+	printf("Frequency:      %.3f Hz\n", lock.freq);
+	printf("Residual error: %.2f ppm\n", lock.error_ppm);
+
+	ret = ret ? 1 : 0;
+exit:
+	generator_destroy(generator);
+	counter_destroy(counter);
+	return ret;
+}
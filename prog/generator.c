@@ -69,6 +69,10 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	/* print all protocol events */
+	evlog_sink(&generator->port->log, evlog_stderr, NULL);
+	generator->port->log.level = EVLOG_DEBUG;
+
 	signal(SIGINT, sighandler);
 
 	generator_load_state(generator);
@@ -37,6 +37,40 @@ static GtkWidget *filters[4];
 static GtkWidget *waves[8];
 static GtkWidget *memory[8];
 
+static int wr_tag;
+
+/*
+ * Called when the port is writable while commands are queued.
+ */
+static void write_callback(gpointer data __attribute__((unused)),
+                           gint source __attribute__((unused)),
+                           GdkInputCondition condition __attribute__((unused)));
+
+/*
+ * Commands that could not be written without blocking stay queued, the
+ * port is watched for writing until the queue is drained.
+ */
+static void watch_write(void)
+{
+	int pending = generator != NULL && libserial_pending(generator->port);
+
+	if (pending && !wr_tag)
+		wr_tag = gdk_input_add(generator->port->wfd, GDK_INPUT_WRITE, write_callback, NULL);
+
+	if (!pending && wr_tag) {
+		gdk_input_remove(wr_tag);
+		wr_tag = 0;
+	}
+}
+
+static void write_callback(gpointer data __attribute__((unused)),
+                           gint source __attribute__((unused)),
+                           GdkInputCondition condition __attribute__((unused)))
+{
+	libserial_flush(generator->port);
+	watch_write();
+}
+
 static void destroy(GtkWidget *widget, gpointer data)
 {
 	generator_destroy(generator);
@@ -110,6 +144,7 @@ static void generator_callback(gpointer data __attribute__((unused)),
                                GdkInputCondition condition __attribute__((unused)))
 {
 	generator_read(generator);
+	watch_write();
 }
 
 static void connect(GtkWidget *widget, gpointer data)
@@ -119,6 +154,7 @@ static void connect(GtkWidget *widget, gpointer data)
 	if (generator != NULL) {
 		fd_tag = gdk_input_add(generator->port->fd, GDK_INPUT_READ, generator_callback, NULL);
 		generator_load_state(generator);
+		watch_write();
 		return;
 	}
 
@@ -135,6 +171,7 @@ static void disconnect(GtkWidget *widget, gpointer data)
 	gdk_input_remove(fd_tag);
 	generator_destroy(generator);
 	generator = NULL;
+	watch_write();
 }
 
 static GtkItemFactoryEntry menu_items[] = {
@@ -215,6 +252,7 @@ static void wave_radio_button_callback(GtkWidget *widget,
 
 	generator_set_wave(generator, wave);
 	generator_load_state(generator);
+	watch_write();
 }
 
 static void filter_radio_button_callback(GtkWidget *widget,
@@ -231,6 +269,7 @@ static void filter_radio_button_callback(GtkWidget *widget,
 	printf("Setting filter\n");
 	generator_set_filter(generator, filter);
 	generator_load_state(generator);
+	watch_write();
 }
 
 static void memory_radio_button_callback(GtkWidget *widget,
@@ -248,6 +287,7 @@ static void memory_radio_button_callback(GtkWidget *widget,
 
 	generator_load(generator, mem);
 	generator_load_state(generator);
+	watch_write();
 }
 
 static void amplitude_slider_callback(GtkRange *range,
@@ -262,6 +302,7 @@ static void amplitude_slider_callback(GtkRange *range,
 
 	generator_set_amplitude(generator, (255 * val / 4.81));
 	generator_load_state(generator);
+	watch_write();
 }
 
 static void offset_slider_callback(GtkRange *range,
@@ -276,6 +317,7 @@ static void offset_slider_callback(GtkRange *range,
 
 	generator_set_offset(generator, (-255 * val / 4.81));
 	generator_load_state(generator);
+	watch_write();
 }
 
 static void freq_entry_callback(GtkWidget *widget, GtkEntry *entry)
@@ -289,6 +331,7 @@ static void freq_entry_callback(GtkWidget *widget, GtkEntry *entry)
 
 	generator_set_freq_float(generator, atoi(val));
 	generator_load_state(generator);
+	watch_write();
 }
 
 static GtkWidget *create_generator(void)
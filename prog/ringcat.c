@@ -0,0 +1,99 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "libvameter.h"
+#include "libcounter.h"
+#include "libshmring.h"
+
+static int ready = 1;
+
+static void sighandler(int signum)
+{
+	(void) signum;
+	ready = 0;
+}
+
+static void print_vameter(const struct vameter_record *rec)
+{
+	printf("%.6f %c %c%f %u %u\n", rec->s.t / 1000000000.0, rec->chan,
+	       rec->s.acdc, rec->s.rms, rec->s.range, rec->s.flags);
+}
+
+static void print_counter(const struct counter_sample *s)
+{
+	printf("%.6f F %.3f %c\n", s->t / 1000000000.0, s->val, s->range);
+}
+
+int main(int argc, char *argv[])
+{
+	struct shmring *ring;
+	union {
+		struct vameter_record vameter;
+		struct counter_sample counter;
+	} rec;
+
+	if (argc != 2) {
+		printf("usage: ./ringcat /name\n");
+		return 1;
+	}
+
+	ring = shmring_attach(argv[1], 0);
+
+	if (ring == NULL) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	if (ring->hdr->kind != SHMRING_VAMETER && ring->hdr->kind != SHMRING_COUNTER) {
+		fprintf(stderr, "%s: unknown record kind %u\n", argv[1], ring->hdr->kind);
+		shmring_detach(ring);
+		return 1;
+	}
+
+	signal(SIGINT, sighandler);
+
+	/* the writer never signals, poll the ring */
+	while (ready) {
+		if (!shmring_read(ring, &rec)) {
+			fflush(stdout);
+			usleep(10000);
+			continue;
+		}
+
+		if (ring->hdr->kind == SHMRING_VAMETER)
+			print_vameter(&rec.vameter);
+		else
+			print_counter(&rec.counter);
+	}
+
+	fprintf(stderr, "lost %llu\n", (unsigned long long)ring->lost);
+
+	shmring_detach(ring);
+
+	return 0;
+}
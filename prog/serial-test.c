@@ -19,16 +19,142 @@
  *                                                                            *
  ******************************************************************************/
 
+/*
+ * Opens /dev/ttyS0 for a while. With -l checks the adapter latency timer
+ * setup on a pty against a fake sysfs tree instead.
+ */
+
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include "libserial.h"
 
+static int write_file(const char *path, const char *str)
+{
+	FILE *f = fopen(path, "w");
+
+	if (f == NULL)
+		return -1;
+
+	fputs(str, f);
+
+	return fclose(f);
+}
+
+static int read_file(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	int val;
+
+	if (f == NULL)
+		return -1;
+
+	if (fscanf(f, "%i", &val) != 1)
+		val = -1;
+
+	fclose(f);
+
+	return val;
+}
+
+/*
+ * Creates ROOT/dev/char/MAJ:MIN/device/latency_timer for a pty, set to the
+ * 16 ms FTDI default, and checks that libserial_open() lowers it.
+ */
+static int latency_check(void)
+{
+	char root[] = "/tmp/serial-test.XXXXXX";
+	char path[512], dev[64];
+	struct libserial_port *port;
+	struct stat st;
+	int master, ret = 1, val = -1;
+	size_t len;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (master < 0 || grantpt(master) || unlockpt(master) ||
+	    ptsname_r(master, dev, sizeof(dev)) || stat(dev, &st)) {
+		printf("Failed to create pty, %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (mkdtemp(root) == NULL) {
+		printf("Failed to create %s, %s\n", root, strerror(errno));
+		close(master);
+		return 1;
+	}
+
+	snprintf(path, sizeof(path), "%s/dev", root);
+	mkdir(path, 0755);
+	len = strlen(path);
+	snprintf(path + len, sizeof(path) - len, "/char");
+	mkdir(path, 0755);
+	len = strlen(path);
+	snprintf(path + len, sizeof(path) - len, "/%u:%u",
+	         major(st.st_rdev), minor(st.st_rdev));
+	mkdir(path, 0755);
+	len = strlen(path);
+	snprintf(path + len, sizeof(path) - len, "/device");
+	mkdir(path, 0755);
+	len = strlen(path);
+	snprintf(path + len, sizeof(path) - len, "/latency_timer");
+
+	if (write_file(path, "16\n")) {
+		printf("Failed to write %s, %s\n", path, strerror(errno));
+		goto cleanup;
+	}
+
+	libserial_sysfs_root(root);
+
+	port = libserial_open(dev, B19200);
+
+	if (port == NULL) {
+		printf("Failed to open %s, %s\n", dev, strerror(errno));
+		goto cleanup;
+	}
+
+	val = read_file(path);
+
+	printf("latency_timer file %i, read back %i\n", val, port->latency_timer);
+
+	if (val == 1 && port->latency_timer == 1)
+		ret = 0;
+
+	libserial_close(port);
+cleanup:
+	unlink(path);
+
+	/* remove the directories bottom up */
+	while ((len = strlen(path)) > strlen(root)) {
+		*strrchr(path, '/') = '\0';
+		rmdir(path);
+	}
+
+	rmdir(root);
+
+	libserial_sysfs_root("/sys");
+	close(master);
+
+	printf("%s\n", ret ? "FAIL" : "OK");
+
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
-	struct libserial_port *port = libserial_open("/dev/ttyS0", B9600);
+	struct libserial_port *port;
+
+	if (argc > 1 && !strcmp(argv[1], "-l"))
+		return latency_check();
+
+	port = libserial_open("/dev/ttyS0", B9600);
 
 	if (port == NULL) {
 		printf("Failed to initalize serial port, %s\n", strerror(errno));
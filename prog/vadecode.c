@@ -0,0 +1,129 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "libdecode.h"
+
+static const char chan_names[] = {'V', 'A', 'F'};
+
+static void record(struct decode *self, const struct decode_record *rec)
+{
+	FILE *f = self->priv;
+
+	if (rec->chan == DECODE_FREQ) {
+		fprintf(f, "%.6f F %.3f %c\n", rec->t / 1000000000.0, rec->val,
+		        rec->range);
+		return;
+	}
+
+	fprintf(f, "%.6f %c %c%f %u %u\n", rec->t / 1000000000.0,
+	        chan_names[rec->chan], rec->acdc, rec->val, rec->range,
+	        rec->flags);
+}
+
+static char *help =
+	"Usage: %s [-c] [-t threads] [-s chunk_kb] [-C callibration.cal] capture\n\n"
+	"Decodes raw VAmeter or counter capture in parallel, prints one line per\n"
+	"frame: time, channel, value, range and flags.\n\n"
+	" -c capture is from the counter\n"
+	" -t number of threads, default is one per CPU\n"
+	" -s chunk size in kB, default 4096\n"
+	" -C VAmeter callibration file\n"
+	" -v print summary to stderr\n"
+	" -h prints this help\n";
+
+static void print_help(const char *name, int ret)
+{
+	fprintf(stderr, help, name);
+
+	exit(ret);
+}
+
+int main(int argc, char *argv[])
+{
+	struct decode dec;
+	struct timespec start, end;
+	enum decode_type type = DECODE_VAMETER;
+	const char *callib = NULL;
+	unsigned int threads = 0;
+	size_t chunk = 0;
+	int opt, verbose = 0;
+
+	while ((opt = getopt(argc, argv, "cC:hs:t:v")) != -1) {
+		switch (opt) {
+			case 'c':
+				type = DECODE_COUNTER;
+			break;
+			case 'C':
+				callib = optarg;
+			break;
+			case 's':
+				chunk = atol(optarg) * 1024;
+			break;
+			case 't':
+				threads = atoi(optarg);
+			break;
+			case 'v':
+				verbose = 1;
+			break;
+			case 'h':
+				print_help(argv[0], 0);
+			break;
+			default:
+				print_help(argv[0], 1);
+		}
+	}
+
+	if (optind + 1 != argc)
+		print_help(argv[0], 1);
+
+	decode_init(&dec, type, record, stdout);
+
+	dec.threads = threads;
+	dec.callib  = callib;
+
+	if (chunk)
+		dec.chunk_size = chunk;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (decode_file(&dec, argv[optind])) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (verbose) {
+		fprintf(stderr, "%u chunks %llu records in %.3fs\n", dec.chunks,
+		        (unsigned long long)dec.records,
+		        end.tv_sec - start.tv_sec +
+		        (end.tv_nsec - start.tv_nsec) / 1000000000.0);
+	}
+
+	return 0;
+}
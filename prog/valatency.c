@@ -0,0 +1,503 @@
+/******************************************************************************
+ * This file is part of usb-instruments.                                      *
+ *                                                                            *
+ * Usb-instruments is free software; you can redistribute it and/or modify    *
+ * it under the terms of the GNU General Public License as published by       *
+ * the Free Software Foundation; either version 2 of the License, or          *
+ * (at your option) any later version.                                        *
+ *                                                                            *
+ * Usb-instruments is distributed in the hope that it will be useful,         *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of             *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the              *
+ * GNU General Public License for more details.                               *
+ *                                                                            *
+ * You should have received a copy of the GNU General Public License          *
+ * along with usb-instruments; if not, write to the Free Software             *
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA *
+ *                                                                            *
+ * Copyright (C) 2011 Cyril Hrubis <metan@ucw.cz>                             *
+ *                                                                            *
+ ******************************************************************************/
+
+/*
+ * Latency from a VAmeter frame arriving on the port to the consumer.
+ *
+ * The meter is emulated on a pty, a writer thread injects voltage frames at
+ * a fixed period and records when the byte that completes each frame was
+ * written. The meter is read the same way as in vameter, with blocking
+ * reads or through the I/O loop, and every frame is split into stages:
+ *
+ * wakeup   - frame end written to the pty until the read has returned
+ * parse    - read returned until the voltage_sample callback is called
+ * callback - voltage_sample until the consumer (which formats the value
+ *            as the vameter_gtk label does) has finished
+ * total    - frame end written until the consumer has finished
+ *
+ * The gtk_label_set_text() call itself is not done here, vameter_gtk logs
+ * its timing when started with VAMETER_GTK_LABEL_LOG set.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libvameter.h"
+#include "libioloop.h"
+
+#define SAMPLES     32
+#define FRAME_BYTES (2 * SAMPLES + 1)
+
+enum mode {
+	MODE_READ,
+	MODE_POLL,
+	MODE_URING,
+};
+
+static const char *mode_names[] = {"read", "poll", "uring"};
+
+enum stage {
+	STAGE_WAKEUP,
+	STAGE_PARSE,
+	STAGE_CALLBACK,
+	STAGE_TOTAL,
+	STAGES,
+};
+
+static const char *stage_names[] = {"wakeup", "parse", "callback", "total"};
+
+struct harness {
+	int master;
+	struct VAmeter *meter;
+
+	uint32_t frames;
+	uint64_t period_ns;
+
+	/* per frame timestamps, CLOCK_MONOTONIC ns */
+	uint64_t *inject;
+	uint64_t *wakeup;
+	uint64_t *parsed;
+	uint64_t *done;
+
+	/* frames seen by the consumer */
+	uint32_t seen;
+
+	/* set by writer when frames were lost */
+	int stop;
+
+	/* completion time of the read being parsed */
+	uint64_t t_read;
+
+	char label[20];
+};
+
+static void put_sample(uint8_t *buf, unsigned int val)
+{
+	buf[0] = 0x40 | (val & 0x3f);
+	buf[1] = 0x40 | ((val >> 6) & 0x0f);
+}
+
+static void put_frame(uint8_t *buf, uint8_t cmd, unsigned int val)
+{
+	unsigned int i;
+
+	buf[0] = cmd;
+
+	for (i = 0; i < SAMPLES; i++)
+		put_sample(buf + 1 + 2 * i, val);
+}
+
+static uint32_t frames_seen(struct harness *self)
+{
+	return __atomic_load_n(&self->seen, __ATOMIC_ACQUIRE);
+}
+
+static int running(struct harness *self)
+{
+	return frames_seen(self) < self->frames &&
+	       !__atomic_load_n(&self->stop, __ATOMIC_ACQUIRE);
+}
+
+static void *writer(void *priv)
+{
+	struct harness *self = priv;
+	uint8_t buf[2 + 2 * FRAME_BYTES + 1];
+	struct timespec next;
+	uint32_t i, j;
+
+	/* range and references, the first sample frame is started */
+	buf[0] = 0x8A;
+	buf[1] = 'C';
+	put_frame(buf + 2, 0x9A, 100);
+	put_frame(buf + 2 + FRAME_BYTES, 0x8D, 900);
+	buf[2 + 2 * FRAME_BYTES] = 0x9D;
+
+	if (write(self->master, buf, sizeof(buf)) != sizeof(buf)) {
+		perror("write");
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (i = 0; i < self->frames; i++) {
+		next.tv_nsec += self->period_ns;
+
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		/* samples of frame i, terminated by start of the next one */
+		for (j = 0; j < SAMPLES; j++)
+			put_sample(buf + 2 * j, 100 + (i + j) % 800);
+
+		buf[2 * SAMPLES] = 0x9D;
+
+		__atomic_store_n(&self->inject[i], libserial_time(),
+		                 __ATOMIC_RELEASE);
+
+		if (write(self->master, buf, FRAME_BYTES) != FRAME_BYTES) {
+			perror("write");
+			break;
+		}
+	}
+
+	/* give the reader a second for frames still in flight */
+	for (j = 0; j < 100 && frames_seen(self) < self->frames; j++)
+		usleep(10000);
+
+	/* wakes up a reader blocked on a lost frame */
+	if (frames_seen(self) < self->frames) {
+		__atomic_store_n(&self->stop, 1, __ATOMIC_RELEASE);
+
+		if (write(self->master, "\x81", 1) != 1)
+			perror("write");
+	}
+
+	return NULL;
+}
+
+static void voltage_sample(struct VAmeter *meter, void *ctx,
+                           char acdc, float sample)
+{
+	struct harness *self = ctx;
+
+	(void) meter;
+	(void) acdc;
+	(void) sample;
+
+	if (self->seen < self->frames)
+		self->parsed[self->seen] = libserial_time();
+}
+
+static void voltage_frame(struct VAmeter *meter, void *ctx,
+                          const struct vameter_sample *s)
+{
+	struct harness *self = ctx;
+	float sample = s->rms;
+
+	(void) meter;
+
+	if (self->seen >= self->frames)
+		return;
+
+	/* the work vameter_gtk does before gtk_label_set_text() */
+	self->label[0] = s->acdc;
+
+	if (sample < 1)
+		snprintf(self->label + 1, 19, "%.1fmV", 1000 * sample);
+	else
+		snprintf(self->label + 1, 19, "%.3fV", sample);
+
+	/* s->t is interpolated back to the last sample byte */
+	self->wakeup[self->seen] = self->t_read;
+	self->done[self->seen] = libserial_time();
+
+	__atomic_store_n(&self->seen, self->seen + 1, __ATOMIC_RELEASE);
+}
+
+static const struct vameter_ops ops = {
+	.voltage_sample = voltage_sample,
+	.voltage_frame  = voltage_frame,
+};
+
+static void process(void *inst, const uint8_t *buf, uint32_t len, uint64_t t)
+{
+	struct harness *self = inst;
+
+	self->t_read = t;
+	vameter_process_ts(self->meter, (uint8_t*)buf, len, t);
+}
+
+/* Dtto as vameter_read() */
+static int read_once(struct harness *self)
+{
+	uint8_t buf[IOLOOP_RBUF];
+	int32_t len;
+	uint64_t t;
+
+	len = libserial_read(self->meter->port, buf, sizeof(buf), &t);
+
+	if (len <= 0)
+		return len;
+
+	process(self, buf, len, t);
+
+	return 1;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *sorted, uint32_t n, double p)
+{
+	uint32_t i = p * n;
+
+	if (i >= n)
+		i = n - 1;
+
+	return sorted[i] / 1000.0;
+}
+
+static void report(FILE *f, struct harness *self, enum mode mode,
+                   const char *backend)
+{
+	uint32_t i, s, n = frames_seen(self);
+	uint64_t *lat;
+
+	fprintf(f, "# valatency mode=%s backend=%s frames=%u period=%lluus lost=%u\n",
+	        mode_names[mode], backend, self->frames,
+	        (unsigned long long)self->period_ns / 1000, self->frames - n);
+	fprintf(f, "# build gcc %s%s\n", __VERSION__,
+#ifdef __OPTIMIZE__
+	        " optimized"
+#else
+	        ""
+#endif
+	       );
+
+	if (n == 0)
+		return;
+
+	lat = malloc(n * sizeof(uint64_t));
+
+	if (lat == NULL) {
+		perror("malloc");
+		return;
+	}
+
+	fprintf(f, "%-10s %10s %10s %10s %10s  [us]\n",
+	        "stage", "p50", "p99", "p99.9", "max");
+
+	for (s = 0; s < STAGES; s++) {
+		for (i = 0; i < n; i++) {
+			switch (s) {
+			case STAGE_WAKEUP:
+				lat[i] = self->wakeup[i] - self->inject[i];
+			break;
+			case STAGE_PARSE:
+				lat[i] = self->parsed[i] - self->wakeup[i];
+			break;
+			case STAGE_CALLBACK:
+				lat[i] = self->done[i] - self->parsed[i];
+			break;
+			case STAGE_TOTAL:
+				lat[i] = self->done[i] - self->inject[i];
+			break;
+			}
+		}
+
+		qsort(lat, n, sizeof(uint64_t), cmp_u64);
+
+		fprintf(f, "%-10s %10.3f %10.3f %10.3f %10.3f\n", stage_names[s],
+		        percentile(lat, n, 0.5), percentile(lat, n, 0.99),
+		        percentile(lat, n, 0.999), lat[n - 1] / 1000.0);
+	}
+
+	free(lat);
+}
+
+static int open_pty(char *slave, size_t size)
+{
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (fd < 0)
+		return -1;
+
+	if (grantpt(fd) || unlockpt(fd) || ptsname_r(fd, slave, size)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int run(struct harness *self, struct VAmeter *meter, enum mode mode,
+               const char **backend)
+{
+	struct ioloop *loop;
+
+	*backend = "blocking";
+
+	if (mode == MODE_READ) {
+		vameter_read_blocked(meter, true);
+
+		while (running(self)) {
+			if (read_once(self) <= 0)
+				return -1;
+		}
+
+		return 0;
+	}
+
+	loop = ioloop_create(1, mode == MODE_URING ? IOLOOP_URING : IOLOOP_POLL);
+
+	if (loop == NULL || ioloop_add(loop, meter->port, process, self)) {
+		ioloop_destroy(loop);
+		return -1;
+	}
+
+	*backend = ioloop_backend_name(loop);
+
+	while (running(self) && ioloop_active(loop)) {
+		if (ioloop_run_once(loop, 100) < 0) {
+			ioloop_destroy(loop);
+			return -1;
+		}
+	}
+
+	ioloop_destroy(loop);
+
+	return 0;
+}
+
+static char *help =
+	"Usage: %s [-m read|poll|uring] [-n frames] [-p period_us] [-o report]\n\n"
+	"Injects VAmeter frames into a pty and measures latency distribution\n"
+	"of the read wakeup, parser and consumer callback for each frame.\n\n"
+	" -m acquisition mode, blocking read (default), poll or io_uring loop\n"
+	" -n number of frames, default 10000\n"
+	" -p frame period in us, default 1000\n"
+	" -o append report to file instead of printing it\n"
+	" -h prints this help\n";
+
+static void print_help(const char *name, int ret)
+{
+	fprintf(stderr, help, name);
+
+	exit(ret);
+}
+
+int main(int argc, char *argv[])
+{
+	struct harness self;
+	struct VAmeter *meter;
+	pthread_t thread;
+	enum mode mode = MODE_READ;
+	const char *output = NULL, *backend;
+	char slave[64];
+	FILE *f = stdout;
+	int opt, ret;
+
+	memset(&self, 0, sizeof(self));
+	self.frames    = 10000;
+	self.period_ns = 1000000;
+
+	while ((opt = getopt(argc, argv, "hm:n:o:p:")) != -1) {
+		switch (opt) {
+			case 'm':
+				for (mode = 0; mode <= MODE_URING; mode++)
+					if (!strcmp(optarg, mode_names[mode]))
+						break;
+
+				if (mode > MODE_URING)
+					print_help(argv[0], 1);
+			break;
+			case 'n':
+				self.frames = atoi(optarg);
+			break;
+			case 'o':
+				output = optarg;
+			break;
+			case 'p':
+				self.period_ns = atol(optarg) * 1000ull;
+			break;
+			case 'h':
+				print_help(argv[0], 0);
+			break;
+			default:
+				print_help(argv[0], 1);
+		}
+	}
+
+	if (self.frames == 0 || self.period_ns == 0)
+		print_help(argv[0], 1);
+
+	self.inject = calloc(self.frames, sizeof(uint64_t));
+	self.wakeup = calloc(self.frames, sizeof(uint64_t));
+	self.parsed = calloc(self.frames, sizeof(uint64_t));
+	self.done   = calloc(self.frames, sizeof(uint64_t));
+
+	if (!self.inject || !self.wakeup || !self.parsed || !self.done) {
+		perror("calloc");
+		return 1;
+	}
+
+	self.master = open_pty(slave, sizeof(slave));
+
+	if (self.master < 0) {
+		perror("pty");
+		return 1;
+	}
+
+	meter = vameter_init_ops(slave, &ops, &self);
+	self.meter = meter;
+
+	if (meter == NULL) {
+		fprintf(stderr, "%s: %s\n", slave, strerror(errno));
+		return 1;
+	}
+
+	/* the pty number is not a device, don't cache its references */
+	vameter_ref_cache(meter, NULL);
+
+	if ((errno = pthread_create(&thread, NULL, writer, &self))) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	ret = run(&self, meter, mode, &backend);
+
+	if (ret)
+		fprintf(stderr, "%s: %s\n", mode_names[mode], strerror(errno));
+
+	pthread_join(thread, NULL);
+
+	vameter_exit(meter);
+	close(self.master);
+
+	if (output != NULL && (f = fopen(output, "a")) == NULL) {
+		fprintf(stderr, "%s: %s\n", output, strerror(errno));
+		return 1;
+	}
+
+	report(f, &self, mode, backend);
+
+	if (f != stdout)
+		fclose(f);
+
+	return ret ? 1 : 0;
+}
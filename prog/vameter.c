@@ -27,85 +27,184 @@
 #include <signal.h>
 
 #include "libvameter.h"
-
-static char volt_range[64];
-static char curr_range[64];
-static int nr_samples = -1;
-
-static void voltage_range(uint8_t range, const char *str_range)
+#include "libjoin.h"
+#include "libresample.h"
+#include "libioloop.h"
+
+/*
+ * Output state passed as ctx to the meter callbacks.
+ */
+struct output {
+	char volt_range[64];
+	char curr_range[64];
+	int nr_samples;
+	struct join join;
+	struct resample resample;
+	struct vameter_listener resample_listener;
+};
+
+static void voltage_range(struct VAmeter *meter, void *ctx, uint8_t range,
+                          const char *str_range)
 {
+	struct output *out = ctx;
+
+	(void) meter;
 	(void) range;
-	snprintf(volt_range, 64, " (%s)", str_range);
+	snprintf(out->volt_range, 64, " (%s)", str_range);
 }
 
-static void current_range(uint8_t hw_switch, uint8_t range, const char *str_range)
+static void current_range(struct VAmeter *meter, void *ctx, uint8_t hw_switch,
+                          uint8_t range, const char *str_range)
 {
+	struct output *out = ctx;
+
+	(void) meter;
 	(void) range;
 	(void) hw_switch;
-	snprintf(curr_range, 64, " (%s)", str_range);
+	snprintf(out->curr_range, 64, " (%s)", str_range);
 }
 
-static void voltage_sample_raw(char acdc, float val)
+static void voltage_sample_raw(struct VAmeter *meter, void *ctx,
+                               char acdc, float val)
 {
-	printf("%c%fV%s\n", acdc, val, volt_range);
+	struct output *out = ctx;
+
+	(void) meter;
+	printf("%c%fV%s\n", acdc, val, out->volt_range);
 	
 	fflush(stdout);
 	
-	if (nr_samples > 0)
-		nr_samples--;
+	if (out->nr_samples > 0)
+		out->nr_samples--;
 	//todo else exit
 }
 
-static void current_sample_raw(char acdc, float val)
+static void current_sample_raw(struct VAmeter *meter, void *ctx,
+                               char acdc, float val)
 {
-	printf("%c%fA%s\n", acdc, val, curr_range);
+	struct output *out = ctx;
+
+	(void) meter;
+	printf("%c%fA%s\n", acdc, val, out->curr_range);
 	fflush(stdout);
 	
-	if (nr_samples > 0)
-		nr_samples--;
+	if (out->nr_samples > 0)
+		out->nr_samples--;
 	//todo else exit
 }
 
-static void voltage_sample(char acdc, float val)
+static void voltage_sample(struct VAmeter *meter, void *ctx,
+                           char acdc, float val)
 {	
+	struct output *out = ctx;
+
+	(void) meter;
+
 	if (val < 1) {
-		printf("%c%.0fmV%s\n", acdc, val*1000, volt_range);
+		printf("%c%.0fmV%s\n", acdc, val*1000, out->volt_range);
 		fflush(stdout);
 		return;
 	}
 
 	if (val < 10) {
-		printf("%c%.2fV%s\n", acdc, val, volt_range);
+		printf("%c%.2fV%s\n", acdc, val, out->volt_range);
 		fflush(stdout);
 		return;
 	}
 
-	printf("%c%.1fV%s\n", acdc, val, volt_range);
+	printf("%c%.1fV%s\n", acdc, val, out->volt_range);
 	fflush(stdout);
 	
-	if (nr_samples > 0)
-		nr_samples--;
+	if (out->nr_samples > 0)
+		out->nr_samples--;
 }
 
-static void current_sample(char acdc, float val)
+static void current_sample(struct VAmeter *meter, void *ctx,
+                           char acdc, float val)
 {
+	struct output *out = ctx;
+
+	(void) meter;
+
 	if (val < 1) {
-		printf("%c%.0fmA%s\n", acdc, val*1000, curr_range);
+		printf("%c%.0fmA%s\n", acdc, val*1000, out->curr_range);
 		fflush(stdout);
 		return;
 	}
 
 	if (val < 10) {
-		printf("%c%.2fA%s\n", acdc, val, curr_range);
+		printf("%c%.2fA%s\n", acdc, val, out->curr_range);
 		fflush(stdout);
 		return;
 	}
 
-	printf("%c%.1fA\n%s", acdc, val, curr_range);
+	printf("%c%.1fA\n%s", acdc, val, out->curr_range);
 	fflush(stdout);
 	
-	if (nr_samples > 0)
-		nr_samples--;
+	if (out->nr_samples > 0)
+		out->nr_samples--;
+}
+
+static void voltage_frame_join(struct VAmeter *meter, void *ctx,
+                               const struct vameter_sample *s)
+{
+	struct output *out = ctx;
+
+	(void) meter;
+	join_push(&out->join, 0, s->t, s->rms);
+}
+
+static void current_frame_join(struct VAmeter *meter, void *ctx,
+                               const struct vameter_sample *s)
+{
+	struct output *out = ctx;
+
+	(void) meter;
+	join_push(&out->join, 1, s->t, s->rms);
+}
+
+static void join_record(struct join *self, const struct join_record *rec)
+{
+	(void) self;
+
+	if (rec->valid != 0x03)
+		return;
+
+	printf("%.6f %f %f\n", rec->t / 1000000000.0, rec->val[0], rec->val[1]);
+	fflush(stdout);
+}
+
+static void voltage_frame_resample(struct VAmeter *meter, void *ctx,
+                                   const struct vameter_sample *s)
+{
+	struct output *out = ctx;
+
+	(void) meter;
+	resample_push(&out->resample, 0, s->t, s->rms);
+}
+
+static void current_frame_resample(struct VAmeter *meter, void *ctx,
+                                   const struct vameter_sample *s)
+{
+	struct output *out = ctx;
+
+	(void) meter;
+	resample_push(&out->resample, 1, s->t, s->rms);
+}
+
+static const struct vameter_ops resample_ops = {
+	.voltage_frame = voltage_frame_resample,
+	.current_frame = current_frame_resample,
+};
+
+static void resample_record(struct resample *self,
+                            const struct resample_record *rec)
+{
+	(void) self;
+
+	printf("%.3f %f %f\n", rec->t / 1000000000.0, rec->chan[0].val,
+	       rec->chan[1].val);
+	fflush(stdout);
 }
 
 static char *help = 
@@ -116,6 +215,14 @@ static char *help =
 	" -v print voltage\n"
 	" -r print raw data\n"
 	" -n print number of samples\n"
+	" -j print time aligned voltage and current\n"
+	" -R ms print voltage and current averaged over fixed ms intervals\n"
+	" -e integrate energy, totals are kept in file (SIGUSR1 prints and saves them)\n"
+	" -E s energy checkpoint period in seconds, default 60\n"
+	" -x export OpenMetrics on localhost port or unix socket path\n"
+	" -p publish frames into shared memory ring, i.e. /vameter (see ringcat)\n"
+	" -u read through the I/O loop (io_uring when available)\n"
+	" -s print parser and serial port statistics on exit\n"
 	" -h prints this help\n"
 
 	"\nWritten by (bugs to):\n"
@@ -129,6 +236,7 @@ static void print_help(const char *name, int ret)
 }
 
 static int ready = 1;
+static volatile sig_atomic_t print_energy = 0;
 
 static void sighandler(int signum)
 {
@@ -136,14 +244,104 @@ static void sighandler(int signum)
 	ready = 0;
 }
 
+static void sigusr1(int signum)
+{
+	(void) signum;
+	print_energy = 1;
+}
+
+static void hist_print(const char *name, const struct stats_hist *hist, FILE *f)
+{
+	unsigned int i;
+
+	fprintf(f, "%s:", name);
+
+	for (i = 0; i < STATS_HIST_SIZE; i++)
+		if (hist->bucket[i])
+			fprintf(f, " %llu:%llu", (unsigned long long)stats_bucket_min(i),
+			        (unsigned long long)hist->bucket[i]);
+
+	fprintf(f, "\n");
+}
+
+static void stats_print(struct VAmeter *meter, FILE *f)
+{
+	static const char *frames[] = {
+		"V range", "V zero", "V ref", "V sample",
+		"A range", "A zero", "A ref", "A sample",
+	};
+	struct vameter_stats stats;
+	struct libserial_stats port;
+	unsigned int i;
+
+	vameter_get_stats(meter, &stats);
+	libserial_get_stats(meter->port, &port);
+
+	fprintf(f, "reads %llu bytes %llu errors %llu again %llu\n",
+	        (unsigned long long)port.reads, (unsigned long long)port.bytes,
+	        (unsigned long long)port.errors, (unsigned long long)port.again);
+
+	for (i = 0; i < VAMETER_FRAME_TYPES; i++)
+		fprintf(f, "%s frames %llu\n", frames[i],
+		        (unsigned long long)stats.frames[i]);
+
+	fprintf(f, "range changes %llu resync %llu unknown %llu invalid range %llu truncated %llu\n",
+	        (unsigned long long)stats.range_changes, (unsigned long long)stats.resync,
+	        (unsigned long long)stats.unknown, (unsigned long long)stats.invalid_range,
+	        (unsigned long long)stats.truncated);
+
+	fprintf(f, "callback time %lluus\n", (unsigned long long)stats.callback_ns / 1000);
+
+	hist_print("bytes per read", &port.read_bytes, f);
+	hist_print("voltage frame interval us", &stats.voltage_interval, f);
+	hist_print("current frame interval us", &stats.current_interval, f);
+}
+
+static void loop_stats_print(struct VAmeter *meter, struct ioloop *loop, FILE *f)
+{
+	struct vameter_stats stats;
+	uint64_t frames = 0;
+	unsigned int i;
+
+	vameter_get_stats(meter, &stats);
+
+	for (i = 0; i < VAMETER_FRAME_TYPES; i++)
+		frames += stats.frames[i];
+
+	fprintf(f, "%s loop waits %llu syscalls %llu completions %llu",
+	        ioloop_backend_name(loop), (unsigned long long)loop->stats.waits,
+	        (unsigned long long)loop->stats.syscalls,
+	        (unsigned long long)loop->stats.completions);
+
+	if (frames)
+		fprintf(f, " (%.2f syscalls per frame)",
+		        (double)loop->stats.syscalls / frames);
+
+	fprintf(f, "\n");
+}
+
+static void energy_print(struct vameter_energy *energy, FILE *f)
+{
+	fprintf(f, "%.3fW %.6fWh %.6fAh %.0fs\n", energy->power, energy->energy,
+	        energy->charge, energy->seconds);
+	fflush(f);
+}
+
 int main(int argc, char *argv[])
 {
 	struct VAmeter *meter;
+	struct vameter_ops ops = {};
+	struct output out = {.nr_samples = -1};
 	int opt;
-	char *dev = NULL, *callib = NULL;
+	char *dev = NULL, *callib = NULL, *energy = NULL, *export = NULL;
+	char *publish = NULL;
+	struct exporter *exp = NULL;
+	struct ioloop *loop = NULL;
 	int ret, raw = 0, p_volt = 0, p_curr = 0, p_vrange = 0, p_crange = 0;
+	int p_join = 0, p_stats = 0, use_loop = 0, resample_ms = 0;
+	unsigned int energy_period = 60;
 
-	while ((opt = getopt(argc, argv, "Aac:d:hn:rVv")) != -1) {
+	while ((opt = getopt(argc, argv, "Aac:d:E:e:hjn:p:R:rsuVvx:")) != -1) {
 		switch (opt) {
 			case 'd':
 				dev = optarg;
@@ -170,14 +368,38 @@ int main(int argc, char *argv[])
 				raw = 1;
 			break;
 			case 'n':
-				nr_samples = atoi(optarg);
+				out.nr_samples = atoi(optarg);
+			break;
+			case 'j':
+				p_join = 1;
+			break;
+			case 'R':
+				resample_ms = atoi(optarg);
+			break;
+			case 'e':
+				energy = optarg;
+			break;
+			case 'E':
+				energy_period = atoi(optarg);
+			break;
+			case 'x':
+				export = optarg;
+			break;
+			case 'p':
+				publish = optarg;
+			break;
+			case 's':
+				p_stats = 1;
+			break;
+			case 'u':
+				use_loop = 1;
 			break;
 			default:
 				print_help(argv[0], 1);
 		}
 	}
 	
-	nr_samples *= (p_volt + p_curr);
+	out.nr_samples *= (p_volt + p_curr);
 
 	if (optind < argc || dev == NULL)
 		print_help(argv[0], 1);
@@ -189,7 +411,10 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	evlog_sink(&meter->port->log, evlog_stderr, NULL);
+
 	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
 
 	if (callib != NULL)
 		if ((ret = vameter_load_callib(meter, callib)) < 0) {
@@ -200,42 +425,143 @@ int main(int argc, char *argv[])
 		}
 
 	if (p_vrange)
-		meter->voltage_range = voltage_range;
+		ops.voltage_range = voltage_range;
 
 	if (p_crange)
-		meter->current_range = current_range;
+		ops.current_range = current_range;
 
 	if (p_volt) {
 		if (raw)
-			meter->voltage_sample = voltage_sample_raw;
+			ops.voltage_sample = voltage_sample_raw;
 		else
-			meter->voltage_sample = voltage_sample;
+			ops.voltage_sample = voltage_sample;
 	}
 
 	if (p_curr) {
 		if (raw)
-			meter->current_sample = current_sample_raw;
+			ops.current_sample = current_sample_raw;
 		else
-			meter->current_sample = current_sample;
+			ops.current_sample = current_sample;
+	}
+
+	if (energy != NULL) {
+		if (vameter_energy_start(meter, energy, energy_period)) {
+			fprintf(stderr, "Cannot start energy integration\n");
+			vameter_exit(meter);
+			return 1;
+		}
+		signal(SIGUSR1, sigusr1);
+	}
+
+	if (export != NULL) {
+		exp = exporter_create(export);
+
+		if (exp == NULL || vameter_export(meter, exp)) {
+			fprintf(stderr, "Cannot export to %s: %s\n", export, strerror(errno));
+			exporter_destroy(exp);
+			vameter_exit(meter);
+			return 1;
+		}
+	}
+
+	if (publish != NULL && vameter_publish(meter, publish, 4096)) {
+		fprintf(stderr, "Cannot publish to %s: %s\n", publish, strerror(errno));
+		exporter_destroy(exp);
+		vameter_exit(meter);
+		return 1;
+	}
+
+	if (p_join) {
+		join_init(&out.join, 2, JOIN_INTERPOLATE, join_record, NULL);
+		ops.voltage_frame = voltage_frame_join;
+		ops.current_frame = current_frame_join;
+	}
+
+	vameter_set_ops(meter, &ops, &out);
+
+	/* frames of one meter come in time order, no need to hold intervals */
+	if (resample_ms > 0) {
+		resample_init(&out.resample, 2, resample_ms * 1000000ull, 0,
+		              resample_record, NULL);
+		vameter_listen(meter, &out.resample_listener, &resample_ops, &out);
 	}
 
-	while (ready) {
+	if (use_loop) {
+		loop = ioloop_create(1, IOLOOP_AUTO);
+
+		if (loop == NULL || ioloop_add_vameter(loop, meter)) {
+			fprintf(stderr, "Cannot create I/O loop: %s\n", strerror(errno));
+			ioloop_destroy(loop);
+			vameter_exit(meter);
+			return 1;
+		}
+	}
+
+	while (loop != NULL && ready && ioloop_active(loop)) {
+		if (ioloop_run_once(loop, exp != NULL ? 100 : -1) < 0) {
+			fprintf(stderr, "Error reading from device: %s\n", strerror(errno));
+			break;
+		}
+
+		if (exp != NULL)
+			exporter_poll(exp);
+
+		if (meter->energy != NULL)
+			energy_poll(meter->energy);
+
+		if (print_energy && meter->energy != NULL) {
+			print_energy = 0;
+			energy_print(meter->energy, stdout);
+			energy_checkpoint(meter->energy);
+		}
+	}
+
+	while (loop == NULL && ready) {
 		int ret;
 
+		if (exp != NULL && !exporter_wait(exp, vameter_get_fd(meter)))
+			continue;
+
 		if ((ret = vameter_read(meter)) < 0) {
-			/* end of file*/
-			if (ret == 0)
-				return 0;
-			
-			if (nr_samples == 0)
-				return 0;
+			/* requested number of samples printed */
+			if (out.nr_samples == 0)
+				break;
 
 			fprintf(stderr, "Error reading from device: %s\n", strerror(errno)); 
+
+			if (p_join)
+				join_flush(&out.join);
+
 			vameter_exit(meter);
 			return 1;
 		}
+
+		if (print_energy && meter->energy != NULL) {
+			print_energy = 0;
+			energy_print(meter->energy, stdout);
+			energy_checkpoint(meter->energy);
+		}
 	}
 
+	if (resample_ms > 0)
+		resample_flush(&out.resample);
+
+	/* interpolated records still wait for the next value of the other channel */
+	if (p_join)
+		join_flush(&out.join);
+
+	if (meter->energy != NULL)
+		energy_print(meter->energy, stderr);
+
+	if (p_stats)
+		stats_print(meter, stderr);
+
+	if (p_stats && loop != NULL)
+		loop_stats_print(meter, loop, stderr);
+
+	ioloop_destroy(loop);
+
 	vameter_exit(meter);
+	exporter_destroy(exp);
 	return 0;
 }
@@ -23,14 +23,40 @@
 #include <math.h>
 #include <errno.h>
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "libvameter.h"
 
 static GtkWidget *current_label, *voltage_label;
 static GtkWidget *current_range_label, *voltage_range_label;
+static GtkWidget *energy_label;
 static struct VAmeter *meter;
 
+/* energy totals are kept in this file across restarts */
+static gchar *energy_file;
+
+/*
+ * When VAMETER_GTK_LABEL_LOG is set, a line with the frame time and the
+ * times before and after gtk_label_set_text() of the voltage label is
+ * written there for every frame, all CLOCK_MONOTONIC ns. This is the label
+ * stage that valatency cannot measure without gtk.
+ */
+static FILE *label_log;
+
+static void label_stamp(uint64_t t_set)
+{
+	struct vameter_snapshot snap;
+	uint64_t t_done = libserial_time();
+
+	vameter_get_snapshot(meter, &snap);
+
+	fprintf(label_log, "%llu %llu %llu\n", (unsigned long long)snap.voltage_t,
+	        (unsigned long long)t_set, (unsigned long long)t_done);
+}
+
 static void voltage_sample(char acdc, float sample)
 {
+	uint64_t t_set = 0;
 	char buf[20];
 	
 	buf[0] = acdc;
@@ -43,7 +69,13 @@ static void voltage_sample(char acdc, float sample)
 		snprintf(buf + 1, 19, "%.3fV", sample);
 	}
 
+	if (label_log != NULL)
+		t_set = libserial_time();
+
 	gtk_label_set_text (GTK_LABEL (voltage_label), (gchar*) buf);
+
+	if (label_log != NULL)
+		label_stamp(t_set);
 }
 
 static void current_sample(char acdc, float sample)
@@ -61,6 +93,16 @@ static void current_sample(char acdc, float sample)
 	}
 	
 	gtk_label_set_text(GTK_LABEL(current_label), buf);
+
+	/* energy is updated before the current callback is called */
+	if (meter != NULL && meter->energy != NULL) {
+		char ebuf[64];
+
+		snprintf(ebuf, sizeof(ebuf), "%.3fW  %.4fWh  %.4fAh",
+		         meter->energy->power, meter->energy->energy,
+		         meter->energy->charge);
+		gtk_label_set_text(GTK_LABEL(energy_label), ebuf);
+	}
 }
 
 static void voltage_range(uint8_t range, const char *str_range)
@@ -82,6 +124,8 @@ static void setup_vameter(struct VAmeter *meter)
 	meter->current_sample = current_sample;
 	meter->voltage_range  = voltage_range;
 	meter->current_range  = current_range;
+
+	vameter_energy_start(meter, energy_file, 60);
 }
 
 /*
@@ -209,9 +253,10 @@ static GtkWidget *CreateVAmeter(void)
 	GtkWidget *table;
 	GtkWidget *voltage_frame, *current_frame;
 	GtkWidget *voltage_range_frame, *current_range_frame;
+	GtkWidget *energy_frame;
 	PangoFontDescription *initial_font;
 	
-	table = gtk_table_new (2, 2, TRUE);
+	table = gtk_table_new (3, 2, TRUE);
 
 	voltage_frame = gtk_frame_new ("Voltage");
 	current_frame = gtk_frame_new ("Current");
@@ -244,6 +289,11 @@ static GtkWidget *CreateVAmeter(void)
 	gtk_table_attach_defaults(GTK_TABLE (table), voltage_range_frame, 0, 1, 1, 2);
 	gtk_table_attach_defaults(GTK_TABLE (table), current_range_frame, 1, 2, 1, 2);
 
+	energy_frame = gtk_frame_new ("Power / Energy / Charge");
+	energy_label = gtk_label_new ("---");
+	gtk_container_add(GTK_CONTAINER (energy_frame), energy_label);
+	gtk_table_attach_defaults(GTK_TABLE (table), energy_frame, 0, 2, 2, 3);
+
 	gtk_table_set_row_spacings(GTK_TABLE (table), 5);
 	gtk_table_set_col_spacings(GTK_TABLE (table), 5);
 
@@ -256,6 +306,24 @@ int main(int argc, char *argv[])
 	GtkWidget *window, *vbox;
 
 	gtk_init(&argc, &argv);
+
+	if (argc > 1) {
+		energy_file = g_strdup(argv[1]);
+	} else {
+		gchar *dir = g_build_filename(g_get_home_dir(), ".usb-instruments", NULL);
+
+		g_mkdir_with_parents(dir, 0755);
+		energy_file = g_build_filename(dir, "energy", NULL);
+		g_free(dir);
+	}
+
+	if (getenv("VAMETER_GTK_LABEL_LOG") != NULL) {
+		label_log = fopen(getenv("VAMETER_GTK_LABEL_LOG"), "w");
+
+		if (label_log == NULL)
+			perror("VAMETER_GTK_LABEL_LOG");
+	}
+
 	window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	gtk_window_set_title(GTK_WINDOW(window), "VAmeter");
 	